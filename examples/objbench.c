@@ -0,0 +1,100 @@
+/**
+ * \file objbench.c
+ * Micro-benchmark for the object cache: inserts, looks up and removes
+ * a large number of handles the way a device hands them out.
+ *
+ * The object cache is internal to libmtp, so ptp.c is built right into
+ * this program rather than linked from the library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "ptp.c"
+
+#include <time.h>
+
+#define DEFAULT_OBJECTS 400000
+
+/* Normally provided by libmtp.c, which is not built in */
+void ptp_nikon_getptpipguid (unsigned char* guid)
+{
+  memset(guid, 0, 16);
+}
+
+/*
+ * The i:th handle in device order: two storages interleaved, each
+ * handing out its handles in scattered order, like after years of
+ * adding and deleting files.
+ */
+static uint32_t device_handle(unsigned int i, unsigned int n)
+{
+  unsigned int j = (unsigned int) (((uint64_t) i * 7919) % n);
+
+  return ((j & 1) ? 0x20000000U : 0x10000000U) + (j >> 1) + 1;
+}
+
+static double seconds(clock_t start)
+{
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+  PTPParams params;
+  PTPObject *ob;
+  unsigned int n = DEFAULT_OBJECTS;
+  unsigned int i;
+  clock_t start;
+
+  if (argc > 1)
+    n = strtoul(argv[1], NULL, 0);
+  /* The permutation above needs n and 7919 to be coprime */
+  if (!n || n % 7919 == 0) {
+    fprintf(stderr, "usage: %s [number of objects, not a multiple of 7919]\n", argv[0]);
+    return 1;
+  }
+  memset(&params, 0, sizeof(params));
+
+  start = clock();
+  for (i = 0; i < n; i++) {
+    if (ptp_object_find_or_insert(&params, device_handle(i, n), &ob) != PTP_RC_OK) {
+      fprintf(stderr, "insert failed at %u\n", i);
+      return 1;
+    }
+    ob->oi.ParentObject = i % 100;
+    ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+  }
+  printf("insert %u objects: %.3fs\n", n, seconds(start));
+
+  start = clock();
+  for (i = 0; i < n; i++)
+    if (ptp_object_find(&params, device_handle(n - 1 - i, n), &ob) != PTP_RC_OK) {
+      fprintf(stderr, "lookup failed at %u\n", i);
+      return 1;
+    }
+  printf("look up %u objects: %.3fs\n", n, seconds(start));
+
+  start = clock();
+  for (i = 0; i < n; i += 3)
+    ptp_remove_object_from_cache(&params, device_handle(i, n));
+  printf("remove every third object: %.3fs\n", seconds(start));
+
+  start = clock();
+  ptp_objects_sort(&params);
+  printf("sort %u objects: %.3fs\n", params.nrofobjects, seconds(start));
+
+  ptp_free_params(&params);
+  return 0;
+}
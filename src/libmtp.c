@@ -41,6 +41,7 @@
 #include "libusb-glue.h"
 #include "device-flags.h"
 #include "playlist-spl.h"
+#include "metadata-cache.h"
 #include "util.h"
 
 #include "mtpz.h"
@@ -56,6 +57,9 @@ int use_mtpz;
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef _MSC_VER // For MSVC++
 #define USE_WINDOWS_IO_H
 #include <io.h>
@@ -88,6 +92,12 @@ int use_mtpz;
  */
 int LIBMTP_debug = LIBMTP_DEBUG_NONE;
 
+/*
+ * Where to keep the metadata of opened devices across sessions,
+ * NULL (the default) for nowhere, see LIBMTP_Set_Metadata_Cache().
+ */
+static char *metadata_cache_dir = NULL;
+
 
 /*
  * This is a mapping between libmtp internal MTP filetypes and
@@ -121,6 +131,7 @@ typedef struct propertymap_struct {
  * for parsing onwards to the usb_event_async function.
  */
 typedef struct event_cb_data_struct {
+  LIBMTP_mtpdevice_t *device;
   LIBMTP_event_cb_fn cb;
   void *user_data;
 } event_cb_data_t;
@@ -147,6 +158,11 @@ static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 					uint16_t ptp_error,
 					char const * const error_text);
 static void flush_handles(LIBMTP_mtpdevice_t *device);
+static void fix_up_handles(LIBMTP_mtpdevice_t *device);
+static int refresh_storage(LIBMTP_mtpdevice_t *device, uint32_t storageid);
+static uint16_t load_folder(LIBMTP_mtpdevice_t *device, uint32_t storageid,
+			    uint32_t parent);
+static void fill_cache(LIBMTP_mtpdevice_t *device);
 static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
 				    PTPParams *params,
 				    uint32_t storageid,
@@ -190,7 +206,9 @@ static int set_object_u8(LIBMTP_mtpdevice_t *device, uint32_t const object_id,
 			 uint16_t const attribute_id, uint8_t const value);
 static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
 			       LIBMTP_track_t *track);
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent);
+static LIBMTP_folder_t *get_subfolders_for_folder(PTPParams *params,
+						  uint32_t storage,
+						  uint32_t parent);
 static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 				    char const * const name,
 				    char const * const artist,
@@ -221,8 +239,10 @@ static int set_object_filename(LIBMTP_mtpdevice_t *device,
                 const char **newname);
 static char *generate_unique_filename(PTPParams* params, char const * const filename);
 static int check_filename_exists(PTPParams* params, char const * const filename);
-static void LIBMTP_Handle_Event(PTPContainer *ptp_event,
+static void LIBMTP_Handle_Event(LIBMTP_mtpdevice_t *device,
+                                PTPContainer *ptp_event,
                                 LIBMTP_event_t *event, uint32_t *out1);
+static void apply_cache_events(LIBMTP_mtpdevice_t *device);
 
 /**
  * These are to wrap the get/put handlers to convert from the MTP types to PTP types
@@ -796,6 +816,40 @@ void LIBMTP_Init(void)
   return;
 }
 
+/**
+ * Keep the metadata of devices opened with
+ * <code>LIBMTP_Open_Raw_Device()</code> in a cache file in the given
+ * directory, one per device serial number. When a device is opened
+ * again, and each of its storages still reports the same capacity,
+ * free space and number of objects as when the file was written, the
+ * metadata is loaded from there instead of being read from the device
+ * object by object, which can take a minute on a full device.
+ *
+ * Changes that leave the storage figures alone, like a file being
+ * renamed on the device itself, go unnoticed. Only use this where
+ * that is acceptable.
+ *
+ * The cache file is written after the device has been scanned and
+ * again when it is released.
+ *
+ * @param directory an existing directory writable by the process,
+ *        or NULL to turn the cache off, which is the default.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Metadata_Cache(char const * const directory)
+{
+  char *dir = NULL;
+
+  if (directory != NULL) {
+    dir = strdup(directory);
+    if (dir == NULL)
+      return -1;
+  }
+  free(metadata_cache_dir);
+  metadata_cache_dir = dir;
+  return 0;
+}
+
 
 /**
  * This helper function returns a textual description for a libmtp
@@ -1837,14 +1891,15 @@ static void parse_extension_descriptor(LIBMTP_mtpdevice_t *mtpdevice,
 }
 
 /**
- * This function opens a device from a raw device. It is the
- * preferred way to access devices in the new interface where
- * several devices can come and go as the library is working
- * on a certain device.
+ * Opens a device without an object cache, see
+ * <code>LIBMTP_Open_Raw_Device_Uncached()</code>.
  * @param rawdevice the raw device to open a "real" device for.
- * @return an open device.
+ * @param error takes why the device could not be opened, or
+ *        <code>LIBMTP_ERROR_NONE</code>.
+ * @return an open device, or NULL.
  */
-LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
+static LIBMTP_mtpdevice_t *open_raw_device(LIBMTP_raw_device_t *rawdevice,
+					   LIBMTP_error_number_t *error)
 {
   LIBMTP_mtpdevice_t *mtp_device;
   uint8_t bs = 0;
@@ -1865,6 +1920,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 	    "allocation error with device %d on bus %d, trying to continue",
 	    rawdevice->devnum, rawdevice->bus_location);
 
+    *error = LIBMTP_ERROR_MEMORY_ALLOCATION;
     return NULL;
   }
   memset(mtp_device, 0, sizeof(LIBMTP_mtpdevice_t));
@@ -1875,6 +1931,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   current_params = (PTPParams *) malloc(sizeof(PTPParams));
   if (current_params == NULL) {
     free(mtp_device);
+    *error = LIBMTP_ERROR_MEMORY_ALLOCATION;
     return NULL;
   }
   memset(current_params, 0, sizeof(PTPParams));
@@ -1901,6 +1958,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 	    "Too old stdlibc, glibc and libiconv?\n");
     free(current_params);
     free(mtp_device);
+    *error = LIBMTP_ERROR_GENERAL;
     return NULL;
   }
 #endif
@@ -1913,6 +1971,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   if (err != LIBMTP_ERROR_NONE) {
     free(current_params);
     free(mtp_device);
+    *error = err;
     return NULL;
   }
   ptp_usb = (PTP_USB*) mtp_device->usbinfo;
@@ -1931,6 +1990,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
     free(mtp_device->params);
     current_params = NULL;
     free(mtp_device);
+    *error = LIBMTP_ERROR_CONNECTING;
     return NULL;
   }
 
@@ -2121,12 +2181,90 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   }
 
 
+  *error = LIBMTP_ERROR_NONE;
   return mtp_device;
 }
 
-LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
+/**
+ * This function opens a device from a raw device. It is the
+ * preferred way to access devices in the new interface where
+ * several devices can come and go as the library is working
+ * on a certain device.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
+{
+  LIBMTP_error_number_t err;
+
+  return open_raw_device(rawdevice, &err);
+}
+
+/*
+ * Progress of the object listing while a device is being opened, see
+ * LIBMTP_Open_Raw_Device_With_Progress(). It hangs off the transfer
+ * callback of the device for as long as the listing runs.
+ */
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_openprogressfunc_t callback;
+  void const *data;
+  int timeout; /* For the listing of all objects, 0 for the default */
+  int cancelled;
+} open_progress_t;
+
+static int open_progress_transfer(uint64_t const sent, uint64_t const total,
+				  void const * const data)
+{
+  open_progress_t *progress = (open_progress_t *) data;
+  PTPParams *params = (PTPParams *) progress->device->params;
+
+  if (!progress->cancelled &&
+      progress->callback(sent, params->nrofobjects, progress->data) != 0)
+    progress->cancelled = 1;
+  return progress->cancelled;
+}
+
+/* The progress of the device being opened, if any */
+static open_progress_t *get_open_progress(LIBMTP_mtpdevice_t *device)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  if (ptp_usb->current_transfer_callback != open_progress_transfer)
+    return NULL;
+  return (open_progress_t *) ptp_usb->current_transfer_callback_data;
+}
+
+/**
+ * Reports the progress of the object listing while a device is being
+ * opened, between transactions.
+ * @param device a pointer to the MTP device.
+ * @return non-zero if the listing has been cancelled.
+ */
+static int listing_cancelled(LIBMTP_mtpdevice_t *device)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  open_progress_t *progress = get_open_progress(device);
+
+  if (progress == NULL)
+    return 0;
+  return open_progress_transfer(ptp_usb->current_transfer_complete, 0,
+				progress);
+}
+
+/**
+ * Opens a device with an object cache, which is either filled with
+ * all objects right away or, if lazy, one folder at a time. If the
+ * listing of all objects is cancelled through the progress callback
+ * the device is opened lazily instead. Why the device could not be
+ * opened goes to error.
+ */
+static LIBMTP_mtpdevice_t *open_raw_device_cached(LIBMTP_raw_device_t *rawdevice,
+						  int lazy,
+						  open_progress_t *progress,
+						  LIBMTP_error_number_t *error)
 {
-  LIBMTP_mtpdevice_t *mtp_device = LIBMTP_Open_Raw_Device_Uncached(rawdevice);
+  LIBMTP_mtpdevice_t *mtp_device = open_raw_device(rawdevice, error);
 
   if (mtp_device == NULL)
     return NULL;
@@ -2156,10 +2294,170 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
    * This has the desired side effect of caching all handles from
    * the device which speeds up later operations.
    */
-  flush_handles(mtp_device);
+  if (metadata_cache_dir != NULL &&
+      metadata_cache_load(mtp_device, metadata_cache_dir) == 0) {
+    fix_up_handles(mtp_device);
+  } else if (lazy) {
+    ((PTPParams *) mtp_device->params)->objects_lazy = 1;
+    flush_handles(mtp_device);
+  } else if (progress != NULL) {
+    PTP_USB *ptp_usb = (PTP_USB*) mtp_device->usbinfo;
+
+    progress->device = mtp_device;
+    ptp_usb->callback_active = 1;
+    ptp_usb->current_transfer_total = UINT64_MAX; // Not known up front
+    ptp_usb->current_transfer_complete = 0;
+    ptp_usb->current_transfer_callback = open_progress_transfer;
+    ptp_usb->current_transfer_callback_data = progress;
+
+    flush_handles(mtp_device);
+
+    ptp_usb->callback_active = 0;
+    ptp_usb->current_transfer_callback = NULL;
+    ptp_usb->current_transfer_callback_data = NULL;
+
+    if (progress->cancelled) {
+      add_error_to_errorstack(mtp_device, LIBMTP_ERROR_CANCELLED,
+			      "Cancelled listing the objects, the device "
+			      "is listed one folder at a time instead.");
+      ((PTPParams *) mtp_device->params)->objects_lazy = 1;
+      flush_handles(mtp_device);
+    } else if (metadata_cache_dir != NULL) {
+      metadata_cache_save(mtp_device, metadata_cache_dir);
+    }
+  } else {
+    flush_handles(mtp_device);
+    if (metadata_cache_dir != NULL)
+      metadata_cache_save(mtp_device, metadata_cache_dir);
+  }
   return mtp_device;
 }
 
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
+{
+  LIBMTP_error_number_t err;
+
+  return open_raw_device_cached(rawdevice, 0, NULL, &err);
+}
+
+/**
+ * This function opens a device from a raw device like
+ * <code>LIBMTP_Open_Raw_Device()</code> does, but reports on the
+ * listing of the objects of the device as it goes along, and lets the
+ * application cancel it. The device is then listed one folder at a
+ * time, as if opened with <code>LIBMTP_Open_Raw_Device_Lazy()</code>,
+ * and <code>LIBMTP_ERROR_CANCELLED</code> is put on its error stack.
+ * Release the device if it is not wanted after all.
+ *
+ * Devices that list all objects in one go may think for a long time
+ * before they send anything. The timeout bounds that wait, after which
+ * the objects are listed some slower way instead.
+ *
+ * @param rawdevice the raw device to open a "real" device for.
+ * @param timeout the longest wait in milliseconds for the list of all
+ *        objects to come in, 0 for the default of 60 seconds.
+ * @param callback a progress function to be called during the listing,
+ *        returning non-zero from it cancels the listing. It is called
+ *        from the thread opening the device.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function.
+ * @return an open device.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_With_Progress(LIBMTP_raw_device_t *rawdevice,
+							  int const timeout,
+							  LIBMTP_openprogressfunc_t const callback,
+							  void const * const data)
+{
+  open_progress_t progress;
+  LIBMTP_error_number_t err;
+
+  if (callback == NULL)
+    return open_raw_device_cached(rawdevice, 0, NULL, &err);
+  progress.device = NULL;
+  progress.callback = callback;
+  progress.data = data;
+  progress.timeout = timeout;
+  progress.cancelled = 0;
+  return open_raw_device_cached(rawdevice, 0, &progress, &err);
+}
+
+/**
+ * This function opens a device from a raw device like
+ * <code>LIBMTP_Open_Raw_Device()</code> does, but only the root folders
+ * of the storages are read into the object cache at first. Any other
+ * folder is listed when it is first asked for, e.g. by
+ * <code>LIBMTP_Get_Files_And_Folders()</code> or
+ * <code>LIBMTP_Find_Object_By_Path()</code>, so a device with lots of
+ * files opens quickly. This suits file browser style applications.
+ *
+ * Operations that go through all objects of the device, like
+ * <code>LIBMTP_Get_Filelisting_With_Callback()</code> or
+ * <code>LIBMTP_Get_Folder_List()</code>, read in everything at that
+ * point, after which the device behaves as if opened with
+ * <code>LIBMTP_Open_Raw_Device()</code>. So does a device whose
+ * metadata cache could be loaded from disk.
+ *
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ * @see LIBMTP_Prefetch_Folders()
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Lazy(LIBMTP_raw_device_t *rawdevice)
+{
+  LIBMTP_error_number_t err;
+
+  return open_raw_device_cached(rawdevice, 1, NULL, &err);
+}
+
+/**
+ * Reads ahead into the object cache of a device opened with
+ * <code>LIBMTP_Open_Raw_Device_Lazy()</code>: lists some of the folders
+ * that are known but have not been listed yet, i.e. the subfolders and
+ * sibling folders of those that have been looked at, so that they
+ * open at once later. Call this when the application has nothing
+ * better to do with the device, with a small number of folders at a
+ * time so it stays responsive.
+ *
+ * @param device a pointer to the device to read ahead on.
+ * @param max_folders the largest number of folders to list.
+ * @return the number of folders listed, 0 when there is nothing left
+ *         to list, and -1 on failure.
+ */
+int LIBMTP_Prefetch_Folders(LIBMTP_mtpdevice_t *device, int const max_folders)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *handles;
+  unsigned int i, n = 0;
+  int loaded = 0;
+
+  if (!params->objects_lazy || max_folders <= 0)
+    return 0;
+
+  // Pick them first, listing them grows the cache
+  handles = malloc(max_folders * sizeof(uint32_t));
+  if (handles == NULL)
+    return -1;
+  for (i = 0; i < params->nrofobjects && n < (unsigned int) max_folders; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    if (PTPOBJECT_REMOVED(ob) ||
+	!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED) ||
+	ob->oi.ObjectFormat != PTP_OFC_Association ||
+	(ob->flags & PTPOBJECT_DIRECTORY_LOADED))
+      continue;
+    handles[n++] = ob->oid;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (load_folder(device, 0, handles[i]) != PTP_RC_OK) {
+      free(handles);
+      return -1;
+    }
+    loaded++;
+  }
+  free(handles);
+  return loaded;
+}
+
 /**
  * To read events sent by the device, repeatedly call this function from a secondary
  * thread until the return value is < 0.
@@ -2189,11 +2487,156 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
     /* Device is closing down or other fatal stuff, exit thread */
     return -1;
   }
-  LIBMTP_Handle_Event(&ptp_event, event, out1);
+  LIBMTP_Handle_Event(device, &ptp_event, event, out1);
+  apply_cache_events(device);
+  return 0;
+}
+
+/**
+ * Keep the object cache of a device in step with the objects being
+ * added, removed and changed as reported by its events, so that the
+ * changes show without a full rescan of the device. Each event costs
+ * at most fetching the metadata of the one object concerned. Storages
+ * being added or removed, such as memory cards, reload only the
+ * objects of that storage.
+ *
+ * The cache is updated when the event is read with
+ * <code>LIBMTP_Read_Event()</code>, so the application must see to it
+ * that the device is not used from another thread at that time. Events
+ * read with <code>LIBMTP_Read_Event_Async()</code> arrive in the middle
+ * of libusb event handling, where no transaction can be made, so they
+ * are only queued up there. The queue is applied by the next call of
+ * <code>LIBMTP_Read_Event_Async()</code> or of a function that looks
+ * at the object cache, such as <code>LIBMTP_Get_Filelisting()</code>.
+ *
+ * @param device a pointer to the device, which must have been opened
+ *        with <code>LIBMTP_Open_Raw_Device()</code>.
+ * @param enable non-zero to apply events to the cache, 0 (the default)
+ *        to leave it alone.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Event_Cache_Updates(LIBMTP_mtpdevice_t *device, int enable)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (!device->cached) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Event_Cache_Updates(): "
+			    "device has no object cache.");
+    return -1;
+  }
+  params->cache_events_enabled = enable ? 1 : 0;
+  if (!enable) {
+    free(params->cache_events);
+    params->cache_events = NULL;
+    params->nrofcache_events = 0;
+  }
   return 0;
 }
 
-void LIBMTP_Handle_Event(PTPContainer *ptp_event,
+/**
+ * Apply one object or storage event to the object cache.
+ */
+static void apply_cache_event(LIBMTP_mtpdevice_t *device,
+			      PTPContainer *ptp_event)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t handle = ptp_event->Param1;
+  PTPObject *ob;
+
+  switch (ptp_event->Code) {
+  case PTP_EC_ObjectAdded:
+    // Objects we created ourselves are in the cache already
+    if (ptp_object_find(params, handle, &ob) != PTP_RC_OK)
+      add_object_to_cache(device, handle);
+    break;
+  case PTP_EC_ObjectRemoved:
+    ptp_remove_object_from_cache(params, handle);
+    break;
+  case PTP_EC_ObjectInfoChanged:
+    // Refetch it, if we had it at all
+    if (ptp_object_find(params, handle, &ob) == PTP_RC_OK)
+      update_metadata_cache(device, handle);
+    break;
+  case PTP_EC_StoreAdded:
+  case PTP_EC_StoreRemoved:
+    // Without a storage ID to go by everything has to be reloaded
+    if (handle == 0 || handle == 0xffffffffU)
+      flush_handles(device);
+    else if (ptp_event->Code == PTP_EC_StoreAdded)
+      refresh_storage(device, handle);
+    else
+      ptp_remove_storage_from_cache(params, handle);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Apply the queued up object events to the object cache. This takes
+ * transactions of its own, so it is put off while one is in progress
+ * or while libusb is handling events, as when it delivers an event in
+ * the middle of a transfer of ours or of LIBMTP_Handle_Events_Timeout_Completed().
+ */
+static void apply_cache_events(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (params->in_transaction || params->in_event_callback)
+    return;
+  while (params->nrofcache_events > 0) {
+    // Events arriving meanwhile go to a new queue
+    PTPContainer *events = params->cache_events;
+    unsigned int n = params->nrofcache_events;
+    unsigned int i;
+
+    params->cache_events = NULL;
+    params->nrofcache_events = 0;
+    for (i = 0; i < n; i++) {
+      uint32_t *handles;
+      unsigned int j;
+
+      // A burst of removals, as for a deleted folder, goes in one batch
+      if (events[i].Code == PTP_EC_ObjectRemoved &&
+	  i + 1 < n && events[i + 1].Code == PTP_EC_ObjectRemoved &&
+	  (handles = malloc((n - i) * sizeof(uint32_t))) != NULL) {
+	for (j = i; j < n && events[j].Code == PTP_EC_ObjectRemoved; j++)
+	  handles[j - i] = events[j].Param1;
+	ptp_remove_objects_from_cache(params, handles, j - i);
+	free(handles);
+	i = j - 1;
+	continue;
+      }
+      apply_cache_event(device, &events[i]);
+    }
+    free(events);
+  }
+}
+
+/**
+ * Queue an object event for the object cache, if the application
+ * asked for that. It is applied by apply_cache_events() later on,
+ * never right here, since this may run inside libusb event handling.
+ */
+static void queue_cache_event(LIBMTP_mtpdevice_t *device,
+			      PTPContainer *ptp_event)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPContainer *events;
+
+  if (!device->cached || !params->cache_events_enabled)
+    return;
+  events = realloc(params->cache_events,
+		   (params->nrofcache_events + 1) * sizeof(PTPContainer));
+  if (events == NULL)
+    return;
+  params->cache_events = events;
+  params->cache_events[params->nrofcache_events++] = *ptp_event;
+}
+
+void LIBMTP_Handle_Event(LIBMTP_mtpdevice_t *device,
+                         PTPContainer *ptp_event,
                          LIBMTP_event_t *event, uint32_t *out1) {
   uint16_t code;
   uint32_t session_id;
@@ -2215,23 +2658,25 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_ObjectAdded:
       LIBMTP_INFO("Received event PTP_EC_ObjectAdded in session %u\n", session_id);
+      queue_cache_event(device, ptp_event);
       *event = LIBMTP_EVENT_OBJECT_ADDED;
       *out1 = param1;
       break;
     case PTP_EC_ObjectRemoved:
       LIBMTP_INFO("Received event PTP_EC_ObjectRemoved in session %u\n", session_id);
+      queue_cache_event(device, ptp_event);
       *event = LIBMTP_EVENT_OBJECT_REMOVED;
       *out1 = param1;
       break;
     case PTP_EC_StoreAdded:
       LIBMTP_INFO("Received event PTP_EC_StoreAdded in session %u\n", session_id);
-      /* TODO: rescan storages */
+      queue_cache_event(device, ptp_event);
       *event = LIBMTP_EVENT_STORE_ADDED;
       *out1 = param1;
       break;
     case PTP_EC_StoreRemoved:
       LIBMTP_INFO("Received event PTP_EC_StoreRemoved in session %u\n", session_id);
-      /* TODO: rescan storages */
+      queue_cache_event(device, ptp_event);
       *event = LIBMTP_EVENT_STORE_REMOVED;
       *out1 = param1;
       break;
@@ -2243,7 +2688,7 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_ObjectInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_ObjectInfoChanged in session %u\n", session_id);
-      /* TODO: rescan object cache or just for this one object */
+      queue_cache_event(device, ptp_event);
       break;
     case PTP_EC_DeviceInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_DeviceInfoChanged in session %u\n", session_id);
@@ -2281,10 +2726,12 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
   uint32_t param1 = 0;
   int handler_ret;
 
+  // This is libusb event handling, the cache is updated later on
+  params->in_event_callback++;
   switch (ret_code) {
   case PTP_RC_OK:
     handler_ret = LIBMTP_HANDLER_RETURN_OK;
-    LIBMTP_Handle_Event(ptp_event, &event, &param1);
+    LIBMTP_Handle_Event(data->device, ptp_event, &event, &param1);
     break;
   case PTP_ERROR_CANCEL:
     handler_ret = LIBMTP_HANDLER_RETURN_CANCEL;
@@ -2295,6 +2742,7 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
   }
 
   data->cb(handler_ret, event, param1, data->user_data);
+  params->in_event_callback--;
   free(data);
 }
 
@@ -2321,6 +2769,10 @@ int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, v
   event_cb_data_t *data =  malloc(sizeof(event_cb_data_t));
   uint16_t ret;
 
+  // Catch up on events queued since, unless this is the event callback
+  apply_cache_events(device);
+
+  data->device = device;
   data->cb = cb;
   data->user_data = user_data;
 
@@ -2328,8 +2780,95 @@ int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, v
   return ret == PTP_RC_OK ? 0 : -1;
 }
 
+/* One of the devices being opened by LIBMTP_Open_Raw_Devices() */
+typedef struct {
+  LIBMTP_raw_device_t *rawdevice;
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_error_number_t error;
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  int started;
+#endif
+} open_job_t;
+
+static void *open_raw_device_job(void *arg)
+{
+  open_job_t *job = (open_job_t *) arg;
+
+  job->device = open_raw_device_cached(job->rawdevice, 0, NULL, &job->error);
+  return NULL;
+}
+
+/**
+ * This function opens a number of raw devices at once, like calling
+ * <code>LIBMTP_Open_Raw_Device()</code> on each of them. Each device is
+ * opened and has its objects listed in a thread of its own, so this
+ * takes about as long as the slowest of the devices rather than all of
+ * them together. Where threads are not available they are opened one
+ * after the other.
+ *
+ * The devices are not linked into a list, each is released with
+ * <code>LIBMTP_Release_Device()</code> as usual. The error stack of
+ * each device tells what went wrong while it was being opened.
+ *
+ * @param rawdevices the raw devices to open "real" devices for, as
+ *        found by <code>LIBMTP_Detect_Raw_Devices()</code>.
+ * @param numdevs the number of raw devices.
+ * @param devices an array of <code>numdevs</code> pointers that will
+ *        take the open devices, in the order of the raw devices. A
+ *        device that could not be opened is NULL.
+ * @param errors an array of <code>numdevs</code> error numbers that
+ *        take why each device could not be opened, e.g.
+ *        <code>LIBMTP_ERROR_NO_DEVICE_ATTACHED</code>, and
+ *        <code>LIBMTP_ERROR_NONE</code> for those that were, or NULL.
+ * @return the number of devices that were opened.
+ */
+int LIBMTP_Open_Raw_Devices(LIBMTP_raw_device_t *rawdevices,
+			    int const numdevs,
+			    LIBMTP_mtpdevice_t **devices,
+			    LIBMTP_error_number_t *errors)
+{
+  open_job_t *jobs;
+  int i, opened = 0;
+
+  jobs = (open_job_t *) calloc(numdevs, sizeof(open_job_t));
+  if (jobs == NULL) {
+    for (i = 0; i < numdevs; i++) {
+      devices[i] = NULL;
+      if (errors != NULL)
+	errors[i] = LIBMTP_ERROR_MEMORY_ALLOCATION;
+    }
+    return 0;
+  }
+  for (i = 0; i < numdevs; i++) {
+    jobs[i].rawdevice = &rawdevices[i];
+#ifdef HAVE_PTHREAD_H
+    if (pthread_create(&jobs[i].thread, NULL, open_raw_device_job,
+		       &jobs[i]) == 0) {
+      jobs[i].started = 1;
+      continue;
+    }
+#endif
+    // No thread for this one, open it right here
+    open_raw_device_job(&jobs[i]);
+  }
+  for (i = 0; i < numdevs; i++) {
+#ifdef HAVE_PTHREAD_H
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+#endif
+    devices[i] = jobs[i].device;
+    if (devices[i] != NULL)
+      opened++;
+    if (errors != NULL)
+      errors[i] = jobs[i].error;
+  }
+  free(jobs);
+  return opened;
+}
+
 /**
- * Recursive function that adds MTP devices to a linked list
+ * Function that adds MTP devices to a linked list
  * @param devices a list of raw devices to have real devices created for.
  * @return a device pointer to a newly created mtpdevice (used in linked
  * list creation).
@@ -2339,10 +2878,15 @@ static LIBMTP_mtpdevice_t * create_usb_mtp_devices(LIBMTP_raw_device_t *devices,
   unsigned int i;
   LIBMTP_mtpdevice_t *mtp_device_list = NULL;
   LIBMTP_mtpdevice_t *current_device = NULL;
+  LIBMTP_mtpdevice_t **mtp_devices;
+
+  mtp_devices = (LIBMTP_mtpdevice_t **) calloc(numdevs, sizeof(LIBMTP_mtpdevice_t *));
+  if (mtp_devices == NULL)
+    return NULL;
+  LIBMTP_Open_Raw_Devices(devices, numdevs, mtp_devices, NULL);
 
   for (i=0; i < numdevs; i++) {
-    LIBMTP_mtpdevice_t *mtp_device;
-    mtp_device = LIBMTP_Open_Raw_Device(&devices[i]);
+    LIBMTP_mtpdevice_t *mtp_device = mtp_devices[i];
 
     /* On error, try next device */
     if (mtp_device == NULL)
@@ -2357,6 +2901,7 @@ static LIBMTP_mtpdevice_t * create_usb_mtp_devices(LIBMTP_raw_device_t *devices,
       current_device = mtp_device;
     }
   }
+  free(mtp_devices);
   return mtp_device_list;
 }
 
@@ -2441,6 +2986,9 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
+  // Keep what this session learned for the next one
+  if (device->cached && metadata_cache_dir != NULL)
+    metadata_cache_save(device, metadata_cache_dir);
   close_device(ptp_usb, params);
   // Clear error stack
   LIBMTP_Clear_Errorstack(device);
@@ -2601,6 +3149,144 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
   }
 }
 
+/*
+ * What has been found out about listing the objects of a device, kept
+ * in listing_flags for the session: whether a GetObjPropList of all
+ * objects fails, whether one per folder or the PTP 1.1 filesystem
+ * manifest fails or was seen to work.
+ */
+#define LISTING_ALL_FAILS	0x01
+#define LISTING_FOLDER_FAILS	0x02
+#define LISTING_FOLDER_WORKS	0x04
+#define LISTING_MANIFEST_FAILS	0x08
+#define LISTING_MANIFEST_WORKS	0x10
+
+/*
+ * State of get_all_metadata_fast() while the property list of all
+ * objects is coming in.
+ */
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  PTPObject *ob; /* The object the previous property belonged to */
+  unsigned int firstnew; /* Objects before this slot are left alone */
+  uint32_t skip; /* The object being left alone */
+} fast_metadata_t;
+
+/* All properties of an object have been seen */
+static void finish_fast_metadata_object(PTPParams *params, PTPObject *ob)
+{
+  ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+  if (!ob->oi.Filename) {
+    /* I have one such file on my Creative (Marcus) */
+    ob->oi.Filename = ptp_strintern(params, "<null>");
+  }
+}
+
+/*
+ * Moves a decoded property into the per-object proplist of an object.
+ * The property is consumed either way.
+ */
+static uint16_t keep_object_prop(PTPParams *params, PTPObject *ob,
+				 MTPProperties *prop)
+{
+  MTPProperties *newprop;
+
+  newprop = ptp_object_new_mtpprop(params, ob);
+  if (!newprop) {
+    ptp_destroy_object_prop(prop);
+    return PTP_RC_GeneralError;
+  }
+  memcpy(newprop, prop, sizeof(*prop));
+  // Artists, albums and genres repeat a lot, share them
+  if (newprop->datatype == PTP_DTC_STR)
+    newprop->propval.str = ptp_strintern_take(params, newprop->propval.str);
+  return PTP_RC_OK;
+}
+
+/*
+ * Called by the streaming property list decoder for each property,
+ * files it with its object in the object cache right away.
+ */
+static uint16_t add_fast_metadata(PTPParams *params, void *priv,
+				  MTPProperties *prop)
+{
+  fast_metadata_t *fast = (fast_metadata_t *) priv;
+  PTPObject *ob = fast->ob;
+  uint16_t ret;
+
+  if (ob == NULL || ob->oid != prop->ObjectHandle) {
+    if (prop->ObjectHandle == 0 || prop->ObjectHandle == fast->skip) {
+      // Not a valid object, ignore.
+      ptp_destroy_object_prop(prop);
+      return PTP_RC_OK;
+    }
+    /*
+     * The properties of an object normally come in one run, so
+     * this is where the previous object is complete.
+     */
+    if (ob != NULL)
+      finish_fast_metadata_object(params, ob);
+    fast->ob = NULL;
+    // Whatever was cached before this listing stays as it is
+    if (ptp_object_find(params, prop->ObjectHandle, &ob) == PTP_RC_OK &&
+	(unsigned int) (ob - params->objects) < fast->firstnew) {
+      fast->skip = prop->ObjectHandle;
+      ptp_destroy_object_prop(prop);
+      return PTP_RC_OK;
+    }
+    ret = ptp_object_find_or_insert(params, prop->ObjectHandle, &ob);
+    if (ret != PTP_RC_OK) {
+      ptp_destroy_object_prop(prop);
+      return ret;
+    }
+    fast->ob = ob;
+  }
+
+  // Queries go by the modification date, it is kept as a property too
+  if (prop->property == PTP_OPC_DateModified && prop->datatype == PTP_DTC_STR)
+    ob->oi.ModificationDate = ptp_parse_datetime(prop->propval.str);
+
+  switch (prop->property) {
+  case PTP_OPC_ParentObject:
+    ob->oi.ParentObject = prop->propval.u32;
+    ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+    break;
+  case PTP_OPC_ObjectFormat:
+    ob->oi.ObjectFormat = prop->propval.u16;
+    break;
+  case PTP_OPC_ObjectSize:
+    // We loose precision here, up to 32 bits! However the commands that
+    // retrieve metadata for files and tracks will make sure that the
+    // PTP_OPC_ObjectSize is read in and duplicated again.
+    if (fast->device->object_bitsize == 64) {
+      ob->oi.ObjectCompressedSize = (uint32_t) prop->propval.u64;
+    } else {
+      ob->oi.ObjectCompressedSize = prop->propval.u32;
+    }
+    break;
+  case PTP_OPC_StorageID:
+    ob->oi.StorageID = prop->propval.u32;
+    ob->flags |= PTPOBJECT_STORAGEID_LOADED;
+    break;
+  case PTP_OPC_ObjectFileName:
+    // Take over the decoded string
+    if (prop->datatype == PTP_DTC_STR && prop->propval.str != NULL) {
+      ptp_strrelease(params, ob->oi.Filename);
+      ob->oi.Filename = ptp_strintern_take(params, prop->propval.str);
+      prop->propval.str = NULL;
+    }
+    break;
+  default:
+    /* Move all of the other MTP properties into the per-object proplist */
+    ret = keep_object_prop(params, ob, prop);
+    if (ret == PTP_RC_OK)
+      ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+    return ret;
+  }
+  ptp_destroy_object_prop(prop);
+  return PTP_RC_OK;
+}
+
 /**
  * This command gets all handles and stuff by FAST directory retrieveal
  * which is available by getting all metadata for object
@@ -2608,18 +3294,20 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
  * This works on the vast majority of MTP devices (there ARE exceptions!)
  * and is quite quick. Check the error stack to see if there were
  * problems getting the metadata.
+ *
+ * The property list is decoded while it is being transferred and each
+ * object goes into the object cache as soon as its properties arrive,
+ * so the list as such is never held in memory.
  * @return 0 if all was OK, -1 on failure.
  */
 static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
 {
   PTPParams      *params = (PTPParams *) device->params;
-  int		 cnt = 0;
-  int            i, j, nrofprops;
-  uint32_t	 lasthandle = 0xffffffff;
-  MTPProperties  *props = NULL;
-  MTPProperties  *prop;
+  int            nrofprops;
+  fast_metadata_t fast;
   uint16_t       ret;
   int            oldtimeout;
+  open_progress_t *progress;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
   /*
@@ -2633,14 +3321,33 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
    * to return a response.
    *
    * Temporarly set timeout to allow working with
-   * widest range of devices.
+   * widest range of devices, unless the application
+   * would rather not wait that long.
    */
   get_usb_device_timeout(ptp_usb, &oldtimeout);
-  set_usb_device_timeout(ptp_usb, 60000);
-
-  ret = ptp_mtp_getobjectproplist(params, 0xffffffff, &props, &nrofprops);
+  progress = get_open_progress(device);
+  if (progress != NULL && progress->timeout > 0)
+    set_usb_device_timeout(ptp_usb, progress->timeout);
+  else
+    set_usb_device_timeout(ptp_usb, 60000);
+
+  fast.device = device;
+  fast.ob = NULL;
+  fast.firstnew = 0;
+  fast.skip = 0;
+  ret = ptp_mtp_getobjectproplist_stream(params, 0xffffffff,
+					 add_fast_metadata, &fast,
+					 &nrofprops);
   set_usb_device_timeout(ptp_usb, oldtimeout);
 
+  /* mark last entry also */
+  if (fast.ob != NULL)
+    finish_fast_metadata_object(params, fast.ob);
+
+  if (ret != PTP_RC_OK) {
+    // Drop whatever made it into the cache, the caller starts over
+    ptp_objects_free(params);
+  }
   if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
     // What's the point in the device implementing this command if
     // you cannot use it to get all props for AT LEAST one object?
@@ -2654,101 +3361,145 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
     "could not get proplist of all objects.");
     return -1;
   }
-  if (props == NULL && nrofprops != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "get_all_metadata_fast(): "
-			    "call to ptp_mtp_getobjectproplist() returned "
-			    "inconsistent results.");
-    return -1;
-  }
-  /*
-   * We count the number of objects by counting the ObjectHandle
-   * references, whenever it changes we get a new object, when it's
-   * the same, it is just different properties of the same object.
-   */
-  prop = props;
-  for (i=0;i<nrofprops;i++) {
-      if (lasthandle != prop->ObjectHandle) {
-	cnt++;
-	lasthandle = prop->ObjectHandle;
-      }
-      prop++;
-  }
-  lasthandle = 0xffffffff;
-  params->objects = calloc (cnt, sizeof(PTPObject));
-  prop = props;
-  i = -1;
-  for (j=0;j<nrofprops;j++) {
-    if (lasthandle != prop->ObjectHandle) {
-      if (i >= 0) {
-        params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-	if (!params->objects[i].oi.Filename) {
-	  /* I have one such file on my Creative (Marcus) */
-	  params->objects[i].oi.Filename = strdup("<null>");
-	}
-      }
-      i++;
-      lasthandle = prop->ObjectHandle;
-      params->objects[i].oid = prop->ObjectHandle;
-    }
-    switch (prop->property) {
-    case PTP_OPC_ParentObject:
-      params->objects[i].oi.ParentObject = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-      break;
-    case PTP_OPC_ObjectFormat:
-      params->objects[i].oi.ObjectFormat = prop->propval.u16;
-      break;
-    case PTP_OPC_ObjectSize:
-      // We loose precision here, up to 32 bits! However the commands that
-      // retrieve metadata for files and tracks will make sure that the
-      // PTP_OPC_ObjectSize is read in and duplicated again.
-      if (device->object_bitsize == 64) {
-	params->objects[i].oi.ObjectCompressedSize = (uint32_t) prop->propval.u64;
-      } else {
-	params->objects[i].oi.ObjectCompressedSize = prop->propval.u32;
-      }
-      break;
-    case PTP_OPC_StorageID:
-      params->objects[i].oi.StorageID = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_STORAGEID_LOADED;
-      break;
-    case PTP_OPC_ObjectFileName:
-      if (prop->propval.str != NULL)
-        params->objects[i].oi.Filename = strdup(prop->propval.str);
-      break;
-    default: {
-      MTPProperties *newprops;
+  return 0;
+}
 
-      /* Copy all of the other MTP oprierties into the per-object proplist */
-      if (params->objects[i].nrofmtpprops) {
-        newprops = realloc(params->objects[i].mtpprops,
-		(params->objects[i].nrofmtpprops+1)*sizeof(MTPProperties));
-      } else {
-        newprops = calloc(1,sizeof(MTPProperties));
+/**
+ * Returns non-zero if the folders of a device can be listed with one
+ * GetObjPropList of depth 1 each, as far as is known.
+ */
+static int use_folder_metadata_fast(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  return ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) &&
+    !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb) &&
+    !(params->listing_flags & LISTING_FOLDER_FAILS);
+}
+
+/**
+ * Lists the children of one folder into the object cache with a single
+ * GetObjPropList of depth 1, instead of one GetObjectInfo per child.
+ * Objects that are in the cache already are left as they are.
+ * @param device a pointer to the MTP device.
+ * @param parent the folder to list, 0 for the root folders of all
+ *        storages.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t get_folder_metadata_fast(LIBMTP_mtpdevice_t *device,
+					 uint32_t parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  fast_metadata_t fast;
+  int nrofprops;
+  uint16_t ret;
+
+  fast.device = device;
+  fast.ob = NULL;
+  fast.firstnew = params->nrofobjects;
+  fast.skip = 0;
+  ret = ptp_mtp_getobjectproplist_stream_level(params, parent, 1,
+					       add_fast_metadata, &fast,
+					       &nrofprops);
+  if (fast.ob != NULL)
+    finish_fast_metadata_object(params, fast.ob);
+  if (ret != PTP_RC_OK)
+    return ret;
+
+  // The first time round, check that this got all of the root folder
+  if (parent == 0x00000000U &&
+      !(params->listing_flags & LISTING_FOLDER_WORKS)) {
+    PTPObjectHandles handles;
+    unsigned int *slots;
+    unsigned int n, nrofroot = 0;
+
+    if (ptp_object_children(params, 0x00000000U, 0, &slots, &n) == PTP_RC_OK)
+      nrofroot += n;
+    if (ptp_object_children(params, 0xffffffffU, 0, &slots, &n) == PTP_RC_OK)
+      nrofroot += n;
+    ret = ptp_getobjecthandles(params, PTP_GOH_ALL_STORAGE,
+			       PTP_GOH_ALL_FORMATS, PTP_GOH_ROOT_PARENT,
+			       &handles);
+    if (ret == PTP_RC_OK) {
+      n = handles.n;
+      free(handles.Handler);
+      if (n != nrofroot) {
+	LIBMTP_INFO("GetObjPropList listed %u objects in the root folder "
+		    "instead of %u, not listing folders with it\n",
+		    nrofroot, n);
+	params->listing_flags |= LISTING_FOLDER_FAILS;
+	return PTP_RC_GeneralError;
       }
-      if (!newprops) return 0; /* FIXME: error handling? */
-      params->objects[i].mtpprops = newprops;
-      memcpy(&params->objects[i].mtpprops[params->objects[i].nrofmtpprops],
-	     &props[j],sizeof(props[j]));
-      params->objects[i].nrofmtpprops++;
-      params->objects[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
-      break;
     }
-    }
-    prop++;
+    params->listing_flags |= LISTING_FOLDER_WORKS;
   }
-  /* mark last entry also */
-  if (i >= 0) {
-    params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-    params->nrofobjects = i+1;
-  } else {
-    params->nrofobjects = 0;
+  return PTP_RC_OK;
+}
+
+/**
+ * Walks the folders of the device from the given one down, listing
+ * each with get_folder_metadata_fast(). A folder the device will not
+ * list that way is walked object by object.
+ * @param device a pointer to the MTP device.
+ * @param parent the folder to start at, 0 for the root folder.
+ * @return a PTP_RC_* code, about the starting folder only.
+ */
+static uint16_t get_handles_by_folder(LIBMTP_mtpdevice_t *device,
+				      uint32_t parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *folders = NULL;
+  uint32_t *storages = NULL;
+  unsigned int nroffolders = 0;
+  unsigned int first = params->nrofobjects;
+  unsigned int i;
+  uint16_t ret;
+
+  // It may have been found not to work further up
+  if (!use_folder_metadata_fast(device))
+    return PTP_RC_OperationNotSupported;
+  ret = get_folder_metadata_fast(device, parent);
+  if (ret != PTP_RC_OK) {
+    if (ret == PTP_RC_OperationNotSupported ||
+	ret == PTP_RC_MTP_Specification_By_Depth_Unsupported)
+      params->listing_flags |= LISTING_FOLDER_FAILS;
+    return ret;
   }
-  free (props);
-  /* The device might not give the list in linear ascending order */
-  ptp_objects_sort (params);
-  return 0;
+
+  /*
+   * Pick out the subfolders first, listing them grows the cache. They
+   * are among the objects the listing just appended, which saves
+   * rebuilding the parent index for every folder of the walk.
+   */
+  if (params->nrofobjects > first) {
+    folders = malloc((params->nrofobjects - first) * sizeof(uint32_t));
+    storages = malloc((params->nrofobjects - first) * sizeof(uint32_t));
+  }
+  for (i = first; folders != NULL && storages != NULL &&
+	 i < params->nrofobjects; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    if (PTPOBJECT_REMOVED(ob) ||
+	ob->oi.ObjectFormat != PTP_OFC_Association || ob->oid == parent)
+      continue;
+    // The root folder is 0 in the cache, but some devices say 0xffffffff
+    if (ob->oi.ParentObject != parent &&
+	(parent != 0x00000000U || ob->oi.ParentObject != 0xffffffffU))
+      continue;
+    folders[nroffolders] = ob->oid;
+    storages[nroffolders] = ob->oi.StorageID;
+    nroffolders++;
+  }
+
+  for (i = 0; i < nroffolders && !listing_cancelled(device); i++) {
+    if (get_handles_by_folder(device, folders[i]) != PTP_RC_OK &&
+	!listing_cancelled(device))
+      get_handles_recursively(device, params, storages[i], folders[i]);
+  }
+  free(folders);
+  free(storages);
+  return PTP_RC_OK;
 }
 
 /**
@@ -2784,6 +3535,11 @@ static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
   // Now descend into any subdirectories found
   for (i = 0; i < currentHandles.n; i++) {
     PTPObject *ob;
+
+    if (listing_cancelled(device)) {
+      free(currentHandles.Handler);
+      return PTP_ERROR_CANCEL;
+    }
     ret = ptp_object_want(params,currentHandles.Handler[i],
 			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
     if (ret == PTP_RC_OK) {
@@ -2801,6 +3557,40 @@ static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
   return PTP_RC_OK;
 }
 
+/**
+ * Lists one storage, or all of them, into the object cache from the
+ * PTP 1.1 filesystem manifest, which takes a single transaction. The
+ * first time around the result is checked against GetNumObjects, since
+ * some devices send incomplete or mislabelled manifests.
+ * @param device a pointer to the MTP device.
+ * @param storageid the storage to list, or PTP_GOH_ALL_STORAGE.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t get_manifest_metadata(LIBMTP_mtpdevice_t *device,
+				      uint32_t storageid)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t listed, numobs = 0;
+  uint16_t ret;
+
+  ret = ptp_list_storage_manifest(params, storageid, &listed);
+  if (ret != PTP_RC_OK) {
+    if (!listing_cancelled(device))
+      params->listing_flags |= LISTING_MANIFEST_FAILS;
+    return ret;
+  }
+  if (params->listing_flags & LISTING_MANIFEST_WORKS)
+    return PTP_RC_OK;
+  ret = ptp_getnumobjects(params, storageid, 0x00000000U, 0x00000000U, &numobs);
+  if (ret != PTP_RC_OK || numobs != listed) {
+    LIBMTP_INFO("Filesystem manifest lists %u objects, device has %u, "
+		"not using it.\n", listed, numobs);
+    params->listing_flags |= LISTING_MANIFEST_FAILS;
+    return PTP_RC_GeneralError;
+  }
+  return PTP_RC_OK;
+}
+
 /**
  * This function refresh the internal handle list whenever
  * the items stored inside the device is altered. On operations
@@ -2812,31 +3602,72 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
 {
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  int ret;
-  uint32_t i;
 
   if (!device->cached) {
     return;
   }
 
-  if (params->objects != NULL) {
-    for (i=0;i<params->nrofobjects;i++)
-      ptp_free_object (&params->objects[i]);
-    free(params->objects);
-    params->objects = NULL;
-    params->nrofobjects = 0;
-  }
+  ptp_objects_free(params);
 
-  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
+  if (params->objects_lazy) {
+    /*
+     * Just the root folders, the rest comes as it is asked for. The
+     * GetObjPropList of the root lists all storages at once, so only
+     * ask storage by storage when that is not used.
+     */
+    if (device->storage == NULL || use_folder_metadata_fast(device)) {
+      load_folder(device, PTP_GOH_ALL_STORAGE, 0x00000000U);
+    } else {
+      LIBMTP_devicestorage_t *storage = device->storage;
+      while(storage != NULL) {
+	load_folder(device, storage->id, 0x00000000U);
+	storage = storage->next;
+      }
+    }
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
-      && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
-    // Use the fast method. Ignore return value for now.
-    ret = get_all_metadata_fast(device);
+      && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)
+      && !(params->listing_flags & LISTING_ALL_FAILS)) {
+    // Use the fast method, and remember if it does not work.
+    if (get_all_metadata_fast(device) != 0 && !listing_cancelled(device))
+      params->listing_flags |= LISTING_ALL_FAILS;
+  }
+
+  // Next best is the filesystem manifest, one transaction per storage
+  if (params->nrofobjects == 0 && !params->objects_lazy &&
+      !listing_cancelled(device) &&
+      ptp_operation_issupported(params, PTP_OC_GetFilesystemManifest) &&
+      !(params->listing_flags & LISTING_MANIFEST_FAILS)) {
+    LIBMTP_devicestorage_t *storage = device->storage;
+    uint16_t ret;
+
+    if (storage == NULL) {
+      ret = get_manifest_metadata(device, PTP_GOH_ALL_STORAGE);
+    } else {
+      do {
+	ret = get_manifest_metadata(device, storage->id);
+	storage = storage->next;
+      } while (ret == PTP_RC_OK && storage != NULL);
+    }
+    if (ret == PTP_RC_OK)
+      params->listing_flags |= LISTING_MANIFEST_WORKS;
+    else
+      ptp_objects_free(params);
+  }
+
+  // If that failed or returned no objects, ask for one folder
+  // at a time, which takes one transaction per folder.
+  if (params->nrofobjects == 0 && !params->objects_lazy &&
+      !listing_cancelled(device) &&
+      use_folder_metadata_fast(device)) {
+    if (get_handles_by_folder(device, 0x00000000U) != PTP_RC_OK)
+      ptp_objects_free(params);
   }
 
   // If the previous failed or returned no objects, use classic
   // methods instead.
-  if (params->nrofobjects == 0) {
+  if (params->nrofobjects == 0 && !params->objects_lazy &&
+      !listing_cancelled(device)) {
     // Get all the handles using just standard commands.
     if (device->storage == NULL) {
       get_handles_recursively(device, params,
@@ -2845,7 +3676,7 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
     } else {
       // Get handles for each storage in turn.
       LIBMTP_devicestorage_t *storage = device->storage;
-      while(storage != NULL) {
+      while(storage != NULL && !listing_cancelled(device)) {
 	get_handles_recursively(device, params,
 				storage->id,
 				PTP_GOH_ROOT_PARENT);
@@ -2854,24 +3685,174 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
     }
   }
 
+  // The cache is filled in device order, list the objects by handle
+  ptp_objects_sort(params);
+
+  fix_up_handles(device);
+}
+
+/**
+ * Lists one folder into the object cache, for devices whose cache is
+ * filled one folder at a time. A folder that has been listed before
+ * is not listed again.
+ * @param device a pointer to the MTP device.
+ * @param storageid the storage of the folder.
+ * @param parent the folder to list, 0 for the root folder.
+ * @return a PTP_RC_* code.
+ */
+static uint16_t load_folder(LIBMTP_mtpdevice_t *device, uint32_t storageid,
+			    uint32_t parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectHandles currentHandles;
+  PTPObject *ob;
+  unsigned int i;
+  uint16_t ret;
+
+  if (parent != 0x00000000U && parent != 0xffffffffU) {
+    ret = ptp_object_want(params, parent, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+    if (ret != PTP_RC_OK)
+      return ret;
+    if (ob->oi.ObjectFormat != PTP_OFC_Association ||
+	(ob->flags & PTPOBJECT_DIRECTORY_LOADED))
+      return PTP_RC_OK;
+    storageid = ob->oi.StorageID;
+  } else {
+    parent = PTP_GOH_ROOT_PARENT;
+  }
+
+  // One transaction for the whole folder, if the device can
+  if (use_folder_metadata_fast(device) &&
+      get_folder_metadata_fast(device, (parent == PTP_GOH_ROOT_PARENT) ?
+			       0x00000000U : parent) == PTP_RC_OK)
+    goto loaded;
+
+  ret = ptp_getobjecthandles(params, storageid, PTP_GOH_ALL_FORMATS,
+			     parent, &currentHandles);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "load_folder(): "
+				"could not get object handles.");
+    return ret;
+  }
+  for (i = 0; i < currentHandles.n; i++) {
+    if (ptp_object_want(params, currentHandles.Handler[i],
+			PTPOBJECT_OBJECTINFO_LOADED, &ob) != PTP_RC_OK)
+      add_error_to_errorstack(device, LIBMTP_ERROR_CONNECTING,
+			      "Found a bad handle, trying to ignore it.");
+  }
+  free(currentHandles.Handler);
+
+ loaded:
+  // Loading the children may have moved it around in the cache
+  if (parent != PTP_GOH_ROOT_PARENT &&
+      ptp_object_find(params, parent, &ob) == PTP_RC_OK)
+    ob->flags |= PTPOBJECT_DIRECTORY_LOADED;
+  return PTP_RC_OK;
+}
+
+/**
+ * Makes sure the object cache holds all objects of the device, for
+ * the operations that go through all of them. A device opened with
+ * LIBMTP_Open_Raw_Device_Lazy() is fully listed at this point, and
+ * stays that way.
+ * @param device a pointer to the MTP device.
+ */
+static void fill_cache(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Catch up on events that came in asynchronously
+  apply_cache_events(device);
+  if (params->objects_lazy) {
+    params->objects_lazy = 0;
+    flush_handles(device);
+  } else if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+}
+
+/**
+ * Drops the cached objects of one storage and lists them again from
+ * the device, storage by storage being the only way there is to ask
+ * for the objects of just one storage.
+ * @param device a pointer to the MTP device to refresh.
+ * @param storageid the storage to refresh.
+ * @return 0 on success, any other value means failure.
+ */
+static int refresh_storage(LIBMTP_mtpdevice_t *device, uint32_t storageid)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  ptp_remove_storage_from_cache(params, storageid);
+  if (params->objects_lazy) {
+    ret = load_folder(device, storageid, 0x00000000U);
+  } else {
+    /*
+     * One transaction per folder if the device can. The root folders
+     * of the other storages come along, but are cached already and so
+     * left alone.
+     */
+    ret = PTP_RC_OperationNotSupported;
+    if (use_folder_metadata_fast(device)) {
+      ret = get_handles_by_folder(device, 0x00000000U);
+      if (ret != PTP_RC_OK)
+	ptp_remove_storage_from_cache(params, storageid);
+    }
+    if (ret != PTP_RC_OK && !listing_cancelled(device))
+      ret = get_handles_recursively(device, params, storageid,
+				    PTP_GOH_ROOT_PARENT);
+  }
+  ptp_objects_sort(params);
+  fix_up_handles(device);
+  // A storage that has gone away has no objects left to list
+  if (ret != PTP_RC_OK && ret != PTP_RC_InvalidStorageId)
+    return -1;
+  return 0;
+}
+
+/**
+ * Loop over the handles, fix up any NULL filenames or
+ * keywords, then attempt to locate some default folders
+ * in the root directory of the primary storage.
+ * @param device a pointer to the MTP device with a freshly filled
+ *        object cache.
+ */
+static void fix_up_handles(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *handles;
+  uint32_t nrofhandles = 0;
+  int ret;
+  uint32_t i;
+
   /*
-   * Loop over the handles, fix up any NULL filenames or
-   * keywords, then attempt to locate some default folders
-   * in the root directory of the primary storage.
+   * Loading an object that turns out to be broken drops it from the
+   * cache, which may then move the others around, so go by handle.
    */
-  for(i = 0; i < params->nrofobjects; i++) {
-    PTPObject *ob, *xob;
+  handles = malloc(params->nrofobjects * sizeof(uint32_t));
+  if (handles == NULL && params->nrofobjects > 0)
+    return;
+  for (i = 0; i < params->nrofobjects; i++)
+    if (!PTPOBJECT_REMOVED(&params->objects[i]))
+      handles[nrofhandles++] = params->objects[i].oid;
 
-    ob = &params->objects[i];
-    ret = ptp_object_want(params,params->objects[i].oid,
-			  PTPOBJECT_OBJECTINFO_LOADED, &xob);
+  for(i = 0; i < nrofhandles; i++) {
+    PTPObject *ob;
+
+    ret = ptp_object_want(params, handles[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
     if (ret != PTP_RC_OK) {
-	LIBMTP_ERROR("broken! %x not found\n", params->objects[i].oid);
+	LIBMTP_ERROR("broken! %x not found\n", handles[i]);
+	// It is gone from the cache by now
+	continue;
+    }
+    if (ob->oi.Filename == NULL) {
+      ob->oi.Filename = ptp_strintern(params, "<null>");
+      ptp_object_changed(params, ob);
     }
-    if (ob->oi.Filename == NULL)
-      ob->oi.Filename = strdup("<null>");
     if (ob->oi.Keywords == NULL)
-      ob->oi.Keywords = strdup("<null>");
+      ob->oi.Keywords = ptp_strintern(params, "<null>");
 
     /* Ignore handles that point to non-folders */
     if(ob->oi.ObjectFormat != PTP_OFC_Association)
@@ -2925,6 +3906,7 @@ static void flush_handles(LIBMTP_mtpdevice_t *device)
       device->default_text_folder = ob->oid;
     }
   }
+  free(handles);
 }
 
 /**
@@ -3585,6 +4567,137 @@ int LIBMTP_Reset_Device(LIBMTP_mtpdevice_t *device)
   return 0;
 }
 
+/**
+ * This sets up pipelining of bulk data read from the device. Large
+ * data phases (file downloads, big metadata listings) are then read
+ * with <code>depth</code> transfers of <code>blocksize</code> bytes
+ * each queued on the bus at the same time, so that the device can keep
+ * sending while the previous block is written out. By default devices
+ * are opened with 4 transfers of one block each queued.
+ *
+ * Only the libusb 1.0 backend pipelines reads, other backends ignore
+ * this setting.
+ * @param device a pointer to the device to configure.
+ * @param depth the number of transfers to keep queued. Pass 0 or 1 to
+ *        read synchronously one block at a time.
+ * @param blocksize the size of each queued transfer in bytes, rounded
+ *        down to a multiple of the endpoint packet size. Pass 0 to
+ *        follow the device's transfer block size, see
+ *        LIBMTP_Set_Transfer_Sizing().
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Read_Queue(LIBMTP_mtpdevice_t *device, int depth,
+			  uint32_t blocksize)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  if (depth < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Read_Queue(): "
+			    "invalid queue depth.");
+    return -1;
+  }
+  ptp_usb->read_queue_depth = depth;
+  ptp_usb->read_block_size = blocksize;
+  return 0;
+}
+
+/**
+ * This sets up pipelining of bulk data sent to the device. While
+ * <code>depth</code> blocks of <code>blocksize</code> bytes are on the
+ * wire, the next ones are already being fetched from the source file
+ * or buffer. By default devices are opened with 4 blocks queued.
+ *
+ * Only the libusb 1.0 backend pipelines writes, other backends ignore
+ * this setting.
+ * @param device a pointer to the device to configure.
+ * @param depth the number of blocks to keep queued. Pass 0 or 1 to
+ *        write synchronously one block at a time.
+ * @param blocksize the size of each queued block in bytes, rounded
+ *        down to a multiple of the endpoint packet size. Pass 0 to
+ *        follow the device's transfer block size, see
+ *        LIBMTP_Set_Transfer_Sizing().
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Write_Queue(LIBMTP_mtpdevice_t *device, int depth,
+			   uint32_t blocksize)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  if (depth < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Write_Queue(): "
+			    "invalid queue depth.");
+    return -1;
+  }
+  ptp_usb->write_queue_depth = depth;
+  ptp_usb->write_block_size = blocksize;
+  return 0;
+}
+
+/**
+ * This retrieves statistics on the buffers used to receive data from
+ * the device into memory, e.g. object property lists, since the device
+ * was opened. Useful to check how much buffer churn a large metadata
+ * listing causes.
+ * @param device a pointer to the device to get the statistics for.
+ * @param allocations a pointer to a variable that will hold the number
+ *        of buffer allocations and reallocations, may be NULL.
+ * @param allocated a pointer to a variable that will hold the total
+ *        number of bytes requested by those allocations, may be NULL.
+ * @param peak a pointer to a variable that will hold the size of the
+ *        largest receive buffer, may be NULL.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Get_Receive_Buffer_Stats(LIBMTP_mtpdevice_t *device,
+				    uint64_t * const allocations,
+				    uint64_t * const allocated,
+				    uint64_t * const peak)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (allocations != NULL)
+    *allocations = params->recv_allocs;
+  if (allocated != NULL)
+    *allocated = params->recv_alloc_bytes;
+  if (peak != NULL)
+    *peak = params->recv_alloc_peak;
+  return 0;
+}
+
+/**
+ * This selects how large data transfers to and from the device are
+ * chopped into blocks. By default the block size is derived from the
+ * USB speed and endpoint packet size of the device, and some devices
+ * known to need a special block pattern get that.
+ *
+ * Block sizes are rounded down to a multiple of the endpoint packet
+ * size and capped at 1 MiB. Only the libusb 1.0 backend honours this
+ * setting.
+ * @param device a pointer to the device to configure.
+ * @param sizing the block sizing policy.
+ * @param blocksize the block size in bytes for
+ *        <code>LIBMTP_TRANSFER_SIZING_FIXED</code>, or the size to start
+ *        out from for <code>LIBMTP_TRANSFER_SIZING_AUTOTUNE</code> (0
+ *        picks it automatically). Ignored by the other policies.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Transfer_Sizing(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_transfer_sizing_t sizing,
+			       uint32_t blocksize)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  if (sizing == LIBMTP_TRANSFER_SIZING_FIXED && blocksize == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Sizing(): "
+			    "a fixed block size needs a size.");
+    return -1;
+  }
+  set_usb_device_transfer_sizing(ptp_usb, sizing, blocksize);
+  return 0;
+}
+
 /**
  * This retrieves the manufacturer name of an MTP device.
  * @param device a pointer to the device to get the manufacturer name for.
@@ -3903,6 +5016,33 @@ int LIBMTP_Format_Storage(LIBMTP_mtpdevice_t *device,
   return 0;
 }
 
+/**
+ * Reloads the cached objects of one storage of a device, leaving the
+ * objects of its other storages alone. This is what to call after a
+ * memory card has been inserted or removed, or after anything else
+ * that changed the contents of a single storage behind our back, in
+ * place of releasing and reopening the device. It does not update the
+ * <code>device-&gt;storage</code> list, use
+ * <code>LIBMTP_Get_Storage()</code> for that.
+ *
+ * @param device a pointer to the device to refresh the storage of.
+ * @param storage_id the ID of the storage to refresh. If the device
+ *        no longer has this storage its objects are just dropped.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Storage()
+ */
+int LIBMTP_Refresh_Storage(LIBMTP_mtpdevice_t *device,
+			   uint32_t const storage_id)
+{
+  if (!device->cached) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Refresh_Storage(): "
+			    "device has no object cache.");
+    return -1;
+  }
+  return refresh_storage(device, storage_id);
+}
+
 /**
  * Helper function to extract a unicode property off a device.
  * This is the standard way of retrieveing unicode device
@@ -4260,28 +5400,13 @@ void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
 }
 
 /**
- * Helper function that takes one PTP object and creates a
- * LIBMTP_file_t metadata entry.
+ * Works out the filetype of a cached object.
  */
-static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+static LIBMTP_filetype_t get_object_filetype(LIBMTP_mtpdevice_t *device,
+					     PTPObject *ob)
 {
-  PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *file;
-  unsigned int i;
-
-  // Allocate a new file type
-  file = LIBMTP_new_file_t();
-
-  file->parent_id = ob->oi.ParentObject;
-  file->storage_id = ob->oi.StorageID;
-
-  if (ob->oi.Filename != NULL) {
-    file->filename = strdup(ob->oi.Filename);
-  }
-
-  // Set the filetype
-  file->filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+  LIBMTP_filetype_t filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
 
   /*
    * A special quirk for devices that doesn't quite
@@ -4291,30 +5416,73 @@ static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
    * and fall back on this heuristic approach in that case,
    * for these bugged devices only.
    */
-  if (file->filetype == LIBMTP_FILETYPE_UNKNOWN) {
+  if (filetype == LIBMTP_FILETYPE_UNKNOWN) {
     if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
         FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-        has_ogg_extension(file->filename)) {
-      file->filetype = LIBMTP_FILETYPE_OGG;
+        has_ogg_extension(ob->oi.Filename)) {
+      filetype = LIBMTP_FILETYPE_OGG;
     }
 
-    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(file->filename)) {
-        file->filetype = LIBMTP_FILETYPE_FLAC;
+    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(ob->oi.Filename)) {
+        filetype = LIBMTP_FILETYPE_FLAC;
     }
   }
+  return filetype;
+}
 
-  // Set the modification date
-  file->modificationdate = ob->oi.ModificationDate;
-
-  // We only have 32-bit file size here; later we use the PTP_OPC_ObjectSize property
-  file->filesize = ob->oi.ObjectCompressedSize;
+/**
+ * Works out the size of a cached object without asking the device.
+ */
+static uint64_t get_cached_filesize(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  unsigned int i;
 
-  // This is a unique ID so we can keep track of the file.
-  file->item_id = ob->oid;
+  // The size property has 64 bits where the object info may have 32
+  for (i = 0; i < ob->nrofmtpprops; i++) {
+    if (ob->mtpprops[i].property == PTP_OPC_ObjectSize) {
+      if (device->object_bitsize == 64)
+	return ob->mtpprops[i].propval.u64;
+      return ob->mtpprops[i].propval.u32;
+    }
+  }
+  return ob->oi.ObjectCompressedSize;
+}
 
-  /*
-   * If we have a cached, large set of metadata, then use it!
-   */
+/**
+ * Helper function that takes one PTP object and creates a
+ * LIBMTP_file_t metadata entry.
+ */
+static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *file;
+  unsigned int i;
+
+  // Allocate a new file type
+  file = LIBMTP_new_file_t();
+
+  file->parent_id = ob->oi.ParentObject;
+  file->storage_id = ob->oi.StorageID;
+
+  if (ob->oi.Filename != NULL) {
+    file->filename = strdup(ob->oi.Filename);
+  }
+
+  // Set the filetype
+  file->filetype = get_object_filetype(device, ob);
+
+  // Set the modification date
+  file->modificationdate = ob->oi.ModificationDate;
+
+  // We only have 32-bit file size here; later we use the PTP_OPC_ObjectSize property
+  file->filesize = ob->oi.ObjectCompressedSize;
+
+  // This is a unique ID so we can keep track of the file.
+  file->item_id = ob->oid;
+
+  /*
+   * If we have a cached, large set of metadata, then use it!
+   */
   if (ob->mtpprops) {
     MTPProperties *prop = ob->mtpprops;
 
@@ -4463,9 +5631,7 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
   PTPParams *params = (PTPParams *) device->params;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  fill_cache(device);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_file_t *file;
@@ -4475,6 +5641,8 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
       callback(i, params->nrofobjects, data);
 
     ob = &params->objects[i];
+    if (PTPOBJECT_REMOVED(ob))
+      continue;
 
     if (ob->oi.ObjectFormat == PTP_OFC_Association) {
       // MTP use this object format for folders which means
@@ -4504,14 +5672,142 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
   return retfiles;
 }
 
+/**
+ * This function walks the object cache of a device one object at a
+ * time, without copying anything, which suits applications that go
+ * through a lot of objects just to count or pick out some of them.
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_object_view_t view;
+ * unsigned int cursor = 0;
+ *
+ * while (LIBMTP_Next_Object(device, &cursor, &view)) {
+ *   // Do something with view.filename, view.filesize etc here...
+ * }
+ * </pre>
+ *
+ * Folders are included, with the filetype
+ * <code>LIBMTP_FILETYPE_FOLDER</code>. The fields come straight out of
+ * the cache without any USB traffic, so the size of a large file may
+ * be cut down to 32 bits on devices that only told that much about it,
+ * see <code>LIBMTP_Get_Filemetadata()</code> for the full size.
+ *
+ * The filename of the view belongs to the cache, it must not be freed
+ * and is only good until the objects of the device change, e.g. by
+ * sending or deleting a file. Changing the objects while walking them
+ * may skip some or list some twice.
+ *
+ * @param device a pointer to the device to walk the objects of. It
+ *        must have been opened with an object cache.
+ * @param cursor the position of the walk, which must be set to 0 to
+ *        get the first object and is moved on past every object.
+ * @param view a view of the next object, filled in on success.
+ * @return 1 if <code>view</code> holds the next object, 0 when all
+ *         objects have been walked.
+ */
+int LIBMTP_Next_Object(LIBMTP_mtpdevice_t *device,
+		       unsigned int * const cursor,
+		       LIBMTP_object_view_t * const view)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Get all the handles if we haven't already done that
+  if (*cursor == 0)
+    fill_cache(device);
+
+  while (*cursor < params->nrofobjects) {
+    PTPObject *ob = &params->objects[(*cursor)++];
+
+    if (PTPOBJECT_REMOVED(ob))
+      continue;
+
+    view->item_id = ob->oid;
+    view->parent_id = ob->oi.ParentObject;
+    view->storage_id = ob->oi.StorageID;
+    view->filename = ob->oi.Filename;
+    view->filesize = get_cached_filesize(device, ob);
+    view->modificationdate = ob->oi.ModificationDate;
+    view->filetype = get_object_filetype(device, ob);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Lists the contents of one folder out of the object cache, looking
+ * at the children of the folder only.
+ */
+static LIBMTP_file_t *get_cached_files_and_folders(LIBMTP_mtpdevice_t *device,
+						   uint32_t const storage,
+						   uint32_t const parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *retfiles = NULL;
+  LIBMTP_file_t *curfile = NULL;
+  unsigned int *slots, *rootslots = NULL;
+  uint32_t *handles;
+  unsigned int nrofslots, nrofrootslots = 0;
+  unsigned int i, n = 0;
+
+  if (ptp_object_children(params, parent, 0, &slots, &nrofslots) != PTP_RC_OK)
+    return NULL;
+  // The root folder is 0 in the cache, but some devices say 0xffffffff
+  if (parent == LIBMTP_FILES_AND_FOLDERS_ROOT &&
+      ptp_object_children(params, 0x00000000U, 0, &rootslots,
+			  &nrofrootslots) != PTP_RC_OK)
+    return NULL;
+  if (nrofslots + nrofrootslots == 0)
+    return NULL;
+
+  // Making the file structs may load more into the cache, so hold on
+  // to the handles rather than the slots
+  handles = malloc((nrofslots + nrofrootslots) * sizeof(uint32_t));
+  if (handles == NULL)
+    return NULL;
+  for (i = 0; i < nrofslots + nrofrootslots; i++) {
+    PTPObject *ob;
+
+    if (i < nrofrootslots)
+      ob = &params->objects[rootslots[i]];
+    else
+      ob = &params->objects[slots[i - nrofrootslots]];
+    if (storage != 0 && storage != ob->oi.StorageID)
+      continue;
+    handles[n++] = ob->oid;
+  }
+
+  for (i = 0; i < n; i++) {
+    LIBMTP_file_t *file;
+    PTPObject *ob;
+
+    if (ptp_object_find(params, handles[i], &ob) != PTP_RC_OK)
+      continue;
+    file = obj2file(device, ob);
+    if (file == NULL)
+      continue;
+
+    if (curfile == NULL) {
+      curfile = file;
+      retfiles = file;
+    } else {
+      curfile->next = file;
+      curfile = file;
+    }
+  }
+  free(handles);
+
+  return retfiles;
+}
+
 /**
  * This function retrieves the contents of a certain folder
  * with id parent on a certain storage on a certain device.
  * The result contains both files and folders.
- * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
  *
- * NOTE: the request will always perform I/O with the device.
+ * NOTE: on a device opened with LIBMTP_Open_Raw_Device_Uncached()
+ * the request will always perform I/O with the device. A cached
+ * device lists the folder from its object cache.
  * @param device a pointer to the MTP device to report info from.
  * @param storage a storage on the device to report info from. If
  *        0 is passed in, the files for the given parent will be
@@ -4531,11 +5827,13 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
   unsigned int i = 0;
 
   if (device->cached) {
-    // This function is only supposed to be used by devices
-    // opened as uncached!
-    LIBMTP_ERROR("tried to use %s on a cached device!\n",
-		 __func__);
-    return NULL;
+    apply_cache_events(device);
+    // Get all the handles if we haven't already done that
+    if (params->nrofobjects == 0)
+      flush_handles(device);
+    else if (params->objects_lazy && parent != LIBMTP_FILES_AND_FOLDERS_ROOT)
+      load_folder(device, storage ? storage : PTP_GOH_ALL_STORAGE, parent);
+    return get_cached_files_and_folders(device, storage, parent);
   }
 
   if (storage == 0)
@@ -4559,29 +5857,685 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
   if (currentHandles.Handler == NULL || currentHandles.n == 0)
     return NULL;
 
-  for (i = 0; i < currentHandles.n; i++) {
-    LIBMTP_file_t *file;
+  for (i = 0; i < currentHandles.n; i++) {
+    LIBMTP_file_t *file;
+
+    // Get metadata for one file, if it fails, try next file
+    file = LIBMTP_Get_Filemetadata(device, currentHandles.Handler[i]);
+    if (file == NULL)
+      continue;
+
+    // Add track to a list that will be returned afterwards.
+    if (curfile == NULL) {
+      curfile = file;
+      retfiles = file;
+    } else {
+      curfile->next = file;
+      curfile = file;
+    }
+  }
+
+  free(currentHandles.Handler);
+
+  // Return a pointer to the original first file
+  // in the big list.
+  return retfiles;
+}
+
+/*
+ * Handles found by a query on the device, kept in the order they came
+ * in. Their metadata goes into the object cache like that of
+ * get_folder_metadata_fast().
+ */
+typedef struct {
+  fast_metadata_t fast;
+  uint32_t *handles;
+  unsigned int nrofhandles;
+  unsigned int allocated;
+} query_result_t;
+
+/* Adds a handle to the result of a query, once */
+static int add_query_handle(query_result_t *result, uint32_t handle)
+{
+  if (handle == 0 ||
+      (result->nrofhandles > 0 &&
+       result->handles[result->nrofhandles - 1] == handle))
+    return 0;
+  if (result->nrofhandles == result->allocated) {
+    unsigned int allocated = result->allocated ? result->allocated * 2 : 64;
+    uint32_t *tmp = realloc(result->handles, allocated * sizeof(uint32_t));
+
+    if (tmp == NULL)
+      return -1;
+    result->handles = tmp;
+    result->allocated = allocated;
+  }
+  result->handles[result->nrofhandles++] = handle;
+  return 0;
+}
+
+/*
+ * Called by the streaming property list decoder for each property
+ * that a query brings in.
+ */
+static uint16_t add_query_metadata(PTPParams *params, void *priv,
+				   MTPProperties *prop)
+{
+  query_result_t *result = (query_result_t *) priv;
+
+  if (add_query_handle(result, prop->ObjectHandle) != 0) {
+    ptp_destroy_object_prop(prop);
+    return PTP_RC_GeneralError;
+  }
+  return add_fast_metadata(params, &result->fast, prop);
+}
+
+/**
+ * Checks a cached object against the filters of a query, apart from
+ * where it is.
+ * @return non-zero if the object matches.
+ */
+static int query_matches(LIBMTP_mtpdevice_t *device,
+			 LIBMTP_query_t const * const query, PTPObject *ob)
+{
+  uint64_t filesize;
+  int i;
+
+  if (query->storage_id != 0 && ob->oi.StorageID != query->storage_id)
+    return 0;
+  if (query->filetypes != NULL) {
+    LIBMTP_filetype_t filetype = get_object_filetype(device, ob);
+
+    for (i = 0; i < query->nroffiletypes; i++) {
+      if (query->filetypes[i] == filetype)
+	break;
+    }
+    if (i == query->nroffiletypes)
+      return 0;
+  }
+  if (query->modified_since != 0 &&
+      ob->oi.ModificationDate < query->modified_since)
+    return 0;
+  filesize = get_cached_filesize(device, ob);
+  if (filesize < query->min_size ||
+      (query->max_size != 0 && filesize > query->max_size))
+    return 0;
+  return 1;
+}
+
+/**
+ * Returns non-zero if the device can be asked for the filetypes of a
+ * query by their object formats.
+ */
+static int query_by_format(LIBMTP_mtpdevice_t *device,
+			   LIBMTP_query_t const * const query)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  if (query->filetypes == NULL || query->nroffiletypes <= 0)
+    return 0;
+  // These devices lose track of which files are OGG or FLAC
+  return !FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
+    !FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
+    !FLAG_FLAC_IS_UNKNOWN(ptp_usb);
+}
+
+/**
+ * Lists the folders a query looks at into a lazily filled cache, one
+ * level of the tree at a time. Listing a folder drops the parent index,
+ * so it is only rebuilt once per level rather than once per folder.
+ * @return 0 on success, -1 when out of memory.
+ */
+static int load_query_folders(LIBMTP_mtpdevice_t *device,
+			      LIBMTP_query_t const * const query)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t storageid = query->storage_id ? query->storage_id :
+    PTP_GOH_ALL_STORAGE;
+  uint32_t *folders, *next = NULL;
+  unsigned int nroffolders = 0, nrofnext, allocated = 16;
+  unsigned int i;
+
+  folders = malloc(allocated * sizeof(uint32_t));
+  if (folders == NULL)
+    return -1;
+  folders[nroffolders++] = query->parent_id;
+  while (nroffolders > 0 && !listing_cancelled(device)) {
+    for (i = 0; i < nroffolders; i++)
+      if (folders[i] != LIBMTP_FILES_AND_FOLDERS_ROOT)
+	load_folder(device, storageid, folders[i]);
+    if (!query->subtree)
+      break;
+
+    // Then collect the next level, with the index built just once
+    next = malloc(allocated * sizeof(uint32_t));
+    if (next == NULL) {
+      free(folders);
+      return -1;
+    }
+    nrofnext = 0;
+    for (i = 0; i < nroffolders; i++) {
+      unsigned int r;
+
+      // The root folder is 0 in the cache, but some devices say 0xffffffff
+      for (r = 0; r < 2; r++) {
+	uint32_t key = r ? 0x00000000U : folders[i];
+	unsigned int *slots;
+	unsigned int n, j;
+
+	if (r && folders[i] != LIBMTP_FILES_AND_FOLDERS_ROOT)
+	  break;
+	if (ptp_object_children(params, key, 0, &slots, &n) != PTP_RC_OK)
+	  continue;
+	for (j = 0; j < n; j++) {
+	  PTPObject *ob = &params->objects[slots[j]];
+
+	  if (ob->oid == folders[i] ||
+	      ob->oi.ObjectFormat != PTP_OFC_Association)
+	    continue;
+	  if (nrofnext == allocated) {
+	    uint32_t *tmp = realloc(next, allocated * 2 * sizeof(uint32_t));
+
+	    if (tmp == NULL) {
+	      free(next);
+	      free(folders);
+	      return -1;
+	    }
+	    next = tmp;
+	    allocated *= 2;
+	  }
+	  next[nrofnext++] = ob->oid;
+	}
+      }
+    }
+    free(folders);
+    folders = next;
+    nroffolders = nrofnext;
+  }
+  free(folders);
+  return 0;
+}
+
+/**
+ * Runs a query over the object cache, using the parent index to look
+ * at just the folders asked for. Lazily listed folders are listed
+ * first.
+ */
+static int query_cache(LIBMTP_mtpdevice_t *device,
+		       LIBMTP_query_t const * const query,
+		       query_result_t *result)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *folders;
+  unsigned int nroffolders = 0, allocated = 16;
+  unsigned int i;
+
+  if (query->parent_id == 0) {
+    fill_cache(device);
+    for (i = 0; i < params->nrofobjects; i++) {
+      PTPObject *ob = &params->objects[i];
+
+      if (!PTPOBJECT_REMOVED(ob) && query_matches(device, query, ob) &&
+	  add_query_handle(result, ob->oid) != 0)
+	return -1;
+    }
+    return 0;
+  }
+
+  if (params->nrofobjects == 0)
+    flush_handles(device);
+  if (params->objects_lazy && load_query_folders(device, query) != 0)
+    return -1;
+  folders = malloc(allocated * sizeof(uint32_t));
+  if (folders == NULL)
+    return -1;
+  folders[nroffolders++] = query->parent_id;
+  while (nroffolders > 0) {
+    uint32_t folder = folders[--nroffolders];
+    unsigned int r;
+
+    // The root folder is 0 in the cache, but some devices say 0xffffffff
+    for (r = 0; r < 2; r++) {
+      uint32_t key = r ? 0x00000000U : folder;
+      unsigned int *slots;
+      unsigned int n, j;
+
+      if (r && folder != LIBMTP_FILES_AND_FOLDERS_ROOT)
+	break;
+      if (ptp_object_children(params, key, 0, &slots, &n) != PTP_RC_OK)
+	continue;
+      for (j = 0; j < n; j++) {
+	PTPObject *ob = &params->objects[slots[j]];
+
+	if (ob->oid == folder)
+	  continue;
+	if (query_matches(device, query, ob) &&
+	    add_query_handle(result, ob->oid) != 0) {
+	  free(folders);
+	  return -1;
+	}
+	if (query->subtree && ob->oi.ObjectFormat == PTP_OFC_Association) {
+	  if (nroffolders == allocated) {
+	    uint32_t *tmp = realloc(folders, allocated * 2 * sizeof(uint32_t));
+
+	    if (tmp == NULL) {
+	      free(folders);
+	      return -1;
+	    }
+	    folders = tmp;
+	    allocated *= 2;
+	  }
+	  folders[nroffolders++] = ob->oid;
+	}
+      }
+    }
+  }
+  free(folders);
+  return 0;
+}
+
+/**
+ * Runs a query with GetObjPropList, handing the format filter and the
+ * folder to the device, one request per format. The rest is filtered
+ * here.
+ */
+static uint16_t query_device_fast(LIBMTP_mtpdevice_t *device,
+				  LIBMTP_query_t const * const query,
+				  query_result_t *result)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t handle, depth;
+  unsigned int firsthandle = result->nrofhandles;
+  unsigned int i, j;
+  int nrofprops;
+  int f, nrofformats = 1;
+  int byformat = query_by_format(device, query);
+  uint16_t ret = PTP_RC_OK;
+
+  if (query->parent_id == 0) {
+    if (FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb) ||
+	(params->listing_flags & LISTING_ALL_FAILS))
+      return PTP_RC_OperationNotSupported;
+    handle = 0xffffffffU;
+    depth = 0xffffffffU;
+  } else {
+    if (!use_folder_metadata_fast(device))
+      return PTP_RC_OperationNotSupported;
+    handle = (query->parent_id == LIBMTP_FILES_AND_FOLDERS_ROOT) ?
+      0x00000000U : query->parent_id;
+    depth = query->subtree ? 0xffffffffU : 1;
+  }
+
+  // A long list of formats is better asked for all at once
+  if (byformat && query->nroffiletypes <= 4)
+    nrofformats = query->nroffiletypes;
+  else
+    byformat = 0;
+
+  for (f = 0; f < nrofformats && ret == PTP_RC_OK; f++) {
+    uint32_t format = 0x00000000U;
+
+    if (byformat)
+      format = map_libmtp_type_to_ptp_type(query->filetypes[f]);
+    result->fast.ob = NULL;
+    result->fast.firstnew = params->nrofobjects;
+    result->fast.skip = 0;
+    ret = ptp_mtp_getobjectproplist_stream_generic(params, handle, format,
+						   0xffffffffU, 0, depth,
+						   add_query_metadata, result,
+						   &nrofprops);
+    if (result->fast.ob != NULL)
+      finish_fast_metadata_object(params, result->fast.ob);
+  }
+  if (ret != PTP_RC_OK) {
+    result->nrofhandles = firsthandle;
+    return ret;
+  }
+
+  // Keep what passes the filters the device did not take
+  for (i = j = firsthandle; i < result->nrofhandles; i++) {
+    PTPObject *ob;
+
+    if (result->handles[i] == handle ||
+	ptp_object_find(params, result->handles[i], &ob) != PTP_RC_OK ||
+	!query_matches(device, query, ob))
+      continue;
+    result->handles[j++] = result->handles[i];
+  }
+  result->nrofhandles = j;
+  return PTP_RC_OK;
+}
+
+/**
+ * Runs a query with GetObjectHandles and one GetObjectInfo per object,
+ * walking down the folders for a subtree. The device filters on the
+ * storage, the folder and, for a single format, the format.
+ */
+static uint16_t query_device(LIBMTP_mtpdevice_t *device,
+			     LIBMTP_query_t const * const query,
+			     query_result_t *result)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t storageid = query->storage_id ? query->storage_id :
+    PTP_GOH_ALL_STORAGE;
+  uint32_t format = PTP_GOH_ALL_FORMATS;
+  uint32_t *folders;
+  unsigned int nroffolders = 0, allocated = 16;
+  uint16_t ret = PTP_RC_OK;
+
+  // The subfolders have to be seen to walk down
+  if (query_by_format(device, query) && query->nroffiletypes == 1 &&
+      (!query->subtree || query->parent_id == 0))
+    format = map_libmtp_type_to_ptp_type(query->filetypes[0]);
+
+  folders = malloc(allocated * sizeof(uint32_t));
+  if (folders == NULL)
+    return PTP_RC_GeneralError;
+  folders[nroffolders++] = query->parent_id;
+  while (nroffolders > 0 && ret == PTP_RC_OK) {
+    uint32_t folder = folders[--nroffolders];
+    PTPObjectHandles handles;
+    unsigned int i;
+
+    ret = ptp_getobjecthandles(params, storageid, format, folder, &handles);
+    if (ret != PTP_RC_OK)
+      break;
+    for (i = 0; i < handles.n; i++) {
+      PTPObject *ob;
+
+      if (handles.Handler[i] == folder ||
+	  ptp_object_want(params, handles.Handler[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob) != PTP_RC_OK)
+	continue;
+      if (query_matches(device, query, ob) &&
+	  add_query_handle(result, ob->oid) != 0) {
+	ret = PTP_RC_GeneralError;
+	break;
+      }
+      if (query->subtree && query->parent_id != 0 &&
+	  ob->oi.ObjectFormat == PTP_OFC_Association) {
+	if (nroffolders == allocated) {
+	  uint32_t *tmp = realloc(folders, allocated * 2 * sizeof(uint32_t));
+
+	  if (tmp == NULL) {
+	    ret = PTP_RC_GeneralError;
+	    break;
+	  }
+	  folders = tmp;
+	  allocated *= 2;
+	}
+	folders[nroffolders++] = ob->oid;
+      }
+    }
+    free(handles.Handler);
+  }
+  free(folders);
+  return ret;
+}
+
+/**
+ * This function lists the files and folders of a device that match a
+ * number of filters at once, e.g. all photos taken since some time:
+ *
+ * <pre>
+ * LIBMTP_filetype_t photos[] = { LIBMTP_FILETYPE_JPEG };
+ * LIBMTP_query_t query;
+ * LIBMTP_file_t *files;
+ *
+ * memset(&query, 0, sizeof(query));
+ * query.filetypes = photos;
+ * query.nroffiletypes = 1;
+ * query.modified_since = last_sync;
+ * files = LIBMTP_Query_Files(device, &query);
+ * </pre>
+ *
+ * On a device with an object cache the query is answered out of the
+ * cache, looking only at the folders asked for if any. Otherwise the
+ * filters that the device can take are handed to it, so the above takes
+ * a single GetObjPropList on most devices, and the rest are applied to
+ * what comes back.
+ *
+ * @param device a pointer to the device to query.
+ * @param query the filters, see <code>LIBMTP_query_t</code>.
+ * @return a list of files and folders that can be followed using the
+ *         <code>next</code> field of the <code>LIBMTP_file_t</code> data
+ *         structure, or NULL if nothing matches. Each of the entries
+ *         must be freed after use.
+ */
+LIBMTP_file_t *LIBMTP_Query_Files(LIBMTP_mtpdevice_t *device,
+				  LIBMTP_query_t const * const query)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *retfiles = NULL;
+  LIBMTP_file_t *curfile = NULL;
+  query_result_t result;
+  unsigned int i;
+  uint16_t ret;
+
+  memset(&result, 0, sizeof(result));
+  result.fast.device = device;
+
+  if (device->cached) {
+    apply_cache_events(device);
+    if (query_cache(device, query, &result) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Query_Files(): out of memory.");
+      free(result.handles);
+      return NULL;
+    }
+  } else {
+    ret = PTP_RC_OperationNotSupported;
+    if (ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) &&
+	!FLAG_BROKEN_MTPGETOBJPROPLIST((PTP_USB*) device->usbinfo))
+      ret = query_device_fast(device, query, &result);
+    if (ret != PTP_RC_OK)
+      ret = query_device(device, query, &result);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Query_Files(): "
+				  "could not list the objects.");
+      free(result.handles);
+      return NULL;
+    }
+  }
+
+  for (i = 0; i < result.nrofhandles; i++) {
+    LIBMTP_file_t *file;
+    PTPObject *ob;
+
+    if (ptp_object_find(params, result.handles[i], &ob) != PTP_RC_OK)
+      continue;
+    file = obj2file(device, ob);
+    if (file == NULL)
+      continue;
+
+    if (curfile == NULL) {
+      curfile = file;
+      retfiles = file;
+    } else {
+      curfile->next = file;
+      curfile = file;
+    }
+  }
+  free(result.handles);
+  return retfiles;
+}
+
+/**
+ * Compares a path component of a certain length to a file name,
+ * ignoring case the same way the parent index orders the names.
+ */
+static int compare_path_component(const char *component, size_t len,
+				  const char *name)
+{
+  int ret;
+
+  if (name == NULL)
+    return 1;
+  ret = strncasecmp(component, name, len);
+  if (ret != 0)
+    return ret;
+  return (name[len] == '\0') ? 0 : -1;
+}
+
+/**
+ * Looks up a child of a certain name in the object cache, by binary
+ * search among the children of the parent sorted by name. A name
+ * that matches exactly beats one that only differs in case.
+ * @return 0 if found, any other value means it is not there.
+ */
+static int find_cached_child(PTPParams *params, uint32_t storage,
+			     uint32_t parent, const char *component,
+			     size_t len, uint32_t *handle)
+{
+  unsigned int *slots;
+  unsigned int nrofslots;
+  unsigned int lo = 0, hi, i;
+  int found = 0;
+
+  if (ptp_object_children(params, parent, 1, &slots, &nrofslots) != PTP_RC_OK)
+    return -1;
+  hi = nrofslots;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (compare_path_component(component, len,
+			       params->objects[slots[mid]].oi.Filename) > 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (i = lo; i < nrofslots; i++) {
+    PTPObject *ob = &params->objects[slots[i]];
+
+    if (compare_path_component(component, len, ob->oi.Filename) != 0)
+      break;
+    if (storage != 0 && storage != ob->oi.StorageID)
+      continue;
+    if (!found)
+      *handle = ob->oid;
+    found = 1;
+    if (!strncmp(component, ob->oi.Filename, len)) {
+      *handle = ob->oid;
+      break;
+    }
+  }
+  return found ? 0 : -1;
+}
+
+/**
+ * Looks up a child of a certain name on the device itself, listing
+ * just that one folder.
+ * @return 0 if found, any other value means it is not there.
+ */
+static int find_uncached_child(LIBMTP_mtpdevice_t *device, uint32_t storage,
+			       uint32_t parent, const char *component,
+			       size_t len, uint32_t *handle)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectHandles currentHandles;
+  unsigned int i;
+  int found = 0;
+  uint16_t ret;
+
+  ret = ptp_getobjecthandles(params,
+			     storage ? storage : PTP_GOH_ALL_STORAGE,
+			     PTP_GOH_ALL_FORMATS,
+			     parent ? parent : PTP_GOH_ROOT_PARENT,
+			     &currentHandles);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "find_uncached_child(): "
+				"could not get object handles.");
+    return -1;
+  }
+
+  for (i = 0; i < currentHandles.n; i++) {
+    PTPObject *ob;
+
+    ret = ptp_object_want(params, currentHandles.Handler[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
+    if (ret != PTP_RC_OK)
+      continue;
+    if (compare_path_component(component, len, ob->oi.Filename) != 0)
+      continue;
+    if (!found)
+      *handle = ob->oid;
+    found = 1;
+    if (!strncmp(component, ob->oi.Filename, len)) {
+      *handle = ob->oid;
+      break;
+    }
+  }
+  free(currentHandles.Handler);
+  return found ? 0 : -1;
+}
+
+/**
+ * This function looks up the object at a certain path on a device,
+ * such as "/Music/Artist/Album/track.mp3". Names are compared with
+ * case ignored, as most devices do, but an exact match is preferred.
+ *
+ * On a cached device each step is a lookup in the object cache, so
+ * resolving a path costs next to nothing once the cache is filled.
+ * A device opened with LIBMTP_Open_Raw_Device_Uncached() lists only
+ * the folders along the path.
+ *
+ * @param device a pointer to the device to look the path up on.
+ * @param storage_id the storage to look in, or 0 to look in any
+ *        storage.
+ * @param path the path, with the folders separated by '/'. The
+ *        leading '/' is optional.
+ * @param object_id pointer to where the ID of the object is stored.
+ *        The root folder has ID 0, like the parent of the objects in
+ *        it.
+ * @return 0 on success, any other value means there is no such object
+ *         or the device could not be asked.
+ */
+int LIBMTP_Find_Object_By_Path(LIBMTP_mtpdevice_t *device,
+			       uint32_t const storage_id,
+			       char const * const path,
+			       uint32_t * const object_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  const char *p = path;
+  uint32_t parent = 0x00000000U;
+
+  if (device->cached)
+    apply_cache_events(device);
+  // Get all the handles if we haven't already done that
+  if (device->cached && params->nrofobjects == 0)
+    flush_handles(device);
 
-    // Get metadata for one file, if it fails, try next file
-    file = LIBMTP_Get_Filemetadata(device, currentHandles.Handler[i]);
-    if (file == NULL)
-      continue;
+  while (1) {
+    uint32_t handle = 0;
+    size_t len;
+    int ret;
 
-    // Add track to a list that will be returned afterwards.
-    if (curfile == NULL) {
-      curfile = file;
-      retfiles = file;
+    while (*p == '/')
+      p++;
+    if (*p == '\0')
+      break;
+    len = strcspn(p, "/");
+
+    if (device->cached) {
+      if (params->objects_lazy && parent != 0x00000000U)
+	load_folder(device, storage_id, parent);
+      ret = find_cached_child(params, storage_id, parent, p, len, &handle);
+      // Some buggy devices have their root folder at 0xffffffff
+      if (ret != 0 && parent == 0x00000000U)
+	ret = find_cached_child(params, storage_id, 0xffffffffU,
+				p, len, &handle);
     } else {
-      curfile->next = file;
-      curfile = file;
+      ret = find_uncached_child(device, storage_id, parent, p, len, &handle);
     }
+    if (ret != 0)
+      return -1;
+    parent = handle;
+    p += len;
   }
 
-  free(currentHandles.Handler);
-
-  // Return a pointer to the original first file
-  // in the big list.
-  return retfiles;
+  *object_id = parent;
+  return 0;
 }
 
 
@@ -4746,6 +6700,106 @@ static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPPrope
   }
 }
 
+/*
+ * Called by the streaming property list decoder while the properties
+ * of a folder full of tracks come in. Objects in the cache that have
+ * no proplist yet get the complete one, everything else is dropped.
+ */
+static uint16_t add_missing_props(PTPParams *params, void *priv,
+				  MTPProperties *prop)
+{
+  fast_metadata_t *fast = (fast_metadata_t *) priv;
+  PTPObject *ob = fast->ob;
+
+  if (ob == NULL || ob->oid != prop->ObjectHandle) {
+    if (ob != NULL)
+      ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+    fast->ob = NULL;
+    if (prop->ObjectHandle == 0 || prop->ObjectHandle == fast->skip ||
+	ptp_object_find(params, prop->ObjectHandle, &ob) != PTP_RC_OK ||
+	(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
+      fast->skip = prop->ObjectHandle;
+      ptp_destroy_object_prop(prop);
+      return PTP_RC_OK;
+    }
+    // Whatever bits came along with the object listing are replaced
+    ptp_free_object_mtpprops(params, ob);
+    fast->ob = ob;
+  }
+  return keep_object_prop(params, ob, prop);
+}
+
+static int compare_handles(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Fetches the properties of all tracks in the object cache that do not
+ * have them yet, with one GetObjPropList of depth 1 per folder holding
+ * such tracks instead of one or more transactions per track. Only done
+ * where folders can be listed that way, get_track_metadata() takes
+ * care of whatever is left.
+ * @param device a pointer to the MTP device.
+ * @param storage_id only look at tracks on this storage, 0 for all.
+ */
+static void get_track_props_by_folder(LIBMTP_mtpdevice_t *device,
+				      uint32_t const storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *folders;
+  unsigned int nroffolders = 0;
+  unsigned int i;
+
+  if (!use_folder_metadata_fast(device) || params->nrofobjects == 0)
+    return;
+  folders = malloc(params->nrofobjects * sizeof(uint32_t));
+  if (folders == NULL)
+    return;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    if (PTPOBJECT_REMOVED(ob) ||
+	(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED) ||
+	!LIBMTP_FILETYPE_IS_TRACK(map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat)) ||
+	(storage_id != 0 && ob->oi.StorageID != storage_id))
+      continue;
+    folders[nroffolders++] = ob->oi.ParentObject;
+  }
+  qsort(folders, nroffolders, sizeof(uint32_t), compare_handles);
+
+  for (i = 0; i < nroffolders; i++) {
+    fast_metadata_t fast;
+    int nrofprops;
+    uint16_t ret;
+
+    if (i > 0 && folders[i] == folders[i - 1])
+      continue;
+    fast.device = device;
+    fast.ob = NULL;
+    fast.firstnew = 0;
+    fast.skip = 0;
+    ret = ptp_mtp_getobjectproplist_stream_level(params, folders[i], 1,
+						 add_missing_props, &fast,
+						 &nrofprops);
+    // A list cut short leaves the last object incomplete
+    if (fast.ob != NULL && ret == PTP_RC_OK)
+      fast.ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+    if (ret == PTP_RC_OperationNotSupported ||
+	ret == PTP_RC_MTP_Specification_By_Depth_Unsupported) {
+      params->listing_flags |= LISTING_FOLDER_FAILS;
+      break;
+    }
+    if (ret != PTP_RC_OK)
+      LIBMTP_INFO("could not get the track properties in folder 0x%08x, "
+		  "fetching them one by one\n", folders[i]);
+  }
+  free(folders);
+}
+
 /**
  * This function retrieves the track metadata for a track
  * given by a unique ID.
@@ -4767,7 +6821,7 @@ static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat
    * If we have a cached, large set of metadata, then use it!
    */
   ret = ptp_object_want(params, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ob->mtpprops) {
+  if (ret == PTP_RC_OK && ob->mtpprops) {
     prop = ob->mtpprops;
     for (i=0;i<ob->nrofmtpprops;i++,prop++)
       pick_property_to_track_metadata(device, prop, track);
@@ -4958,9 +7012,9 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  fill_cache(device);
+  // and the metadata of the tracks in bulk where it is missing
+  get_track_props_by_folder(device, storage_id);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_track_t *track;
@@ -4971,6 +7025,8 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
       callback(i, params->nrofobjects, data);
 
     ob = &params->objects[i];
+    if (PTPOBJECT_REMOVED(ob))
+      continue;
     mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
 
     // Ignore stuff we don't know how to handle...
@@ -5377,6 +7433,8 @@ int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
   PTPDataHandler handler;
   handler.getfunc = NULL;
   handler.putfunc = put_func_wrapper;
+  handler.borrowfunc = NULL;
+  handler.commitfunc = NULL;
   handler.priv = &mtp_handler;
 
   ret = ptp_getobject_to_handler(params, id, &handler);
@@ -6075,6 +8133,8 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
   PTPDataHandler handler;
   handler.getfunc = get_func_wrapper;
   handler.putfunc = NULL;
+  handler.borrowfunc = NULL;
+  handler.commitfunc = NULL;
   handler.priv = &mtp_handler;
 
   ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
@@ -6397,6 +8457,176 @@ static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *file
   return 0;
 }
 
+/**
+ * Turns the metadata of a track into a property list for
+ * SetObjPropList. Only the given properties, i.e. the ones the device
+ * supports for the format of the track, and only those it allows to be
+ * set are included. Blank strings and blank ratings are left out.
+ * @param device a pointer to the device the track is on.
+ * @param metadata the track metadata to convert.
+ * @param properties the supported properties of the track format.
+ * @param propcnt the number of supported properties.
+ * @param props the property list to add to.
+ * @param nrofprops the number of properties in the list.
+ */
+static void add_track_props(LIBMTP_mtpdevice_t *device,
+			    LIBMTP_track_t const * const metadata,
+			    uint16_t const *properties, uint32_t propcnt,
+			    MTPProperties **props, int *nrofprops)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  MTPProperties *prop = NULL;
+  uint32_t i;
+
+  for (i=0;i<propcnt;i++) {
+    PTPObjectPropDesc opd;
+
+    ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
+    if (ret != PTP_RC_OK) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "add_track_props(): "
+			      "could not get property description.");
+    } else if (opd.GetSet) {
+      switch (properties[i]) {
+      case PTP_OPC_Name:
+	if (metadata->title == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Name;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->title);
+	break;
+      case PTP_OPC_AlbumName:
+	if (metadata->album == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AlbumName;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->album);
+	break;
+      case PTP_OPC_Artist:
+	if (metadata->artist == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Artist;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->artist);
+	break;
+      case PTP_OPC_Composer:
+	if (metadata->composer == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Composer;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->composer);
+	break;
+      case PTP_OPC_Genre:
+	if (metadata->genre == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Genre;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->genre);
+	break;
+      case PTP_OPC_Duration:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Duration;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->duration, &opd);
+	break;
+      case PTP_OPC_Track:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Track;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
+	break;
+      case PTP_OPC_OriginalReleaseDate:
+	if (metadata->date == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_OriginalReleaseDate;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->date);
+	break;
+      case PTP_OPC_SampleRate:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_SampleRate;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
+	break;
+      case PTP_OPC_NumberOfChannels:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_NumberOfChannels;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
+	break;
+      case PTP_OPC_AudioWAVECodec:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AudioWAVECodec;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
+	break;
+      case PTP_OPC_AudioBitRate:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AudioBitRate;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
+	break;
+      case PTP_OPC_BitRateType:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_BitRateType;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
+	break;
+      case PTP_OPC_Rating:
+	// TODO: shall this be set for rating 0?
+	if (metadata->rating == 0)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Rating;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->rating, &opd);
+	break;
+      case PTP_OPC_UseCount:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_UseCount;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
+	break;
+      case PTP_OPC_DateModified:
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  // Tag with current time if that is supported
+	  prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_DateModified;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = get_iso8601_stamp();
+	}
+	break;
+      default:
+	break;
+      }
+    }
+    ptp_free_objectpropdesc(&opd);
+  }
+}
+
 /**
  * This function updates the MTP track object metadata on a
  * single file identified by an object ID.
@@ -6436,154 +8666,9 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
   if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
       !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
     MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
     int nrofprops = 0;
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
-
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  if (metadata->title == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->title);
-	  break;
-	case PTP_OPC_AlbumName:
-	  if (metadata->album == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AlbumName;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->album);
-	  break;
-	case PTP_OPC_Artist:
-	  if (metadata->artist == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Artist;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->artist);
-	  break;
-	case PTP_OPC_Composer:
-	  if (metadata->composer == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Composer;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->composer);
-	  break;
-	case PTP_OPC_Genre:
-	  if (metadata->genre == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Genre;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->genre);
-	  break;
-	case PTP_OPC_Duration:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Duration;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->duration, &opd);
-	  break;
-	case PTP_OPC_Track:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Track;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  if (metadata->date == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_OriginalReleaseDate;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->date);
-	  break;
-	case PTP_OPC_SampleRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_SampleRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_NumberOfChannels;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioWAVECodec;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioBitRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
-	  break;
-	case PTP_OPC_BitRateType:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_BitRateType;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
-	  break;
-	case PTP_OPC_Rating:
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating == 0)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Rating;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->rating, &opd);
-	  break;
-	case PTP_OPC_UseCount:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_UseCount;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = metadata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	  }
-	  break;
-	default:
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
+    add_track_props(device, metadata, properties, propcnt, &props, &nrofprops);
 
     // NOTE: File size is not updated, this should not change anyway.
     // neither will we change the filename.
@@ -6767,29 +8852,586 @@ int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
 	  }
 	  break;
 
-	  // NOTE: File size is not updated, this should not change anyway.
-	  // neither will we change the filename.
-	default:
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
-  } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-                            "Your device doesn't seem to support any known way of setting metadata.");
-    free(properties);
+	  // NOTE: File size is not updated, this should not change anyway.
+	  // neither will we change the filename.
+	default:
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+                            "Your device doesn't seem to support any known way of setting metadata.");
+    free(properties);
+    return -1;
+  }
+
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, metadata->item_id);
+
+  free(properties);
+
+  return 0;
+}
+
+/*
+ * Metadata changes to many objects, held back until
+ * LIBMTP_Flush_Metadata_Batch() sends them all at once.
+ */
+struct LIBMTP_metadata_batch_struct {
+  LIBMTP_mtpdevice_t *device;
+  MTPProperties *props; /* In the order the changes were made */
+  int nrofprops;
+  int allocated;
+};
+
+/**
+ * This creates a new, empty batch of metadata changes for a device.
+ * Changes are added to it with <code>LIBMTP_Batch_Set_Object_*()</code>
+ * and <code>LIBMTP_Batch_Update_Track_Metadata()</code>, and nothing is
+ * written to the device until <code>LIBMTP_Flush_Metadata_Batch()</code>
+ * is called. This is much faster than setting the metadata of one
+ * object at a time when tagging whole albums or libraries.
+ * @param device a pointer to the device the objects are on.
+ * @return a new batch, to be freed with
+ *         <code>LIBMTP_Destroy_Metadata_Batch()</code>, or NULL if
+ *         out of memory.
+ * @see LIBMTP_Flush_Metadata_Batch()
+ */
+LIBMTP_metadata_batch_t *LIBMTP_New_Metadata_Batch(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_metadata_batch_t *batch;
+
+  if (device == NULL)
+    return NULL;
+  batch = calloc(1, sizeof(LIBMTP_metadata_batch_t));
+  if (batch == NULL)
+    return NULL;
+  batch->device = device;
+  return batch;
+}
+
+/**
+ * This destroys a batch of metadata changes. Changes that have not
+ * been flushed are dropped and never written to the device.
+ * @param batch the batch to destroy.
+ */
+void LIBMTP_Destroy_Metadata_Batch(LIBMTP_metadata_batch_t *batch)
+{
+  if (batch == NULL)
+    return;
+  ptp_destroy_object_prop_list(batch->props, batch->nrofprops);
+  free(batch);
+}
+
+/* Room for one more change, NULL if out of memory */
+static MTPProperties *new_batch_prop(LIBMTP_metadata_batch_t *batch)
+{
+  MTPProperties *prop;
+
+  if (batch->nrofprops == batch->allocated) {
+    int allocated = batch->allocated ? batch->allocated * 2 : 64;
+    MTPProperties *tmp = realloc(batch->props,
+				 allocated * sizeof(MTPProperties));
+
+    if (tmp == NULL)
+      return NULL;
+    batch->props = tmp;
+    batch->allocated = allocated;
+  }
+  prop = &batch->props[batch->nrofprops++];
+  memset(prop, 0, sizeof(MTPProperties));
+  return prop;
+}
+
+static int add_batch_prop(LIBMTP_metadata_batch_t *batch,
+			  uint32_t const object_id, uint16_t const property,
+			  uint16_t const datatype,
+			  PTPPropertyValue const * const value)
+{
+  MTPProperties *prop;
+
+  if (batch == NULL || object_id == 0)
+    return -1;
+  prop = new_batch_prop(batch);
+  if (prop == NULL)
     return -1;
+  prop->ObjectHandle = object_id;
+  prop->property = property;
+  prop->datatype = datatype;
+  prop->propval = *value;
+  if (datatype == PTP_DTC_STR) {
+    prop->propval.str = strdup(value->str);
+    if (prop->propval.str == NULL) {
+      batch->nrofprops--;
+      return -1;
+    }
   }
+  return 0;
+}
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, metadata->item_id);
+/**
+ * Adds setting an object attribute from a string to a batch of
+ * metadata changes. A later change to the same attribute of the same
+ * object replaces this one.
+ *
+ * @param batch the batch to add the change to.
+ * @param object_id Object reference
+ * @param attribute_id MTP attribute ID
+ * @param string string value to set
+ * @return 0 on success, any other value means failure
+ */
+int LIBMTP_Batch_Set_Object_String(LIBMTP_metadata_batch_t *batch,
+				   uint32_t const object_id,
+				   LIBMTP_property_t const attribute_id,
+				   char const * const string)
+{
+  PTPPropertyValue propval;
+
+  if (string == NULL)
+    return -1;
+  propval.str = (char *) string;
+  return add_batch_prop(batch, object_id,
+			map_libmtp_property_to_ptp_property(attribute_id),
+			PTP_DTC_STR, &propval);
+}
+
+/**
+ * Adds setting an object attribute from an unsigned 32-bit integer to
+ * a batch of metadata changes.
+ *
+ * @param batch the batch to add the change to.
+ * @param object_id Object reference
+ * @param attribute_id MTP attribute ID
+ * @param value 32-bit unsigned integer to set
+ * @return 0 on success, any other value means failure
+ */
+int LIBMTP_Batch_Set_Object_u32(LIBMTP_metadata_batch_t *batch,
+				uint32_t const object_id,
+				LIBMTP_property_t const attribute_id,
+				uint32_t const value)
+{
+  PTPPropertyValue propval;
+
+  propval.u32 = value;
+  return add_batch_prop(batch, object_id,
+			map_libmtp_property_to_ptp_property(attribute_id),
+			PTP_DTC_UINT32, &propval);
+}
+
+/**
+ * Adds setting an object attribute from an unsigned 16-bit integer to
+ * a batch of metadata changes.
+ *
+ * @param batch the batch to add the change to.
+ * @param object_id Object reference
+ * @param attribute_id MTP attribute ID
+ * @param value 16-bit unsigned integer to set
+ * @return 0 on success, any other value means failure
+ */
+int LIBMTP_Batch_Set_Object_u16(LIBMTP_metadata_batch_t *batch,
+				uint32_t const object_id,
+				LIBMTP_property_t const attribute_id,
+				uint16_t const value)
+{
+  PTPPropertyValue propval;
 
+  propval.u16 = value;
+  return add_batch_prop(batch, object_id,
+			map_libmtp_property_to_ptp_property(attribute_id),
+			PTP_DTC_UINT16, &propval);
+}
+
+/**
+ * Adds setting an object attribute from an unsigned 8-bit integer to
+ * a batch of metadata changes.
+ *
+ * @param batch the batch to add the change to.
+ * @param object_id Object reference
+ * @param attribute_id MTP attribute ID
+ * @param value 8-bit unsigned integer to set
+ * @return 0 on success, any other value means failure
+ */
+int LIBMTP_Batch_Set_Object_u8(LIBMTP_metadata_batch_t *batch,
+			       uint32_t const object_id,
+			       LIBMTP_property_t const attribute_id,
+			       uint8_t const value)
+{
+  PTPPropertyValue propval;
+
+  propval.u8 = value;
+  return add_batch_prop(batch, object_id,
+			map_libmtp_property_to_ptp_property(attribute_id),
+			PTP_DTC_UINT8, &propval);
+}
+
+/**
+ * Adds the track metadata of a single file to a batch of metadata
+ * changes. It is written the way <code>LIBMTP_Update_Track_Metadata()</code>
+ * would write it: properties the device does not support or allow to
+ * be set for the format of the track, as well as blank strings, are
+ * left out.
+ * @param batch the batch to add the changes to.
+ * @param metadata a track metadata set to be written to the file,
+ *        the <code>item_id</code> field must be correct.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Track_Metadata()
+ */
+int LIBMTP_Batch_Update_Track_Metadata(LIBMTP_metadata_batch_t *batch,
+				       LIBMTP_track_t const * const metadata)
+{
+  LIBMTP_mtpdevice_t *device;
+  MTPProperties *props = NULL;
+  MTPProperties *prop;
+  int nrofprops = 0;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  uint16_t ret;
+  int i;
+
+  if (batch == NULL || metadata == NULL || metadata->item_id == 0)
+    return -1;
+  device = batch->device;
+  ret = ptp_mtp_getobjectpropssupported((PTPParams *) device->params,
+					map_libmtp_type_to_ptp_type(metadata->filetype),
+					&propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Batch_Update_Track_Metadata(): "
+				"could not retrieve supported object properties.");
+    return -1;
+  }
+  add_track_props(device, metadata, properties, propcnt, &props, &nrofprops);
   free(properties);
 
+  // Take over the values, strings and all
+  for (i = 0; i < nrofprops; i++) {
+    prop = new_batch_prop(batch);
+    if (prop == NULL) {
+      for (; i < nrofprops; i++)
+	ptp_destroy_object_prop(&props[i]);
+      free(props);
+      return -1;
+    }
+    *prop = props[i];
+  }
+  free(props);
   return 0;
 }
 
+/*
+ * Updates the object cache after a property has been written to the
+ * device, instead of reading the whole object back in.
+ */
+static void update_cached_prop(PTPParams *params, MTPProperties const *prop)
+{
+  PTPObject *ob;
+  MTPProperties *cached;
+  unsigned int i;
+
+  if (ptp_object_find(params, prop->ObjectHandle, &ob) != PTP_RC_OK)
+    return;
+  if (prop->datatype == PTP_DTC_STR) {
+    if (prop->property == PTP_OPC_ObjectFileName) {
+      ptp_strrelease(params, ob->oi.Filename);
+      ob->oi.Filename = ptp_strintern(params, prop->propval.str);
+      // The children of the parent are sorted by name
+      ptp_object_changed(params, ob);
+    } else if (prop->property == PTP_OPC_DateModified) {
+      ob->oi.ModificationDate = ptp_parse_datetime(prop->propval.str);
+    }
+  } else if (prop->property == PTP_OPC_ParentObject &&
+	     prop->datatype == PTP_DTC_UINT32) {
+    ob->oi.ParentObject = prop->propval.u32;
+    ptp_object_changed(params, ob);
+  }
+  // A partial proplist would pass for the complete one
+  if (!(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED))
+    return;
+  for (i = 0; i < ob->nrofmtpprops; i++) {
+    cached = &ob->mtpprops[i];
+    if (cached->property != prop->property ||
+	cached->ObjectHandle != prop->ObjectHandle)
+      continue;
+    if (cached->datatype == PTP_DTC_STR) {
+      ptp_strrelease(params, cached->propval.str);
+      cached->propval.str = NULL;
+    }
+    break;
+  }
+  if (i == ob->nrofmtpprops) {
+    // The filename and parent live in the object info
+    if (prop->property == PTP_OPC_ObjectFileName ||
+	prop->property == PTP_OPC_ParentObject)
+      return;
+    cached = ptp_object_new_mtpprop(params, ob);
+    if (cached == NULL)
+      return;
+  }
+  *cached = *prop;
+  if (prop->datatype == PTP_DTC_STR)
+    cached->propval.str = ptp_strintern(params, prop->propval.str);
+}
+
+/* Errors that may just mean the property list was too much at once */
+static int is_proplist_size_error(uint16_t ret)
+{
+  return ret == PTP_RC_MTP_Object_Too_Large ||
+    ret == PTP_RC_MTP_Invalid_Dataset ||
+    ret == PTP_RC_IncompleteTransfer ||
+    ret == PTP_RC_GeneralError;
+}
+
+/* The number of objects in a property list sorted by object */
+static unsigned int count_prop_objects(MTPProperties const *props, int nrofprops)
+{
+  unsigned int n = 0;
+  int i;
+
+  for (i = 0; i < nrofprops; i++)
+    if (i == 0 || props[i].ObjectHandle != props[i - 1].ObjectHandle)
+      n++;
+  return n;
+}
+
+/* Where the properties of the n:th object start */
+static int find_prop_object(MTPProperties const *props, int nrofprops,
+			    unsigned int n)
+{
+  int i;
+
+  for (i = 1; i < nrofprops; i++)
+    if (props[i].ObjectHandle != props[i - 1].ObjectHandle && --n == 0)
+      return i;
+  return nrofprops;
+}
+
+/* Writes properties one at a time, for the last resort */
+static int set_props_one_by_one(LIBMTP_mtpdevice_t *device,
+				MTPProperties *props, int nrofprops)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+  int i, failed = 0;
+
+  for (i = 0; i < nrofprops; i++) {
+    ret = ptp_mtp_setobjectpropvalue(params, props[i].ObjectHandle,
+				     props[i].property, &props[i].propval,
+				     props[i].datatype);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Flush_Metadata_Batch(): "
+				  "could not set object property.");
+      failed = 1;
+      continue;
+    }
+    update_cached_prop(params, &props[i]);
+  }
+  return failed ? -1 : 0;
+}
+
+/*
+ * Sends the properties of the given objects with one SetObjPropList.
+ * If the device will not take them, the objects are split in halves
+ * which are tried separately, so a single troublesome object does not
+ * spoil the rest. Only halves the device said were too large lower the
+ * limit for the rest of the session, the generic errors might as well
+ * come from one bad value.
+ */
+static int set_proplist_split(LIBMTP_mtpdevice_t *device,
+			      MTPProperties *props, int nrofprops,
+			      unsigned int nrofobjects)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  unsigned int half;
+  uint16_t ret;
+  int i, split;
+
+  // No use trying more than an earlier half was found to be too many
+  if (params->proplist_maxobjects != 0 &&
+      nrofobjects > params->proplist_maxobjects)
+    goto split;
+  ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+  if (ret == PTP_RC_OK) {
+    for (i = 0; i < nrofprops; i++)
+      update_cached_prop(params, &props[i]);
+    return 0;
+  }
+  if (nrofobjects == 1) {
+    if (is_proplist_size_error(ret) &&
+	ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue))
+      return set_props_one_by_one(device, props, nrofprops);
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Flush_Metadata_Batch(): "
+				"could not set object property list.");
+    return -1;
+  }
+  if (is_proplist_size_error(ret))
+    LIBMTP_INFO("SetObjPropList failed with %u objects, trying fewer\n",
+		nrofobjects);
+  // Only an explicit complaint about the size is worth remembering
+  if (ret == PTP_RC_MTP_Object_Too_Large)
+    params->proplist_maxobjects = nrofobjects - nrofobjects / 2;
+ split:
+  half = nrofobjects / 2;
+  split = find_prop_object(props, nrofprops, half);
+  // Both halves get their go
+  i = set_proplist_split(device, props, split, half);
+  if (set_proplist_split(device, props + split, nrofprops - split,
+			 nrofobjects - half) != 0)
+    i = -1;
+  return i;
+}
+
+/* Orders the changes by object, then property, then when they were made */
+static int compare_batch_props(const void *a, const void *b)
+{
+  MTPProperties const *x = *(MTPProperties const * const *) a;
+  MTPProperties const *y = *(MTPProperties const * const *) b;
+
+  if (x->ObjectHandle != y->ObjectHandle)
+    return x->ObjectHandle < y->ObjectHandle ? -1 : 1;
+  if (x->property != y->property)
+    return x->property < y->property ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * This writes all changes in a batch of metadata changes to the
+ * device, with as few SetObjPropList transactions as the device will
+ * take. Devices that do not support that get one SetObjectPropValue
+ * per change. The object cache is updated in place. The batch is
+ * empty afterwards, whether all changes could be written or not.
+ * @param batch the batch to write.
+ * @return 0 on success, any other value means that some or all of
+ *         the changes could not be written, see the error stack of
+ *         the device for details.
+ */
+int LIBMTP_Flush_Metadata_Batch(LIBMTP_metadata_batch_t *batch)
+{
+  LIBMTP_mtpdevice_t *device;
+  PTPParams *params;
+  PTP_USB *ptp_usb;
+  MTPProperties **order;
+  MTPProperties *props;
+  unsigned int nrofobjects, limit;
+  int nrofprops = 0;
+  int i, start, end;
+  int ret = 0;
+
+  if (batch == NULL)
+    return -1;
+  if (batch->nrofprops == 0)
+    return 0;
+  device = batch->device;
+  params = (PTPParams *) device->params;
+  ptp_usb = (PTP_USB *) device->usbinfo;
+
+  // Group the changes by object, only the last change of a property counts
+  order = malloc(batch->nrofprops * sizeof(MTPProperties *));
+  props = malloc(batch->nrofprops * sizeof(MTPProperties));
+  if (order == NULL || props == NULL) {
+    free(order);
+    free(props);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Flush_Metadata_Batch(): out of memory.");
+    return -1;
+  }
+  for (i = 0; i < batch->nrofprops; i++)
+    order[i] = &batch->props[i];
+  qsort(order, batch->nrofprops, sizeof(MTPProperties *), compare_batch_props);
+  for (i = 0; i < batch->nrofprops; i++) {
+    if (i + 1 < batch->nrofprops &&
+	order[i + 1]->ObjectHandle == order[i]->ObjectHandle &&
+	order[i + 1]->property == order[i]->property) {
+      ptp_destroy_object_prop(order[i]);
+      continue;
+    }
+    props[nrofprops++] = *order[i];
+  }
+  free(order);
+  // The batch starts over empty
+  free(batch->props);
+  batch->props = NULL;
+  batch->nrofprops = 0;
+  batch->allocated = 0;
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    nrofobjects = count_prop_objects(props, nrofprops);
+    for (start = 0; start < nrofprops; start = end) {
+      unsigned int n = nrofobjects;
+
+      // Stay within what the device was seen to take
+      limit = params->proplist_maxobjects;
+      if (limit != 0 && n > limit)
+	n = limit;
+      end = start + find_prop_object(props + start, nrofprops - start, n);
+      if (set_proplist_split(device, props + start, end - start, n) != 0)
+	ret = -1;
+      nrofobjects -= n;
+    }
+  } else if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
+    ret = set_props_one_by_one(device, props, nrofprops);
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Flush_Metadata_Batch(): "
+			    "Your device doesn't seem to support any known way of setting metadata.");
+    ret = -1;
+  }
+  ptp_destroy_object_prop_list(props, nrofprops);
+  return ret;
+}
+
+/**
+ * Collects the handles of everything below a folder in the object
+ * cache, all levels down. Leaves the list empty for anything but a
+ * cached folder, or when out of memory.
+ */
+static void get_cached_contents(PTPParams *params, uint32_t folder,
+				uint32_t **contents, unsigned int *nrofcontents)
+{
+  uint32_t *handles = NULL;
+  unsigned int nrofhandles = 0, allocated = 0;
+  unsigned int next = 0;
+  PTPObject *ob;
+
+  *contents = NULL;
+  *nrofcontents = 0;
+  if (ptp_object_find(params, folder, &ob) != PTP_RC_OK ||
+      ob->oi.ObjectFormat != PTP_OFC_Association)
+    return;
+  // Breadth first, the list itself is the queue of folders to look in
+  do {
+    unsigned int *slots;
+    unsigned int n, i;
+
+    if (ptp_object_children(params, folder, 0, &slots, &n) != PTP_RC_OK)
+      n = 0;
+    if (nrofhandles + n > allocated) {
+      uint32_t *tmp;
+
+      allocated = (nrofhandles + n) * 2;
+      tmp = realloc(handles, allocated * sizeof(uint32_t));
+      if (tmp == NULL) {
+	free(handles);
+	return;
+      }
+      handles = tmp;
+    }
+    for (i = 0; i < n; i++)
+      if (params->objects[slots[i]].oid != folder)
+	handles[nrofhandles++] = params->objects[slots[i]].oid;
+    // Find the next folder to look in
+    folder = 0;
+    while (next < nrofhandles && folder == 0) {
+      if (ptp_object_find(params, handles[next], &ob) == PTP_RC_OK &&
+	  ob->oi.ObjectFormat == PTP_OFC_Association)
+	folder = handles[next];
+      next++;
+    }
+  } while (folder != 0);
+  *contents = handles;
+  *nrofcontents = nrofhandles;
+}
+
 /**
  * This function deletes a single file, track, playlist, folder or
  * any other object off the MTP device, identified by the object ID.
@@ -6810,12 +9452,21 @@ int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  uint32_t *contents = NULL;
+  unsigned int nrofcontents = 0;
 
+  // What the cache holds of a folder goes with it
+  if (device->cached)
+    get_cached_contents(params, object_id, &contents, &nrofcontents);
   ret = ptp_deleteobject(params, object_id, 0);
   if (ret != PTP_RC_OK) {
+    free(contents);
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
     return -1;
   }
+  if (nrofcontents > 0)
+    ptp_remove_objects_from_cache(params, contents, nrofcontents);
+  free(contents);
 
   return 0;
 }
@@ -6854,6 +9505,9 @@ int LIBMTP_Move_Object(LIBMTP_mtpdevice_t *device,
     return -1;
   }
 
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, object_id);
+
   return 0;
 }
 
@@ -7279,80 +9933,24 @@ LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
 /**
  * Function used to recursively get subfolders from params.
  */
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent)
+static LIBMTP_folder_t *get_subfolders_for_folder(PTPParams *params,
+						  uint32_t storage,
+						  uint32_t parent)
 {
   LIBMTP_folder_t *retfolders = NULL;
-  LIBMTP_folder_t *children, *iter, *curr;
-
-  iter = list->sibling;
-  while(iter != list) {
-    if (iter->parent_id != parent) {
-      iter = iter->sibling;
-      continue;
-    }
-
-    /* We know that iter is a child of 'parent', therefore we can safely
-     * hold on to 'iter' locally since no one else will steal it
-     * from the 'list' as we recurse. */
-    children = get_subfolders_for_folder(list, iter->folder_id);
-
-    curr = iter;
-    iter = iter->sibling;
-
-    // Remove curr from the list.
-    curr->child->sibling = curr->sibling;
-    curr->sibling->child = curr->child;
-
-    // Attach the children to curr.
-    curr->child = children;
-
-    // Put this folder into the list of siblings.
-    curr->sibling = retfolders;
-    retfolders = curr;
-  }
-
-  return retfolders;
-}
-
-/**
- * This returns a list of all folders available
- * on the current MTP device.
- *
- * @param device a pointer to the device to get the folder listing for.
- * @param storage a storage ID to get the folder list from
- * @return a list of folders
- */
- LIBMTP_folder_t *LIBMTP_Get_Folder_List_For_Storage(LIBMTP_mtpdevice_t *device,
-						    uint32_t const storage)
-{
-  PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_folder_t head, *rv;
+  LIBMTP_folder_t *last = NULL;
+  unsigned int *slots;
+  unsigned int nrofslots;
   unsigned int i;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  if (ptp_object_children(params, parent, 0, &slots, &nrofslots) != PTP_RC_OK)
+    return NULL;
 
-  /*
-   * This creates a temporary list of the folders, this is in a
-   * reverse order and uses the Folder pointers that are already
-   * in the Folder structure. From this we can then build up the
-   * folder hierarchy with only looking at this temporary list,
-   * and removing the folders from this temporary list as we go.
-   * This significantly reduces the number of operations that we
-   * have to do in building the folder hierarchy. Also since the
-   * temp list is in reverse order, when we prepend to the sibling
-   * list things are in the same order as they were originally
-   * in the handle list.
-   */
-  head.sibling = &head;
-  head.child = &head;
-  for (i = 0; i < params->nrofobjects; i++) {
+  for (i = 0; i < nrofslots; i++) {
     LIBMTP_folder_t *folder;
     PTPObject *ob;
 
-    ob = &params->objects[i];
+    ob = &params->objects[slots[i]];
     if (ob->oi.ObjectFormat != PTP_OFC_Association) {
       continue;
     }
@@ -7361,6 +9959,11 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
       continue;
     }
 
+    // A folder that claims to be its own parent would never end
+    if (ob->oid == parent) {
+      continue;
+    }
+
     /*
      * Do we know how to handle these? They are part
      * of the MTP 1.0 specification paragraph 3.6.4.
@@ -7377,47 +9980,62 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
     folder = LIBMTP_new_folder_t();
     if (folder == NULL) {
       // malloc failure or so.
-      return NULL;
+      break;
     }
     folder->folder_id = ob->oid;
     folder->parent_id = ob->oi.ParentObject;
     folder->storage_id = ob->oi.StorageID;
     folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
 
-    // pretend sibling says next, and child says prev.
-    folder->sibling = head.sibling;
-    folder->child = &head;
-    head.sibling->child = folder;
-    head.sibling = folder;
+    // The children of the cache are not touched while we are at it
+    folder->child = get_subfolders_for_folder(params, storage, ob->oid);
+
+    // Keep the siblings in the same order as the handle list.
+    if (last == NULL)
+      retfolders = folder;
+    else
+      last->sibling = folder;
+    last = folder;
   }
 
-  // We begin at the given root folder and get them all recursively
-  rv = get_subfolders_for_folder(&head, 0x00000000U);
+  return retfolders;
+}
+
+/**
+ * This returns a list of all folders available
+ * on the current MTP device.
+ *
+ * @param device a pointer to the device to get the folder listing for.
+ * @param storage a storage ID to get the folder list from
+ * @return a list of folders
+ */
+ LIBMTP_folder_t *LIBMTP_Get_Folder_List_For_Storage(LIBMTP_mtpdevice_t *device,
+						    uint32_t const storage)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_folder_t *rv;
+
+  // Get all the handles if we haven't already done that
+  fill_cache(device);
+
+  /*
+   * The tree is built top down by looking up the children of each
+   * folder in the parent index of the object cache, so every object
+   * is only looked at once. Folders that can not be reached from the
+   * root this way, with a parent that is missing, are left out.
+   */
+  rv = get_subfolders_for_folder(params, storage, 0x00000000U);
 
   // Some buggy devices may have some files in the "root folder"
   // 0xffffffff so if 0x00000000 didn't return any folders,
   // look for children of the root 0xffffffffU
   if (rv == NULL) {
-    rv = get_subfolders_for_folder(&head, 0xffffffffU);
+    rv = get_subfolders_for_folder(params, storage, 0xffffffffU);
     if (rv != NULL)
       LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
 		   "this is a firmware bug (but continuing)\n");
   }
 
-  // The temp list should be empty. Clean up any orphans just in case.
-  while(head.sibling != &head) {
-    LIBMTP_folder_t *curr = head.sibling;
-
-    LIBMTP_INFO("Orphan folder with ID: 0x%08x name: \"%s\" encountered.\n",
-	   curr->folder_id,
-	   curr->name);
-    curr->sibling->child = curr->child;
-    curr->child->sibling = curr->sibling;
-    curr->child = NULL;
-    curr->sibling = NULL;
-    LIBMTP_destroy_folder_t(curr);
-  }
-
   return rv;
 }
 
@@ -7593,9 +10211,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
   uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  fill_cache(device);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_playlist_t *pl;
@@ -7603,6 +10219,8 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
     uint16_t ret;
 
     ob = &params->objects[i];
+    if (PTPOBJECT_REMOVED(ob))
+      continue;
 
     // Ignore stuff that isn't playlists
 
@@ -8567,8 +11185,7 @@ LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, ui
   uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
+  fill_cache(device);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_album_t *alb;
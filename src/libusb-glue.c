@@ -1098,6 +1098,8 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler) {
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->borrowfunc = NULL;
+	handler->commitfunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
@@ -1118,6 +1120,8 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->borrowfunc = NULL;
+	handler->commitfunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
@@ -2096,6 +2100,15 @@ void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout)
   *timeout = ptp_usb->timeout;
 }
 
+void set_usb_device_transfer_sizing(PTP_USB *ptp_usb,
+				    LIBMTP_transfer_sizing_t sizing,
+				    unsigned long blocksize)
+{
+  /* This backend always transfers in CONTEXT_BLOCK_SIZE blocks */
+  ptp_usb->transfer_sizing = sizing;
+  ptp_usb->transfer_block_size = CONTEXT_BLOCK_SIZE;
+}
+
 int guess_usb_speed(PTP_USB *ptp_usb)
 {
   int bytes_per_second;
@@ -107,6 +107,23 @@ struct _PTP_USB {
   uint64_t current_transfer_complete;
   LIBMTP_progressfunc_t current_transfer_callback;
   void const * current_transfer_callback_data;
+  /** Transfer block sizing, see set_usb_device_transfer_sizing() */
+  LIBMTP_transfer_sizing_t transfer_sizing;
+  unsigned long transfer_block_size;
+  unsigned long tune_bytes;
+  struct timeval tune_start;
+  double tune_best_rate;
+  unsigned long tune_best_size;
+  /** Receive buffer kept between transfers, possibly device memory */
+  unsigned char *recv_buffer;
+  unsigned long recv_buffer_size;
+  int recv_buffer_devmem;
+  /** Pipelined bulk IN transfers, a depth below 2 reads synchronously */
+  int read_queue_depth;
+  unsigned long read_block_size;
+  /** Pipelined bulk OUT transfers, a depth below 2 writes synchronously */
+  int write_queue_depth;
+  unsigned long write_block_size;
   /** Any special device flags, only used internally */
   LIBMTP_raw_device_t rawdevice;
 };
@@ -119,6 +136,9 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 					   void **usbinfo);
 void set_usb_device_timeout(PTP_USB *ptp_usb, int timeout);
 void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout);
+void set_usb_device_transfer_sizing(PTP_USB *ptp_usb,
+				    LIBMTP_transfer_sizing_t sizing,
+				    unsigned long blocksize);
 int guess_usb_speed(PTP_USB *ptp_usb);
 
 /* Flag check macros */
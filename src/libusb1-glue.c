@@ -114,6 +114,7 @@ static short ptp_read_func (unsigned long,
 		PTPDataHandler*, void *data, unsigned long*, int);
 static short ptp_read_cancel_func (PTPParams* params,
 		uint32_t transactionid);
+static void free_receive_buffer(PTP_USB *ptp_usb);
 static int usb_get_endpoint_status(PTP_USB* ptp_usb,
 		int ep, uint16_t* status);
 
@@ -822,7 +823,7 @@ libusb_glue_error (PTPParams *params, const char *format, ...)
  * 2. Send first packet, max size to be sizeof(endpoint) but only when using
  *    split headers. Else goto 3.
  * 3. REPEAT send 0x10000 byte chunks UNTIL remaining bytes < 0x10000
- *    We call 0x10000 CONTEXT_BLOCK_SIZE.
+ *    We call these chunks blocks, see the transfer block sizing below.
  * 4. Send remaining bytes MOD sizeof(endpoint)
  * 5. Send remaining bytes. If this happens to be exactly sizeof(endpoint)
  *    then also send a zero-length package.
@@ -833,7 +834,519 @@ libusb_glue_error (PTPParams *params, const char *format, ...)
  */
 #define CONTEXT_BLOCK_SIZE_1	0x3e00
 #define CONTEXT_BLOCK_SIZE_2  0x200
-#define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
+#define CONTEXT_BLOCK_SIZE    (CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2)
+
+/*
+ * Transfer block sizing. Data phases are chopped into blocks of
+ * ptp_usb->transfer_block_size bytes, chosen per device by one of the
+ * LIBMTP_transfer_sizing_t policies:
+ *
+ * - AUTO: derived from the endpoint packet size and guess_usb_speed(),
+ *   about 4ms worth of data and never less than CONTEXT_BLOCK_SIZE.
+ * - FIXED: whatever the application asked for.
+ * - AUTOTUNE: start out like AUTO, then during the first megabytes of a
+ *   large transfer keep doubling the block size for as long as this
+ *   improves the measured throughput, and stay with the best one.
+ * - ALTERNATING: the iRiver devices want their reads to alternate
+ *   between two block sizes adding up to CONTEXT_BLOCK_SIZE.
+ */
+#define MAX_TRANSFER_BLOCK_SIZE	0x100000
+#define AUTOTUNE_WINDOW		0x100000
+
+/* Blocks must be a multiple of the packet size of both endpoints */
+static unsigned long
+round_block_size (PTP_USB *ptp_usb, unsigned long size)
+{
+  unsigned long maxpacket = ptp_usb->inep_maxpacket;
+
+  if (ptp_usb->outep_maxpacket > maxpacket)
+    maxpacket = ptp_usb->outep_maxpacket;
+  if (size > MAX_TRANSFER_BLOCK_SIZE)
+    size = MAX_TRANSFER_BLOCK_SIZE;
+  size -= size % maxpacket;
+  return size ? size : maxpacket;
+}
+
+static unsigned long
+auto_transfer_block_size (PTP_USB *ptp_usb)
+{
+  unsigned long size = guess_usb_speed(ptp_usb) / 256;
+
+  /* SuperSpeed bulk endpoints carry 1024 bytes per packet */
+  if (ptp_usb->inep_maxpacket > 512)
+    size *= ptp_usb->inep_maxpacket / 512;
+  if (size < CONTEXT_BLOCK_SIZE)
+    size = CONTEXT_BLOCK_SIZE;
+  return round_block_size(ptp_usb, size);
+}
+
+/* Largest block the current policy may use, i.e. the buffer size */
+static unsigned long
+max_transfer_block_size (PTP_USB *ptp_usb)
+{
+  if (ptp_usb->transfer_sizing == LIBMTP_TRANSFER_SIZING_AUTOTUNE)
+    return MAX_TRANSFER_BLOCK_SIZE;
+  return ptp_usb->transfer_block_size;
+}
+
+/* Start measuring a new data phase */
+static void
+autotune_begin (PTP_USB *ptp_usb)
+{
+  ptp_usb->tune_bytes = 0;
+  timerclear(&ptp_usb->tune_start);
+}
+
+/*
+ * Account for a block that just went through. Once AUTOTUNE_WINDOW
+ * bytes have been moved with the current block size its throughput is
+ * compared to the best one so far, then either twice the block size is
+ * tried or the best one is kept for good.
+ */
+static void
+autotune_block (PTP_USB *ptp_usb, unsigned long xfer)
+{
+  struct timeval now;
+  double elapsed, rate;
+
+  if (ptp_usb->transfer_sizing != LIBMTP_TRANSFER_SIZING_AUTOTUNE)
+    return;
+  gettimeofday(&now, NULL);
+  if (!timerisset(&ptp_usb->tune_start)) {
+    // The first block only starts the clock
+    ptp_usb->tune_start = now;
+    return;
+  }
+  ptp_usb->tune_bytes += xfer;
+  if (ptp_usb->tune_bytes < AUTOTUNE_WINDOW)
+    return;
+  elapsed = (now.tv_sec - ptp_usb->tune_start.tv_sec) +
+    (now.tv_usec - ptp_usb->tune_start.tv_usec) / 1000000.0;
+  if (elapsed <= 0.0)
+    return;
+  rate = ptp_usb->tune_bytes / elapsed;
+  LIBMTP_USB_DEBUG("Block size 0x%lx moved %.0f bytes/s\n",
+                   ptp_usb->transfer_block_size, rate);
+
+  // Only worth it if it is at least 5% faster
+  if (rate > ptp_usb->tune_best_rate * 1.05) {
+    ptp_usb->tune_best_rate = rate;
+    ptp_usb->tune_best_size = ptp_usb->transfer_block_size;
+    if (ptp_usb->transfer_block_size * 2 <= MAX_TRANSFER_BLOCK_SIZE) {
+      ptp_usb->transfer_block_size *= 2;
+      ptp_usb->tune_bytes = 0;
+      ptp_usb->tune_start = now;
+      return;
+    }
+  }
+  LIBMTP_USB_DEBUG("Settling on block size 0x%lx\n", ptp_usb->tune_best_size);
+  ptp_usb->transfer_block_size = ptp_usb->tune_best_size;
+  ptp_usb->transfer_sizing = LIBMTP_TRANSFER_SIZING_FIXED;
+}
+
+void set_usb_device_transfer_sizing(PTP_USB *ptp_usb,
+				    LIBMTP_transfer_sizing_t sizing,
+				    unsigned long blocksize)
+{
+  ptp_usb->transfer_sizing = sizing;
+  ptp_usb->tune_best_rate = 0.0;
+  autotune_begin(ptp_usb);
+  switch (sizing) {
+  case LIBMTP_TRANSFER_SIZING_FIXED:
+    ptp_usb->transfer_block_size = round_block_size(ptp_usb, blocksize);
+    break;
+  case LIBMTP_TRANSFER_SIZING_AUTOTUNE:
+    if (blocksize)
+      ptp_usb->transfer_block_size = round_block_size(ptp_usb, blocksize);
+    else
+      ptp_usb->transfer_block_size = auto_transfer_block_size(ptp_usb);
+    ptp_usb->tune_best_size = ptp_usb->transfer_block_size;
+    break;
+  case LIBMTP_TRANSFER_SIZING_ALTERNATING:
+    ptp_usb->transfer_block_size = CONTEXT_BLOCK_SIZE;
+    break;
+  case LIBMTP_TRANSFER_SIZING_AUTO:
+  default:
+    ptp_usb->transfer_sizing = LIBMTP_TRANSFER_SIZING_AUTO;
+    ptp_usb->transfer_block_size = auto_transfer_block_size(ptp_usb);
+    break;
+  }
+  LIBMTP_USB_DEBUG("Transfer block size 0x%lx\n", ptp_usb->transfer_block_size);
+}
+
+/*
+ * Block size of the pipelined transfers: an explicit per-direction
+ * size set through LIBMTP_Set_Read_Queue() or LIBMTP_Set_Write_Queue(),
+ * else the device's transfer block size.
+ */
+static unsigned long
+queue_block_size (PTP_USB *ptp_usb, unsigned long override)
+{
+  if (override)
+    return round_block_size(ptp_usb, override);
+  return ptp_usb->transfer_block_size;
+}
+
+/*
+ * Default pipelining of the bulk IN data phase: this many transfers of
+ * one block each are kept queued on the IN endpoint while the data
+ * handler consumes the previous ones.
+ */
+#define ASYNC_READ_QUEUE_DEPTH	4
+
+/*
+ * Account for xread bytes that just came in and call the progress
+ * callback. Returns non-zero if the user cancelled the transfer.
+ */
+static int
+ptp_read_progress (PTP_USB *ptp_usb, unsigned long xread)
+{
+  int ret;
+
+  if (!ptp_usb->callback_active)
+    return 0;
+  ptp_usb->current_transfer_complete += xread;
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+    // send last update and disable callback.
+    ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+    ptp_usb->callback_active = 0;
+  }
+  if (ptp_usb->current_transfer_callback != NULL) {
+    ret = ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+                                             ptp_usb->current_transfer_total,
+                                             ptp_usb->current_transfer_callback_data);
+    if (ret != 0) {
+      LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Consume the zero-length packet terminating a data phase that ended
+ * on a packet boundary.
+ */
+static void
+ptp_read_zero_packet (PTP_USB *ptp_usb)
+{
+  unsigned char temp;
+  int zeroresult = 0, xread;
+
+  LIBMTP_USB_DEBUG("<==USB IN\n");
+  LIBMTP_USB_DEBUG("Zero Read\n");
+
+  zeroresult = USB_BULK_READ(ptp_usb->handle,
+                             ptp_usb->inep,
+                             &temp,
+                             0,
+                             &xread,
+                             ptp_usb->timeout);
+  if (zeroresult != LIBUSB_SUCCESS)
+    LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
+}
+
+/*
+ * Returns non-zero if a data phase of the given size should go through
+ * the pipelined reader rather than the synchronous loop. Devices that
+ * need alternating block sizes are left alone.
+ */
+static int
+use_async_read (PTP_USB *ptp_usb, unsigned long size)
+{
+  if (ptp_usb->read_queue_depth < 2)
+    return 0;
+  if (ptp_usb->transfer_sizing == LIBMTP_TRANSFER_SIZING_ALTERNATING)
+    return 0;
+  /* A single block gains nothing from being queued */
+  return size > queue_block_size(ptp_usb, ptp_usb->read_block_size);
+}
+
+/*
+ * Receive buffers stay with the device between transfers. Where the
+ * platform supports it (Linux usbfs) they are allocated with
+ * libusb_dev_mem_alloc(), so the kernel DMAs the data straight into
+ * them instead of copying it over from a bounce buffer of its own.
+ * The synchronous writer borrows the same buffer, a transaction never
+ * reads and writes at the same time.
+ */
+static unsigned char *
+get_receive_buffer (PTP_USB *ptp_usb, unsigned long size)
+{
+  if (ptp_usb->recv_buffer != NULL && ptp_usb->recv_buffer_size >= size)
+    return ptp_usb->recv_buffer;
+  free_receive_buffer(ptp_usb);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  ptp_usb->recv_buffer = libusb_dev_mem_alloc(ptp_usb->handle, size);
+  if (ptp_usb->recv_buffer != NULL) {
+    ptp_usb->recv_buffer_size = size;
+    ptp_usb->recv_buffer_devmem = 1;
+    return ptp_usb->recv_buffer;
+  }
+#endif
+  ptp_usb->recv_buffer = malloc(size);
+  if (ptp_usb->recv_buffer != NULL)
+    ptp_usb->recv_buffer_size = size;
+  return ptp_usb->recv_buffer;
+}
+
+static void
+free_receive_buffer (PTP_USB *ptp_usb)
+{
+  if (ptp_usb->recv_buffer == NULL)
+    return;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  if (ptp_usb->recv_buffer_devmem)
+    libusb_dev_mem_free(ptp_usb->handle, ptp_usb->recv_buffer,
+                        ptp_usb->recv_buffer_size);
+  else
+#endif
+    free(ptp_usb->recv_buffer);
+  ptp_usb->recv_buffer = NULL;
+  ptp_usb->recv_buffer_size = 0;
+  ptp_usb->recv_buffer_devmem = 0;
+}
+
+/* One queued bulk IN transfer of the pipelined reader */
+struct ptp_read_slot {
+  struct libusb_transfer *transfer;
+  unsigned char *bytes;
+  unsigned long toread;
+  int expect_terminator_byte;
+  int done;
+};
+
+static void
+ptp_read_async_cb (struct libusb_transfer *t)
+{
+  struct ptp_read_slot *slot = t->user_data;
+
+  slot->done = 1;
+}
+
+/*
+ * Pipelined version of ptp_read_func(): keeps up to read_queue_depth
+ * bulk IN transfers in flight and hands the completed buffers to the
+ * data handler in submission order, so the bus stays busy while the
+ * handler copies or writes out the previous block. Handlers that can
+ * lend out their storage get the data read straight into it instead.
+ *
+ * The size must be exactly what is left of the data phase. No transfer
+ * is ever queued past it, since that one would swallow the response
+ * container.
+ */
+static short
+ptp_read_func_async (
+	unsigned long size, PTPDataHandler *handler, void *data,
+	unsigned long *readbytes,
+	int readzero
+) {
+  PTP_USB *ptp_usb = (PTP_USB *)data;
+  int depth = ptp_usb->read_queue_depth;
+  unsigned long blocksize, bufsize;
+  unsigned long queued = 0;
+  unsigned long curread = 0;
+  struct ptp_read_slot *slots;
+  unsigned char *dest = NULL;
+  unsigned char *pool = NULL;
+  int head = 0, inflight = 0, stop = 0, short_read = 0;
+  short ret = PTP_RC_OK;
+  uint16_t handler_ret = PTP_RC_OK;
+  int i;
+
+  /* The block size may still grow while autotuning */
+  blocksize = queue_block_size(ptp_usb, ptp_usb->read_block_size);
+  bufsize = ptp_usb->read_block_size ? blocksize :
+    max_transfer_block_size(ptp_usb);
+  if ((unsigned long) depth > size / blocksize + 1)
+    depth = size / blocksize + 1;
+  autotune_begin(ptp_usb);
+
+  // Allocate before anything is borrowed, so failing here leaves no trace
+  slots = calloc(depth, sizeof(struct ptp_read_slot));
+  if (slots == NULL)
+    return PTP_ERROR_IO;
+
+  /*
+   * Either borrow the whole remainder from the handler, or read into
+   * the receive buffer, one block per slot. Either way there is one
+   * extra byte for the terminator of FLAG_NO_ZERO_READS devices.
+   */
+  if (handler != NULL && handler->borrowfunc != NULL &&
+      handler->commitfunc != NULL &&
+      handler->borrowfunc(NULL, handler->priv, size + 1, &dest) != PTP_RC_OK)
+    dest = NULL;
+  if (dest == NULL) {
+    pool = get_receive_buffer(ptp_usb, depth * (bufsize + 1));
+    if (pool == NULL) {
+      free(slots);
+      return PTP_ERROR_IO;
+    }
+  }
+
+  for (i = 0; i < depth; i++) {
+    slots[i].transfer = libusb_alloc_transfer(0);
+    if (pool != NULL)
+      slots[i].bytes = pool + i * (bufsize + 1);
+    if (slots[i].transfer == NULL) {
+      ret = PTP_ERROR_IO;
+      stop = 1;
+      break;
+    }
+  }
+
+  while (1) {
+    struct ptp_read_slot *slot;
+    struct libusb_transfer *t;
+    unsigned long xread;
+
+    // Top up the queue
+    while (!stop && inflight < depth && queued < size) {
+      blocksize = queue_block_size(ptp_usb, ptp_usb->read_block_size);
+      slot = &slots[(head + inflight) % depth];
+      slot->toread = size - queued;
+      slot->expect_terminator_byte = 0;
+      if (slot->toread > blocksize) {
+        slot->toread = blocksize;
+      } else if (readzero && FLAG_NO_ZERO_READS(ptp_usb) &&
+                 (slot->toread % ptp_usb->inep_maxpacket) == 0) {
+        // this is equivalent to zero read for these devices
+        slot->toread += 1;
+        slot->expect_terminator_byte = 1;
+      }
+      if (dest != NULL)
+        slot->bytes = dest + queued;
+      slot->done = 0;
+      libusb_fill_bulk_transfer(slot->transfer, ptp_usb->handle,
+                                ptp_usb->inep, slot->bytes, slot->toread,
+                                ptp_read_async_cb, slot, ptp_usb->timeout);
+      LIBMTP_USB_DEBUG("Queueing read of 0x%04lx bytes\n", slot->toread);
+      if (libusb_submit_transfer(slot->transfer) != LIBUSB_SUCCESS) {
+        ret = PTP_ERROR_IO;
+        stop = 1;
+        break;
+      }
+      queued += slot->toread - slot->expect_terminator_byte;
+      inflight++;
+    }
+    if (inflight == 0)
+      break;
+    if (stop) {
+      // Pull back whatever is still queued, then drain it
+      for (i = 0; i < inflight; i++)
+        libusb_cancel_transfer(slots[(head + i) % depth].transfer);
+    }
+
+    slot = &slots[head];
+    while (!slot->done) {
+      int res = libusb_handle_events_completed(libmtp_libusb_context,
+                                               &slot->done);
+      if (res != LIBUSB_SUCCESS && res != LIBUSB_ERROR_INTERRUPTED &&
+          !stop) {
+        LIBMTP_ERROR("LIBMTP panic: error 0x%04x handling USB events\n", res);
+        ret = PTP_ERROR_IO;
+        stop = 1;
+        for (i = 0; i < inflight; i++)
+          libusb_cancel_transfer(slots[(head + i) % depth].transfer);
+      }
+    }
+    head = (head + 1) % depth;
+    inflight--;
+    t = slot->transfer;
+    if (stop) {
+      /*
+       * A device that ended the data phase early may already have sent
+       * its response into one of the blocks queued behind the short
+       * one. Keep it for ptp_usb_getresp() rather than losing it.
+       */
+      if (short_read && t->actual_length >= PTP_USB_BULK_HDR_LEN &&
+          ptp_usb->params->response_packet == NULL) {
+        unsigned long keep = t->actual_length;
+
+        if (keep > sizeof(PTPUSBBulkContainer))
+          keep = sizeof(PTPUSBBulkContainer);
+        ptp_usb->params->response_packet = malloc(keep);
+        if (ptp_usb->params->response_packet != NULL) {
+          memcpy(ptp_usb->params->response_packet, slot->bytes, keep);
+          ptp_usb->params->response_packet_size = keep;
+        }
+      }
+      continue;
+    }
+
+    LIBMTP_USB_DEBUG("Result of read: 0x%04x (%d bytes)\n", t->status,
+                     t->actual_length);
+    if (t->status == LIBUSB_TRANSFER_TIMED_OUT) {
+      ret = PTP_ERROR_TIMEOUT;
+      stop = 1;
+      continue;
+    } else if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+      ret = PTP_ERROR_IO;
+      stop = 1;
+      continue;
+    }
+    xread = t->actual_length;
+
+    LIBMTP_USB_DEBUG("<==USB IN\n");
+    if (xread == 0)
+      LIBMTP_USB_DEBUG("Zero Read\n");
+    else
+      LIBMTP_USB_DATA(slot->bytes, xread, 16);
+
+    // want to discard extra byte
+    if (slot->expect_terminator_byte && xread == slot->toread) {
+      LIBMTP_USB_DEBUG("<==USB IN\nDiscarding extra byte\n");
+      xread--;
+    }
+
+    if (dest != NULL)
+      handler_ret = handler->commitfunc(NULL, handler->priv, xread);
+    else if (handler != NULL)
+      handler_ret = handler->putfunc(NULL, handler->priv, xread, slot->bytes);
+    if (handler_ret != PTP_RC_OK) {
+      LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
+                   "Not enough memory or temp/destination free space?");
+      ret = PTP_ERROR_CANCEL;
+      stop = 1;
+      continue;
+    }
+    curread += xread;
+    if (!ptp_usb->read_block_size)
+      autotune_block(ptp_usb, xread);
+
+    if (ptp_read_progress(ptp_usb, xread)) {
+      ret = PTP_ERROR_CANCEL;
+      stop = 1;
+      continue;
+    }
+
+    /* short reads are common */
+    if (xread < slot->toread - slot->expect_terminator_byte) {
+      stop = 1;
+      short_read = 1;
+    }
+  }
+
+  for (i = 0; i < depth; i++) {
+    if (slots[i].transfer != NULL)
+      libusb_free_transfer(slots[i].transfer);
+  }
+  free(slots);
+  if (ret != PTP_RC_OK)
+    return ret;
+
+  if (readbytes)
+    *readbytes = curread;
+
+  // there might be a zero packet waiting for us...
+  if (readzero && !short_read &&
+    !FLAG_NO_ZERO_READS(ptp_usb) &&
+    curread % ptp_usb->inep_maxpacket == 0)
+    ptp_read_zero_packet(ptp_usb);
+
+  return PTP_RC_OK;
+}
+
 static short
 ptp_read_func (
 	unsigned long size, PTPDataHandler *handler,void *data,
@@ -848,30 +1361,24 @@ ptp_read_func (
   unsigned long curread = 0;
   unsigned char *bytes;
   int expect_terminator_byte = 0;
-  unsigned long usb_inep_maxpacket_size;
-  unsigned long context_block_size_1;
-  unsigned long context_block_size_2;
-  uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
-
-  //"iRiver" device special handling
-  if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
-	  usb_inep_maxpacket_size = ptp_usb->inep_maxpacket;
-	  if (usb_inep_maxpacket_size == 0x400) {
-		  context_block_size_1 = CONTEXT_BLOCK_SIZE_1 - 0x200;
-		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2 + 0x200;
-	  }
-	  else {
-		  context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
-		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
-	  }
+  unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+  unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
+
+  if (ptp_usb->transfer_sizing == LIBMTP_TRANSFER_SIZING_ALTERNATING &&
+      ptp_usb->inep_maxpacket == 0x400) {
+	  context_block_size_1 = CONTEXT_BLOCK_SIZE_1 - 0x200;
+	  context_block_size_2 = CONTEXT_BLOCK_SIZE_2 + 0x200;
   }
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  bytes = get_receive_buffer(ptp_usb, max_transfer_block_size(ptp_usb));
+  if (bytes == NULL)
+    return PTP_ERROR_IO;
+  autotune_begin(ptp_usb);
   while (curread < size) {
     LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
 
     // check equal to condition here
-    if (size - curread < CONTEXT_BLOCK_SIZE)
+    if (size - curread < ptp_usb->transfer_block_size)
     {
       // this is the last packet
       toread = size - curread;
@@ -881,7 +1388,7 @@ ptp_read_func (
         expect_terminator_byte = 1;
       }
     }
-    else if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
+    else if (ptp_usb->transfer_sizing == LIBMTP_TRANSFER_SIZING_ALTERNATING) {
 	    //"iRiver" device special handling
 	    if (curread == 0)
 		    // we are first packet, but not last packet
@@ -895,7 +1402,7 @@ ptp_read_func (
 				(unsigned int) toread, (unsigned int) (size-curread));
     }
     else
-	    toread = CONTEXT_BLOCK_SIZE;
+	    toread = ptp_usb->transfer_block_size;
 
     LIBMTP_USB_DEBUG("Reading in 0x%04lx bytes\n", toread);
 
@@ -933,33 +1440,16 @@ ptp_read_func (
         if (handler_ret != PTP_RC_OK) {
             LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
                          "Not enough memory or temp/destination free space?");
-            free (bytes);
             return PTP_ERROR_CANCEL;
         }
     }
 
-    if (ptp_usb->callback_active)
-        ptp_usb->current_transfer_complete += xread;
     curread += xread;
+    autotune_block(ptp_usb, xread);
 
     // Increase counters, call callback
-    if (ptp_usb->callback_active) {
-      if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
-        // send last update and disable callback.
-        ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
-        ptp_usb->callback_active = 0;
-      }
-      if (ptp_usb->current_transfer_callback != NULL) {
-        ret = ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
-                                                 ptp_usb->current_transfer_total,
-                                                 ptp_usb->current_transfer_callback_data);
-        if (ret != 0) {
-          LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
-          free (bytes);
-          return PTP_ERROR_CANCEL;
-        }
-      }
-    }
+    if (ptp_read_progress(ptp_usb, xread))
+      return PTP_ERROR_CANCEL;
 
     if (xread < toread) /* short reads are common */
       break;
@@ -967,27 +1457,12 @@ ptp_read_func (
 
   if (readbytes)
     *readbytes = curread;
-  free (bytes);
 
   // there might be a zero packet waiting for us...
   if (readzero &&
     !FLAG_NO_ZERO_READS(ptp_usb) &&
-    curread % ptp_usb->inep_maxpacket == 0) {
-    unsigned char temp;
-    int zeroresult = 0, xread;
-
-    LIBMTP_USB_DEBUG("<==USB IN\n");
-    LIBMTP_USB_DEBUG("Zero Read\n");
-
-    zeroresult = USB_BULK_READ(ptp_usb->handle,
-                               ptp_usb->inep,
-                               &temp,
-                               0,
-                               &xread,
-                               ptp_usb->timeout);
-    if (zeroresult != LIBUSB_SUCCESS)
-      LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
-  }
+    curread % ptp_usb->inep_maxpacket == 0)
+    ptp_read_zero_packet(ptp_usb);
 
   return PTP_RC_OK;
 }
@@ -1055,6 +1530,59 @@ ptp_read_cancel_func (
   return PTP_ERROR_CANCEL;
 }
 
+/*
+ * Default pipelining of the bulk OUT data phase, see ptp_write_func_async().
+ */
+#define ASYNC_WRITE_QUEUE_DEPTH	4
+
+/*
+ * Call the progress callback after a block went out. Returns non-zero
+ * if the user cancelled the transfer.
+ */
+static int
+ptp_write_progress (PTP_USB *ptp_usb)
+{
+  if (!ptp_usb->callback_active)
+    return 0;
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+    // send last update and disable callback.
+    ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+    ptp_usb->callback_active = 0;
+  }
+  if (ptp_usb->current_transfer_callback != NULL) {
+    int ret;
+    ret = ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+                                             ptp_usb->current_transfer_total,
+                                             ptp_usb->current_transfer_callback_data);
+    if (ret != 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Terminate a data phase that ended on a packet boundary with a
+ * zero-length write.
+ */
+static short
+ptp_write_zero_packet (PTP_USB *ptp_usb)
+{
+  int ret, xwritten;
+
+  LIBMTP_USB_DEBUG("USB OUT==>\n");
+  LIBMTP_USB_DEBUG("Zero Write\n");
+
+  ret = USB_BULK_WRITE(ptp_usb->handle,
+                       ptp_usb->outep,
+                       (unsigned char *) "x",
+                       0,
+                       &xwritten,
+                       ptp_usb->timeout);
+  if (ret != LIBUSB_SUCCESS)
+    return PTP_ERROR_IO;
+  return PTP_RC_OK;
+}
+
 static short
 ptp_write_func (
         unsigned long   size,
@@ -1069,17 +1597,18 @@ ptp_write_func (
   unsigned char *bytes;
 
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  bytes = get_receive_buffer(ptp_usb, max_transfer_block_size(ptp_usb));
   if (!bytes) {
     return PTP_ERROR_IO;
   }
+  autotune_begin(ptp_usb);
   while (curwrite < size) {
     unsigned long usbwritten = 0;
     int xwritten = 0;
 
     towrite = size-curwrite;
-    if (towrite > CONTEXT_BLOCK_SIZE) {
-      towrite = CONTEXT_BLOCK_SIZE;
+    if (towrite > ptp_usb->transfer_block_size) {
+      towrite = ptp_usb->transfer_block_size;
     } else {
       // This magic makes packets the same size that WMP send them.
       if (towrite > ptp_usb->outep_maxpacket && towrite % ptp_usb->outep_maxpacket != 0) {
@@ -1088,7 +1617,6 @@ ptp_write_func (
     }
     int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
     if (getfunc_ret != PTP_RC_OK) {
-      free(bytes);
       return getfunc_ret;
     }
     while (usbwritten < towrite) {
@@ -1102,7 +1630,6 @@ ptp_write_func (
 	    LIBMTP_USB_DEBUG("USB OUT==>\n");
 
 	    if (ret != LIBUSB_SUCCESS) {
-              free(bytes);
 	      return PTP_ERROR_IO;
 	    }
 	    LIBMTP_USB_DATA(bytes+usbwritten, xwritten, 16);
@@ -1112,58 +1639,235 @@ ptp_write_func (
 	    curwrite += xwritten;
 	    usbwritten += xwritten;
     }
+    autotune_block(ptp_usb, usbwritten);
     // call callback
-    if (ptp_usb->callback_active) {
-      if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
-	// send last update and disable callback.
-	ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
-	ptp_usb->callback_active = 0;
-      }
-      if (ptp_usb->current_transfer_callback != NULL) {
-	int ret;
-	ret = ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
-						 ptp_usb->current_transfer_total,
-						 ptp_usb->current_transfer_callback_data);
-	if (ret != 0) {
-          free(bytes);
-	  return PTP_ERROR_CANCEL;
-	}
-      }
+    if (ptp_write_progress(ptp_usb)) {
+      return PTP_ERROR_CANCEL;
     }
     if (xwritten < towrite) /* short writes happen */
       break;
   }
-  free (bytes);
   if (written) {
     *written = curwrite;
   }
 
   // If this is the last transfer send a zero write if required
-  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
-    if ((towrite % ptp_usb->outep_maxpacket) == 0) {
-      int xwritten;
-
-      LIBMTP_USB_DEBUG("USB OUT==>\n");
-      LIBMTP_USB_DEBUG("Zero Write\n");
-
-      ret =USB_BULK_WRITE(ptp_usb->handle,
-			    ptp_usb->outep,
-			    (unsigned char *) "x",
-			    0,
-                            &xwritten,
-			    ptp_usb->timeout);
-    }
-  }
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total &&
+      (towrite % ptp_usb->outep_maxpacket) == 0)
+    return ptp_write_zero_packet(ptp_usb);
 
   if (ret != LIBUSB_SUCCESS)
     return PTP_ERROR_IO;
   return PTP_RC_OK;
 }
 
+/*
+ * Returns non-zero if a data phase of the given size should be sent
+ * through the pipelined writer.
+ */
+static int
+use_async_write (PTP_USB *ptp_usb, unsigned long size)
+{
+  if (ptp_usb->write_queue_depth < 2)
+    return 0;
+  return size > queue_block_size(ptp_usb, ptp_usb->write_block_size);
+}
+
+/* One queued bulk OUT transfer of the pipelined writer */
+struct ptp_write_slot {
+  struct libusb_transfer *transfer;
+  unsigned char *bytes;
+  unsigned long towrite;
+  int done;
+};
+
+static void
+ptp_write_async_cb (struct libusb_transfer *t)
+{
+  struct ptp_write_slot *slot = t->user_data;
+
+  slot->done = 1;
+}
+
+/*
+ * Pipelined version of ptp_write_func(): the next blocks are fetched
+ * from the data handler and queued while up to write_queue_depth
+ * earlier ones are still on the wire, so reading the source (typically
+ * a file) overlaps with the USB transfer. Blocks are sized exactly like
+ * ptp_write_func() does, and the trailing zero-length write is sent the
+ * same way.
+ */
+static short
+ptp_write_func_async (
+        unsigned long   size,
+        PTPDataHandler  *handler,
+        void            *data,
+        unsigned long   *written
+) {
+  PTP_USB *ptp_usb = (PTP_USB *)data;
+  int depth = ptp_usb->write_queue_depth;
+  unsigned long blocksize, bufsize;
+  unsigned long queued = 0;
+  unsigned long curwrite = 0;
+  unsigned long towrite = 0;
+  struct ptp_write_slot *slots;
+  int head = 0, inflight = 0, stop = 0;
+  short ret = PTP_RC_OK;
+  int i;
+
+  /* The block size may still grow while autotuning */
+  blocksize = queue_block_size(ptp_usb, ptp_usb->write_block_size);
+  bufsize = ptp_usb->write_block_size ? blocksize :
+    max_transfer_block_size(ptp_usb);
+  if ((unsigned long) depth > size / blocksize + 2)
+    depth = size / blocksize + 2;
+  autotune_begin(ptp_usb);
+
+  slots = calloc(depth, sizeof(struct ptp_write_slot));
+  if (slots == NULL)
+    return PTP_ERROR_IO;
+  for (i = 0; i < depth; i++) {
+    slots[i].transfer = libusb_alloc_transfer(0);
+    slots[i].bytes = malloc(bufsize);
+    if (slots[i].transfer == NULL || slots[i].bytes == NULL) {
+      ret = PTP_ERROR_IO;
+      stop = 1;
+      break;
+    }
+  }
+
+  while (1) {
+    struct ptp_write_slot *slot;
+    struct libusb_transfer *t;
+
+    // Prefetch from the handler and queue up to the queue depth
+    while (!stop && inflight < depth && queued < size) {
+      uint16_t getfunc_ret;
+
+      blocksize = queue_block_size(ptp_usb, ptp_usb->write_block_size);
+      slot = &slots[(head + inflight) % depth];
+      slot->towrite = size - queued;
+      if (slot->towrite > blocksize) {
+        slot->towrite = blocksize;
+      } else {
+        // This magic makes packets the same size that WMP send them.
+        if (slot->towrite > ptp_usb->outep_maxpacket &&
+            slot->towrite % ptp_usb->outep_maxpacket != 0) {
+          slot->towrite -= slot->towrite % ptp_usb->outep_maxpacket;
+        }
+      }
+      getfunc_ret = handler->getfunc(NULL, handler->priv, slot->towrite,
+                                     slot->bytes, &slot->towrite);
+      if (getfunc_ret != PTP_RC_OK) {
+        ret = getfunc_ret;
+        stop = 1;
+        break;
+      }
+      if (slot->towrite == 0) {
+        // The source ran dry, send what we have
+        stop = 1;
+        break;
+      }
+      slot->done = 0;
+      libusb_fill_bulk_transfer(slot->transfer, ptp_usb->handle,
+                                ptp_usb->outep, slot->bytes, slot->towrite,
+                                ptp_write_async_cb, slot, ptp_usb->timeout);
+      LIBMTP_USB_DEBUG("Queueing write of 0x%04lx bytes\n", slot->towrite);
+      if (libusb_submit_transfer(slot->transfer) != LIBUSB_SUCCESS) {
+        ret = PTP_ERROR_IO;
+        stop = 1;
+        break;
+      }
+      queued += slot->towrite;
+      inflight++;
+    }
+    if (inflight == 0)
+      break;
+    if (stop && ret != PTP_RC_OK) {
+      for (i = 0; i < inflight; i++)
+        libusb_cancel_transfer(slots[(head + i) % depth].transfer);
+    }
+
+    slot = &slots[head];
+    while (!slot->done) {
+      int res = libusb_handle_events_completed(libmtp_libusb_context,
+                                               &slot->done);
+      if (res != LIBUSB_SUCCESS && res != LIBUSB_ERROR_INTERRUPTED &&
+          ret == PTP_RC_OK) {
+        LIBMTP_ERROR("LIBMTP panic: error 0x%04x handling USB events\n", res);
+        ret = PTP_ERROR_IO;
+        stop = 1;
+        for (i = 0; i < inflight; i++)
+          libusb_cancel_transfer(slots[(head + i) % depth].transfer);
+      }
+    }
+    head = (head + 1) % depth;
+    inflight--;
+    if (ret != PTP_RC_OK)
+      continue;
+
+    t = slot->transfer;
+    LIBMTP_USB_DEBUG("USB OUT==>\n");
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+      ret = PTP_ERROR_IO;
+      stop = 1;
+      continue;
+    }
+    LIBMTP_USB_DATA(slot->bytes, t->actual_length, 16);
+    // Increase counters
+    ptp_usb->current_transfer_complete += t->actual_length;
+    curwrite += t->actual_length;
+    towrite = slot->towrite;
+    if (!ptp_usb->write_block_size)
+      autotune_block(ptp_usb, t->actual_length);
+
+    if (ptp_write_progress(ptp_usb)) {
+      ret = PTP_ERROR_CANCEL;
+      stop = 1;
+      continue;
+    }
+    if (t->actual_length < slot->towrite) { /* short writes happen */
+      stop = 1;
+      /*
+       * The rest of this block is gone from the handler, and the blocks
+       * queued behind it are on their way already, so the gap cannot be
+       * filled any more. Pull them back and give up.
+       */
+      if (inflight > 0) {
+        LIBMTP_ERROR("LIBMTP panic: short write with more blocks queued\n");
+        ret = PTP_ERROR_IO;
+        for (i = 0; i < inflight; i++)
+          libusb_cancel_transfer(slots[(head + i) % depth].transfer);
+      }
+    }
+  }
+
+  for (i = 0; i < depth; i++) {
+    if (slots[i].transfer != NULL)
+      libusb_free_transfer(slots[i].transfer);
+    free(slots[i].bytes);
+  }
+  free(slots);
+  if (ret != PTP_RC_OK)
+    return ret;
+  if (written) {
+    *written = curwrite;
+  }
+
+  // If this is the last transfer send a zero write if required
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total &&
+      (towrite % ptp_usb->outep_maxpacket) == 0)
+    return ptp_write_zero_packet(ptp_usb);
+
+  return PTP_RC_OK;
+}
+
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
 	unsigned long	size, curoff;
+	unsigned long	alloced;
 } PTPMemHandlerPrivate;
 
 static uint16_t
@@ -1188,12 +1892,23 @@ memory_putfunc(PTPParams* params, void* private,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
-	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		priv->size = priv->curoff + sendlen;
+	if (priv->curoff + sendlen > priv->alloced) {
+		/* grow geometrically, see memory_putfunc() in ptp.c */
+		unsigned long newsize = priv->alloced * 2;
+		unsigned char *newdata;
+
+		if (newsize < priv->curoff + sendlen)
+			newsize = priv->curoff + sendlen;
+		newdata = realloc (priv->data, newsize);
+		if (!newdata)
+			return PTP_RC_GeneralError;
+		priv->data = newdata;
+		priv->alloced = newsize;
 	}
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
+	if (priv->curoff > priv->size)
+		priv->size = priv->curoff;
 	return PTP_RC_OK;
 }
 
@@ -1205,9 +1920,12 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler) {
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->borrowfunc = NULL;
+	handler->commitfunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
+	priv->alloced = 0;
 	return PTP_RC_OK;
 }
 
@@ -1225,9 +1943,12 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->borrowfunc = NULL;
+	handler->commitfunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
+	priv->alloced = len;
 	return PTP_RC_OK;
 }
 
@@ -1354,8 +2075,13 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 	ret = PTP_RC_OK;
 	while(bytes_left_to_transfer > 0) {
 		unsigned long max_long_transfer = ULONG_MAX + 1 - packet_size;
-		ret = ptp_write_func (bytes_left_to_transfer > max_long_transfer ? max_long_transfer : bytes_left_to_transfer,
-			handler, params->data, &written);
+		unsigned long chunk = bytes_left_to_transfer > max_long_transfer ?
+			max_long_transfer : bytes_left_to_transfer;
+
+		if (use_async_write(ptp_usb, chunk))
+			ret = ptp_write_func_async (chunk, handler, params->data, &written);
+		else
+			ret = ptp_write_func (chunk, handler, params->data, &written);
 		if (ret != PTP_RC_OK)
 			break;
 		if (written == 0) {
@@ -1401,6 +2127,9 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 	return ret;
 }
 
+/* The most a data phase is presized for before any of it has arrived */
+#define PRESIZE_MAX	0x4000000
+
 uint16_t
 ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 {
@@ -1447,6 +2176,29 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 				break;
 			}
 		}
+		/*
+		 * Let the handler presize itself for the announced length,
+		 * rather than growing block by block. One spare byte for the
+		 * terminator of FLAG_NO_ZERO_READS devices. The length comes
+		 * from the device, so do not take it for more than a hint: a
+		 * bogus one must not have us allocate gigabytes up front, and
+		 * if the room cannot be had the handler just grows as the
+		 * data comes in.
+		 */
+		if (handler->borrowfunc != NULL &&
+		    dtoh32(usbdata.length) != 0xffffffffU &&
+		    dtoh32(usbdata.length) > PTP_USB_BULK_HDR_LEN) {
+			unsigned char *reserved;
+			unsigned long presize = dtoh32(usbdata.length) - PTP_USB_BULK_HDR_LEN + 1;
+
+			if (presize > PRESIZE_MAX)
+				presize = PRESIZE_MAX;
+			if (handler->borrowfunc(params, handler->priv, presize,
+						&reserved) != PTP_RC_OK)
+				libusb_glue_debug (params, "ptp2/ptp_usb_getdata: could not "
+					   "presize for %lu bytes, growing as it comes",
+					   presize);
+		}
 		if (rlen == ptp_usb->inep_maxpacket) {
 		  /* Copy first part of data to 'data' */
 		  putfunc_ret =
@@ -1460,6 +2212,22 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 		if (rlen == usbdata.length)
 			return PTP_RC_OK;
 
+		/*
+		 * With the length known the rest can be pipelined, otherwise
+		 * (objects of 4GB and beyond) read on until a short packet.
+		 */
+		if (dtoh32(usbdata.length) != 0xffffffffU &&
+		    use_async_read(ptp_usb, dtoh32(usbdata.length) - rlen)) {
+			ret = ptp_read_func_async(dtoh32(usbdata.length) - rlen,
+						  handler,
+						  params->data,
+						  NULL,
+						  1);
+			if (ret == PTP_ERROR_CANCEL)
+				return ptp_read_cancel_func(params, ptp->Transaction_ID);
+			return ret;
+		}
+
 		  /* stuff data directly to passed data handler */
 		  while (1) {
 		    unsigned long readdata;
@@ -1569,11 +2337,18 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 		  break;
 		}
 
-		ret = ptp_read_func(len - (rlen - PTP_USB_BULK_HDR_LEN),
-							handler,
-							params->data,
-							&rlen,
-							1);
+		if (use_async_read(ptp_usb, len - (rlen - PTP_USB_BULK_HDR_LEN)))
+			ret = ptp_read_func_async(len - (rlen - PTP_USB_BULK_HDR_LEN),
+						  handler,
+						  params->data,
+						  &rlen,
+						  1);
+		else
+			ret = ptp_read_func(len - (rlen - PTP_USB_BULK_HDR_LEN),
+					    handler,
+					    params->data,
+					    &rlen,
+					    1);
 		if (ret == PTP_ERROR_CANCEL) {
 			ptp_read_cancel_func(params, ptp->Transaction_ID);
 			break;
@@ -2081,6 +2856,7 @@ static void clear_stall(PTP_USB* ptp_usb)
 
 static void close_usb(PTP_USB* ptp_usb)
 {
+  free_receive_buffer(ptp_usb);
   if (!FLAG_NO_RELEASE_INTERFACE(ptp_usb)) {
     /*
      * Clear any stalled endpoints
@@ -2286,6 +3062,18 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   /* Copy USB version number */
   ptp_usb->bcdusb = desc.bcdUSB;
 
+  /* Size the transfer blocks, iRiver devices alternate block sizes */
+  if (ptp_usb->rawdevice.device_entry.vendor_id == 0x4102 ||
+      ptp_usb->rawdevice.device_entry.vendor_id == 0x1006)
+    set_usb_device_transfer_sizing(ptp_usb,
+				   LIBMTP_TRANSFER_SIZING_ALTERNATING, 0);
+  else
+    set_usb_device_transfer_sizing(ptp_usb, LIBMTP_TRANSFER_SIZING_AUTO, 0);
+
+  /* Pipeline the bulk data phases by default */
+  ptp_usb->read_queue_depth = ASYNC_READ_QUEUE_DEPTH;
+  ptp_usb->write_queue_depth = ASYNC_WRITE_QUEUE_DEPTH;
+
   /* Attempt to initialize this device */
   if (init_ptp_usb(params, ptp_usb, ldevice) < 0) {
     free (ptp_usb);
@@ -0,0 +1,639 @@
+/**
+ * \file metadata-cache.c
+ *
+ * Persistent on-disk copy of the object metadata cache, so that a
+ * device which is plugged in again need not be scanned all over.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * There is one file per device, named after its serial number. It is
+ * a header, the fingerprint of the storages as they were when the file
+ * was written, the objects, their properties and finally all strings,
+ * each section an array of fixed size records. The records only refer
+ * to each other by index or offset, so the file can be mapped and
+ * read in place. It is in host byte order and the header says which
+ * one, it is a cache and not meant to be moved around.
+ *
+ * The cache is only used if every storage still reports the same
+ * capacity, free space and number of objects. That is what catches
+ * objects being added or removed while the device was away, but not
+ * e.g. a file being renamed in place.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "libmtp.h"
+#include "ptp.h"
+#include "util.h"
+
+#include "metadata-cache.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef HAVE_MKSTEMP
+# ifdef __WIN32__
+#  define mkstemp(_pattern) _open(_mktemp(_pattern), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE)
+# else
+#  error Missing mkstemp() function.
+# endif
+#endif
+
+/**
+ * Debug macro
+ */
+#define LIBMTP_CACHE_DEBUG(format, args...) \
+  do { \
+    if ((LIBMTP_debug & LIBMTP_DEBUG_PTP) != 0) \
+      fprintf(stdout, "LIBMTP %s[%d]: " format, __FUNCTION__, __LINE__, ##args); \
+  } while (0)
+
+#define CACHE_MAGIC "MTPCACHE"
+#define CACHE_VERSION 1
+#define CACHE_BYTEORDER 0x01020304U
+#define CACHE_NOSTRING 0xffffffffU
+#define CACHE_MAX_SIZE 0x40000000U
+// What is loaded for an object is all that is worth keeping of its flags
+#define CACHE_OBJECT_FLAGS (PTPOBJECT_OBJECTINFO_LOADED | \
+			    PTPOBJECT_CANONFLAGS_LOADED | \
+			    PTPOBJECT_MTPPROPLIST_LOADED | \
+			    PTPOBJECT_PARENTOBJECT_LOADED | \
+			    PTPOBJECT_STORAGEID_LOADED)
+
+/*
+ * The on-disk records. They are laid out to need no padding, and all
+ * sections start 8-byte aligned.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t nrofstorages;
+  uint32_t nrofobjects;
+  uint32_t nrofprops;
+  uint32_t stringsize;
+} cache_header_t;
+
+typedef struct {
+  uint32_t id;
+  uint32_t nrofobjects;
+  uint64_t maxcapacity;
+  uint64_t freespace;
+} cache_storage_t;
+
+typedef struct {
+  uint64_t size;
+  int64_t capturedate;
+  int64_t modificationdate;
+  uint32_t oid;
+  uint32_t flags;
+  uint32_t canon_flags;
+  uint32_t storageid;
+  uint32_t parent;
+  uint32_t associationdesc;
+  uint32_t sequencenumber;
+  uint32_t thumbsize;
+  uint32_t thumbwidth;
+  uint32_t thumbheight;
+  uint32_t imagewidth;
+  uint32_t imageheight;
+  uint32_t imagebitdepth;
+  uint32_t filename; /* offset into the strings, or CACHE_NOSTRING */
+  uint32_t keywords;
+  uint32_t firstprop;
+  uint32_t nrofprops;
+  uint16_t format;
+  uint16_t protection;
+  uint16_t associationtype;
+  uint16_t thumbformat;
+  uint32_t reserved;
+} cache_object_t;
+
+typedef struct {
+  uint64_t value; /* the string offset for PTP_DTC_STR */
+  uint32_t objecthandle;
+  uint16_t property;
+  uint16_t datatype;
+} cache_prop_t;
+
+/* Array and 128 bit values are rare and always read from the device */
+static int is_cacheable_prop(MTPProperties *prop)
+{
+  return prop->datatype == PTP_DTC_STR ||
+    (prop->datatype >= PTP_DTC_INT8 && prop->datatype <= PTP_DTC_UINT64);
+}
+
+/*
+ * The properties of an object are only kept if all of them can be, or
+ * a partial list would pass for the complete one once loaded again.
+ */
+static int is_cacheable_proplist(PTPObject *ob)
+{
+  unsigned int i;
+
+  for (i = 0; i < ob->nrofmtpprops; i++)
+    if (!is_cacheable_prop(&ob->mtpprops[i]))
+      return 0;
+  return 1;
+}
+
+/**
+ * Returns the name of the cache file of a device, NULL if it has no
+ * serial number to go by.
+ */
+static char *cache_filename(PTPParams *params, const char *directory)
+{
+  const char *serial = params->deviceinfo.SerialNumber;
+  char *path;
+  char *p;
+
+  if (serial == NULL || serial[0] == '\0')
+    return NULL;
+  path = malloc(strlen(directory) + strlen(serial) + 8);
+  if (path == NULL)
+    return NULL;
+  sprintf(path, "%s/", directory);
+  p = path + strlen(path);
+  for (; *serial != '\0'; serial++) {
+    if (isalnum((unsigned char) *serial) || *serial == '-' || *serial == '_')
+      *p++ = *serial;
+    else
+      *p++ = '_';
+  }
+  strcpy(p, ".cache");
+  return path;
+}
+
+/**
+ * Takes the fingerprint of the storages of a device as it is right
+ * now: the capacity, free space and number of objects of each. This
+ * costs two cheap transactions per storage.
+ * @return 0 on success, -1 if the device would not tell.
+ */
+static int get_fingerprint(PTPParams *params, cache_storage_t **storages,
+			   uint32_t *nrofstorages)
+{
+  PTPStorageIDs ids;
+  cache_storage_t *st;
+  uint32_t i;
+
+  if (ptp_getstorageids(params, &ids) != PTP_RC_OK)
+    return -1;
+  st = calloc(ids.n ? ids.n : 1, sizeof(cache_storage_t));
+  if (st == NULL) {
+    free(ids.Storage);
+    return -1;
+  }
+  for (i = 0; i < ids.n; i++) {
+    st[i].id = ids.Storage[i];
+    st[i].maxcapacity = (uint64_t) -1;
+    st[i].freespace = (uint64_t) -1;
+    if (ptp_operation_issupported(params, PTP_OC_GetStorageInfo)) {
+      PTPStorageInfo si;
+
+      if (ptp_getstorageinfo(params, ids.Storage[i], &si) != PTP_RC_OK)
+	goto fail;
+      st[i].maxcapacity = si.MaxCapability;
+      st[i].freespace = si.FreeSpaceInBytes;
+      free(si.StorageDescription);
+      free(si.VolumeLabel);
+    }
+    if (ptp_getnumobjects(params, ids.Storage[i], 0, 0,
+			  &st[i].nrofobjects) != PTP_RC_OK)
+      goto fail;
+  }
+  free(ids.Storage);
+  *storages = st;
+  *nrofstorages = ids.n;
+  return 0;
+
+ fail:
+  free(ids.Storage);
+  free(st);
+  return -1;
+}
+
+static uint32_t put_string(char *strings, uint32_t *offset, const char *str)
+{
+  uint32_t ret = *offset;
+
+  if (str == NULL)
+    return CACHE_NOSTRING;
+  strcpy(strings + ret, str);
+  *offset += strlen(str) + 1;
+  return ret;
+}
+
+/**
+ * Writes the object cache of a device to its cache file in the given
+ * directory, along with the current fingerprint of its storages. The
+ * file is replaced in one go, so an interrupted write leaves the old
+ * one in place. Nothing is written unless the cache holds exactly as
+ * many objects as the device reports, i.e. it is complete and in sync.
+ * @param device the device to save the cache of.
+ * @param directory the directory to keep cache files in.
+ * @return 0 on success, any other value means failure.
+ */
+int metadata_cache_save(LIBMTP_mtpdevice_t *device, const char *directory)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  cache_storage_t *storages = NULL;
+  uint32_t nrofstorages = 0;
+  cache_header_t *header = NULL;
+  cache_object_t *co;
+  cache_prop_t *cp;
+  char *strings;
+  char *path;
+  char *tmppath = NULL;
+  uint32_t nrofobjects = 0, nrofprops = 0, total = 0;
+  uint32_t stroffset = 0;
+  uint64_t stringsize = 0;
+  size_t size;
+  unsigned int i, j;
+  FILE *f;
+  int fd;
+  int ret = -1;
+
+  path = cache_filename(params, directory);
+  if (path == NULL)
+    return -1;
+  if (get_fingerprint(params, &storages, &nrofstorages) != 0)
+    goto out;
+  for (i = 0; i < nrofstorages; i++)
+    total += storages[i].nrofobjects;
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    if (PTPOBJECT_REMOVED(ob))
+      continue;
+    nrofobjects++;
+    if (ob->oi.Filename != NULL)
+      stringsize += strlen(ob->oi.Filename) + 1;
+    if (ob->oi.Keywords != NULL)
+      stringsize += strlen(ob->oi.Keywords) + 1;
+    if (!is_cacheable_proplist(ob))
+      continue;
+    for (j = 0; j < ob->nrofmtpprops; j++) {
+      MTPProperties *prop = &ob->mtpprops[j];
+
+      nrofprops++;
+      if (prop->datatype == PTP_DTC_STR && prop->propval.str != NULL)
+	stringsize += strlen(prop->propval.str) + 1;
+    }
+  }
+  if (nrofobjects != total) {
+    LIBMTP_CACHE_DEBUG("%u objects cached, device has %u, not saving\n",
+		       nrofobjects, total);
+    goto out;
+  }
+
+  size = sizeof(cache_header_t) +
+    nrofstorages * sizeof(cache_storage_t) +
+    nrofobjects * sizeof(cache_object_t) +
+    nrofprops * sizeof(cache_prop_t);
+  if (stringsize + size > CACHE_MAX_SIZE)
+    goto out;
+  size += stringsize;
+  header = calloc(1, size);
+  if (header == NULL)
+    goto out;
+  memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+  header->version = CACHE_VERSION;
+  header->byteorder = CACHE_BYTEORDER;
+  header->nrofstorages = nrofstorages;
+  header->nrofobjects = nrofobjects;
+  header->nrofprops = nrofprops;
+  header->stringsize = stringsize;
+  memcpy(header + 1, storages, nrofstorages * sizeof(cache_storage_t));
+  co = (cache_object_t *) ((cache_storage_t *) (header + 1) + nrofstorages);
+  cp = (cache_prop_t *) (co + nrofobjects);
+  strings = (char *) (cp + nrofprops);
+
+  nrofprops = 0;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = &params->objects[i];
+
+    if (PTPOBJECT_REMOVED(ob))
+      continue;
+    co->oid = ob->oid;
+    co->flags = ob->flags & CACHE_OBJECT_FLAGS;
+    co->canon_flags = ob->canon_flags;
+    co->storageid = ob->oi.StorageID;
+    co->format = ob->oi.ObjectFormat;
+    co->protection = ob->oi.ProtectionStatus;
+    co->size = ob->oi.ObjectCompressedSize;
+    co->thumbformat = ob->oi.ThumbFormat;
+    co->thumbsize = ob->oi.ThumbCompressedSize;
+    co->thumbwidth = ob->oi.ThumbPixWidth;
+    co->thumbheight = ob->oi.ThumbPixHeight;
+    co->imagewidth = ob->oi.ImagePixWidth;
+    co->imageheight = ob->oi.ImagePixHeight;
+    co->imagebitdepth = ob->oi.ImageBitDepth;
+    co->parent = ob->oi.ParentObject;
+    co->associationtype = ob->oi.AssociationType;
+    co->associationdesc = ob->oi.AssociationDesc;
+    co->sequencenumber = ob->oi.SequenceNumber;
+    co->capturedate = ob->oi.CaptureDate;
+    co->modificationdate = ob->oi.ModificationDate;
+    co->filename = put_string(strings, &stroffset, ob->oi.Filename);
+    co->keywords = put_string(strings, &stroffset, ob->oi.Keywords);
+    co->firstprop = nrofprops;
+    co->nrofprops = 0;
+    if (!is_cacheable_proplist(ob)) {
+      // Read from the device again when next needed
+      co->flags &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+      co++;
+      continue;
+    }
+    for (j = 0; j < ob->nrofmtpprops; j++) {
+      MTPProperties *prop = &ob->mtpprops[j];
+
+      cp->objecthandle = prop->ObjectHandle;
+      cp->property = prop->property;
+      cp->datatype = prop->datatype;
+      if (prop->datatype == PTP_DTC_STR)
+	cp->value = put_string(strings, &stroffset, prop->propval.str);
+      else
+	cp->value = prop->propval.u64;
+      cp++;
+      nrofprops++;
+    }
+    co->nrofprops = nrofprops - co->firstprop;
+    co++;
+  }
+
+  // A unique name, so that processes saving at once do not collide
+  tmppath = malloc(strlen(path) + 8);
+  if (tmppath == NULL)
+    goto out;
+  snprintf(tmppath, strlen(path) + 8, "%s.XXXXXX", path);
+  fd = mkstemp(tmppath);
+  if (fd < 0) {
+    LIBMTP_CACHE_DEBUG("could not create %s\n", tmppath);
+    goto out;
+  }
+  f = fdopen(fd, "wb");
+  if (f == NULL) {
+    close(fd);
+    remove(tmppath);
+    goto out;
+  }
+  if (fwrite(header, 1, size, f) != size) {
+    fclose(f);
+    remove(tmppath);
+    goto out;
+  }
+  if (fclose(f) != 0) {
+    remove(tmppath);
+    goto out;
+  }
+#ifdef __WIN32__
+  // Windows will not rename onto an existing file
+  remove(path);
+#endif
+  if (rename(tmppath, path) != 0) {
+    remove(tmppath);
+    goto out;
+  }
+  LIBMTP_CACHE_DEBUG("saved %u objects to %s\n", nrofobjects, path);
+  ret = 0;
+
+ out:
+  free(header);
+  free(storages);
+  free(tmppath);
+  free(path);
+  return ret;
+}
+
+/*
+ * Map a cache file for reading, or where that is not available, read
+ * it into memory.
+ */
+static void *map_file(const char *path, size_t *size)
+{
+  struct stat st;
+  void *data;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(cache_header_t) ||
+      st.st_size > CACHE_MAX_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+#ifdef HAVE_SYS_MMAN_H
+  data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    data = NULL;
+#else
+  data = malloc(*size);
+  if (data != NULL) {
+    size_t done = 0;
+
+    while (done < *size) {
+      ssize_t got = read(fd, (char *) data + done, *size - done);
+
+      if (got <= 0) {
+	free(data);
+	data = NULL;
+	break;
+      }
+      done += got;
+    }
+  }
+#endif
+  close(fd);
+  return data;
+}
+
+static void unmap_file(void *data, size_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+  munmap(data, size);
+#else
+  free(data);
+#endif
+}
+
+static int get_string(PTPParams *params, const char *strings,
+		      uint32_t stringsize, uint64_t offset, char **str)
+{
+  *str = NULL;
+  if (offset == CACHE_NOSTRING)
+    return 0;
+  if (offset >= stringsize)
+    return -1;
+  *str = ptp_strintern(params, strings + offset);
+  return 0;
+}
+
+/**
+ * Fills the object cache of a freshly opened device from its cache
+ * file in the given directory, provided that file was written by this
+ * build and the storages of the device still have the fingerprint
+ * recorded in it. Otherwise the object cache is left alone.
+ * @param device the device to load the cache of.
+ * @param directory the directory cache files are kept in.
+ * @return 0 if the cache was loaded, any other value means it has to
+ *         be built from the device.
+ */
+int metadata_cache_load(LIBMTP_mtpdevice_t *device, const char *directory)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  cache_header_t *header;
+  cache_storage_t *storages = NULL;
+  cache_storage_t *saved;
+  cache_object_t *co;
+  cache_prop_t *cp;
+  const char *strings;
+  uint32_t nrofstorages;
+  uint64_t expected;
+  size_t size;
+  char *path;
+  uint32_t i, j;
+  int ret = -1;
+
+  path = cache_filename(params, directory);
+  if (path == NULL)
+    return -1;
+  header = map_file(path, &size);
+  if (header == NULL) {
+    free(path);
+    return -1;
+  }
+
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+      header->version != CACHE_VERSION ||
+      header->byteorder != CACHE_BYTEORDER)
+    goto out;
+  expected = sizeof(cache_header_t) +
+    (uint64_t) header->nrofstorages * sizeof(cache_storage_t) +
+    (uint64_t) header->nrofobjects * sizeof(cache_object_t) +
+    (uint64_t) header->nrofprops * sizeof(cache_prop_t) +
+    header->stringsize;
+  if (expected != size)
+    goto out;
+  saved = (cache_storage_t *) (header + 1);
+  co = (cache_object_t *) (saved + header->nrofstorages);
+  cp = (cache_prop_t *) (co + header->nrofobjects);
+  strings = (const char *) (cp + header->nrofprops);
+  if (header->stringsize > 0 && strings[header->stringsize - 1] != '\0')
+    goto out;
+
+  // Has anything changed since?
+  if (get_fingerprint(params, &storages, &nrofstorages) != 0)
+    goto out;
+  if (nrofstorages != header->nrofstorages)
+    goto stale;
+  for (i = 0; i < nrofstorages; i++) {
+    if (storages[i].id != saved[i].id ||
+	storages[i].nrofobjects != saved[i].nrofobjects ||
+	storages[i].maxcapacity != saved[i].maxcapacity ||
+	storages[i].freespace != saved[i].freespace)
+      goto stale;
+  }
+
+  ptp_objects_free(params);
+  for (i = 0; i < header->nrofobjects; i++, co++) {
+    PTPObject *ob;
+
+    if (co->oid == 0 || co->firstprop > header->nrofprops ||
+	co->nrofprops > header->nrofprops - co->firstprop)
+      goto corrupt;
+    // The same handle twice is not from us
+    if (ptp_object_find(params, co->oid, &ob) == PTP_RC_OK)
+      goto corrupt;
+    if (ptp_object_find_or_insert(params, co->oid, &ob) != PTP_RC_OK)
+      goto corrupt;
+    ob->flags |= co->flags & CACHE_OBJECT_FLAGS;
+    ob->canon_flags = co->canon_flags;
+    ob->oi.StorageID = co->storageid;
+    ob->oi.ObjectFormat = co->format;
+    ob->oi.ProtectionStatus = co->protection;
+    ob->oi.ObjectCompressedSize = co->size;
+    ob->oi.ThumbFormat = co->thumbformat;
+    ob->oi.ThumbCompressedSize = co->thumbsize;
+    ob->oi.ThumbPixWidth = co->thumbwidth;
+    ob->oi.ThumbPixHeight = co->thumbheight;
+    ob->oi.ImagePixWidth = co->imagewidth;
+    ob->oi.ImagePixHeight = co->imageheight;
+    ob->oi.ImageBitDepth = co->imagebitdepth;
+    ob->oi.ParentObject = co->parent;
+    ob->oi.AssociationType = co->associationtype;
+    ob->oi.AssociationDesc = co->associationdesc;
+    ob->oi.SequenceNumber = co->sequencenumber;
+    ob->oi.CaptureDate = co->capturedate;
+    ob->oi.ModificationDate = co->modificationdate;
+    if (get_string(params, strings, header->stringsize,
+		   co->filename, &ob->oi.Filename) ||
+	get_string(params, strings, header->stringsize,
+		   co->keywords, &ob->oi.Keywords))
+      goto corrupt;
+    for (j = 0; j < co->nrofprops; j++) {
+      cache_prop_t *p = &cp[co->firstprop + j];
+      MTPProperties *prop = ptp_object_new_mtpprop(params, ob);
+
+      if (prop == NULL)
+	goto corrupt;
+      memset(prop, 0, sizeof(MTPProperties));
+      prop->ObjectHandle = p->objecthandle;
+      prop->property = p->property;
+      prop->datatype = p->datatype;
+      if (p->datatype == PTP_DTC_STR) {
+	if (get_string(params, strings, header->stringsize,
+		       p->value, &prop->propval.str))
+	  goto corrupt;
+      } else {
+	prop->propval.u64 = p->value;
+      }
+    }
+  }
+  // It was saved in whatever order the cache had then
+  ptp_objects_sort(params);
+  LIBMTP_CACHE_DEBUG("loaded %u objects from %s\n", header->nrofobjects, path);
+  ret = 0;
+  goto out;
+
+ corrupt:
+  LIBMTP_ERROR("LIBMTP: ignoring broken metadata cache %s\n", path);
+  ptp_objects_free(params);
+  goto out;
+ stale:
+  LIBMTP_CACHE_DEBUG("%s is out of date\n", path);
+ out:
+  unmap_file(header, size);
+  free(storages);
+  free(path);
+  return ret;
+}
@@ -1170,6 +1170,49 @@ duplicate_DevicePropDesc(const PTPDevicePropDesc *src, PTPDevicePropDesc *dst) {
 	}
 }
 
+static inline void
+duplicate_ObjectPropDesc(const PTPObjectPropDesc *src, PTPObjectPropDesc *dst) {
+	int i;
+
+	memset (dst, 0, sizeof(*dst));
+	dst->ObjectPropertyCode	= src->ObjectPropertyCode;
+	dst->DataType		= src->DataType;
+	dst->GetSet		= src->GetSet;
+	dst->GroupCode		= src->GroupCode;
+
+	duplicate_PropertyValue (&src->FactoryDefaultValue, &dst->FactoryDefaultValue, src->DataType);
+
+	dst->FormFlag		= src->FormFlag;
+	switch (src->FormFlag) {
+	case PTP_OPFF_Range:
+		duplicate_PropertyValue (&src->FORM.Range.MinimumValue, &dst->FORM.Range.MinimumValue, src->DataType);
+		duplicate_PropertyValue (&src->FORM.Range.MaximumValue, &dst->FORM.Range.MaximumValue, src->DataType);
+		duplicate_PropertyValue (&src->FORM.Range.StepSize,     &dst->FORM.Range.StepSize,     src->DataType);
+		break;
+	case PTP_OPFF_Enumeration:
+		dst->FORM.Enum.NumberOfValues = src->FORM.Enum.NumberOfValues;
+		dst->FORM.Enum.SupportedValue = malloc (sizeof(dst->FORM.Enum.SupportedValue[0])*src->FORM.Enum.NumberOfValues);
+		for (i = 0; i<src->FORM.Enum.NumberOfValues ; i++)
+			duplicate_PropertyValue (&src->FORM.Enum.SupportedValue[i], &dst->FORM.Enum.SupportedValue[i], src->DataType);
+		break;
+	case PTP_OPFF_DateTime:
+		if (src->FORM.DateTime.String)
+			dst->FORM.DateTime.String = strdup (src->FORM.DateTime.String);
+		break;
+	case PTP_OPFF_RegularExpression:
+		if (src->FORM.RegularExpression.String)
+			dst->FORM.RegularExpression.String = strdup (src->FORM.RegularExpression.String);
+		break;
+	case PTP_OPFF_FixedLengthArray:
+	case PTP_OPFF_ByteArray:
+		dst->FORM.FixedLengthArray = src->FORM.FixedLengthArray;
+		break;
+	default:
+		/* LongString is never unpacked, there is nothing to copy */
+		break;
+	}
+}
+
 #define PTP_opd_ObjectPropertyCode	0
 #define PTP_opd_DataType		2
 #define PTP_opd_GetSet			4
@@ -1517,6 +1560,31 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 	return prop_count;
 }
 
+/*
+ * Unpack a single record of an MTP object property list, as used by the
+ * streaming decoder. Returns the number of bytes it took, or 0 if len
+ * does not hold a complete record (yet).
+ */
+static inline unsigned int
+ptp_unpack_OPL_record (PTPParams *params, unsigned char* data, unsigned int len, MTPProperties *prop)
+{
+	const unsigned int hdrlen = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t);
+	unsigned int offset = 0;
+
+	if (len <= hdrlen)
+		return 0;
+	prop->ObjectHandle = dtoh32a(data);
+	prop->property = dtoh16a(data + sizeof(uint32_t));
+	prop->datatype = dtoh16a(data + sizeof(uint32_t) + sizeof(uint16_t));
+	memset(&prop->propval, 0, sizeof(prop->propval));
+	if (!ptp_unpack_DPV(params, data + hdrlen, &offset, len - hdrlen, &prop->propval, prop->datatype))
+		return 0;
+	/* the 128 bit types are skipped without looking at the length */
+	if (offset > len - hdrlen)
+		return 0;
+	return hdrlen + offset;
+}
+
 /*
     PTP USB Event container unpack
     Copyright (c) 2003 Nikolai Kopanygin
@@ -3120,6 +3188,14 @@ ptp_unpack_ptp11_manifest (
 		return 0;
 	numberoifs = dtoh64ap(params,data);
 	curoffset = 8;
+	if (!numberoifs) {
+		*numoifs = 0;
+		*oifs = NULL;
+		return 1;
+	}
+	/* every entry takes at least 36 bytes, do not trust the count blindly */
+	if (numberoifs > (datalen - 8) / 36)
+		return 0;
 	xoifs = calloc(sizeof(PTPObjectFilesystemInfo),numberoifs);
 	if (!xoifs)
 		return 0;
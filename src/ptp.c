@@ -82,9 +82,10 @@ ptp_init_container(PTPContainer* ptp, uint16_t code, int n_param, ...)
 	ptp_init_container(&PTP, CODE, NARGS(__VA_ARGS__), ##__VA_ARGS__)
 
 static uint16_t ptp_exit_recv_memory_handler (PTPDataHandler*,unsigned char**,unsigned long*);
-static uint16_t ptp_init_recv_memory_handler(PTPDataHandler*);
+static uint16_t ptp_init_recv_memory_handler(PTPDataHandler*,PTPParams*);
 static uint16_t ptp_init_send_memory_handler(PTPDataHandler*,unsigned char*,unsigned long len);
 static uint16_t ptp_exit_send_memory_handler (PTPDataHandler *handler);
+static void ptp_proparena_release (PTPParams *params, MTPProperties *props, unsigned int n);
 
 void
 ptp_debug (PTPParams *params, const char *format, ...)
@@ -126,45 +127,15 @@ ptp_error (PTPParams *params, const char *format, ...)
 
 /* major PTP functions */
 
-/**
- * ptp_transaction:
- * params:	PTPParams*
- * 		PTPContainer* ptp	- general ptp container
- * 		uint16_t flags		- lower 8 bits - data phase description
- * 		unsigned int sendlen	- senddata phase data length
- * 		char** data		- send or receive data buffer pointer
- * 		int* recvlen		- receive data length
- *
- * Performs PTP transaction. ptp is a PTPContainer with appropriate fields
- * filled in (i.e. operation code and parameters). It's up to caller to do
- * so.
- * The flags decide thether the transaction has a data phase and what is its
- * direction (send or receive).
- * If transaction is sending data the sendlen should contain its length in
- * bytes, otherwise it's ignored.
- * The data should contain an address of a pointer to data going to be sent
- * or is filled with such a pointer address if data are received depending
- * od dataphase direction (send or received) or is being ignored (no
- * dataphase).
- * The memory for a pointer should be preserved by the caller, if data are
- * being retreived the appropriate amount of memory is being allocated
- * (the caller should handle that!).
- *
- * Return values: Some PTP_RC_* code.
- * Upon success PTPContainer* ptp contains PTP Response Phase container with
- * all fields filled in.
- **/
-uint16_t
-ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
+/* The transaction proper, see ptp_transaction_new() */
+static uint16_t
+ptp_transaction_run (PTPParams* params, PTPContainer* ptp,
 		     uint16_t flags, uint64_t sendlen,
 		     PTPDataHandler *handler
 ) {
 	int 		tries;
 	uint16_t	cmd;
 
-	if ((params==NULL) || (ptp==NULL))
-		return PTP_ERROR_BADPARAM;
-
 	cmd = ptp->Code;
 	ptp->Transaction_ID=params->transaction_id++;
 	ptp->SessionID=params->session_id;
@@ -233,12 +204,90 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	return ptp->Code;
 }
 
+/**
+ * ptp_transaction:
+ * params:	PTPParams*
+ * 		PTPContainer* ptp	- general ptp container
+ * 		uint16_t flags		- lower 8 bits - data phase description
+ * 		unsigned int sendlen	- senddata phase data length
+ * 		char** data		- send or receive data buffer pointer
+ * 		int* recvlen		- receive data length
+ *
+ * Performs PTP transaction. ptp is a PTPContainer with appropriate fields
+ * filled in (i.e. operation code and parameters). It's up to caller to do
+ * so.
+ * The flags decide thether the transaction has a data phase and what is its
+ * direction (send or receive).
+ * If transaction is sending data the sendlen should contain its length in
+ * bytes, otherwise it's ignored.
+ * The data should contain an address of a pointer to data going to be sent
+ * or is filled with such a pointer address if data are received depending
+ * od dataphase direction (send or received) or is being ignored (no
+ * dataphase).
+ * The memory for a pointer should be preserved by the caller, if data are
+ * being retreived the appropriate amount of memory is being allocated
+ * (the caller should handle that!).
+ *
+ * Return values: Some PTP_RC_* code.
+ * Upon success PTPContainer* ptp contains PTP Response Phase container with
+ * all fields filled in.
+ **/
+uint16_t
+ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
+		     uint16_t flags, uint64_t sendlen,
+		     PTPDataHandler *handler
+) {
+	uint16_t	ret;
+
+	if ((params==NULL) || (ptp==NULL))
+		return PTP_ERROR_BADPARAM;
+
+	/* event callbacks may run while the USB layer waits for us */
+	params->in_transaction++;
+	ret = ptp_transaction_run (params, ptp, flags, sendlen, handler);
+	params->in_transaction--;
+	return ret;
+}
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
 	unsigned long	size, curoff;
+	unsigned long	alloced;
+	PTPParams	*params;	/* for statistics, NULL when sending */
 } PTPMemHandlerPrivate;
 
+/*
+ * Make room for len bytes. When growing piecemeal the buffer at least
+ * doubles each time, so a data phase coming in as thousands of blocks
+ * costs a handful of reallocs rather than one per block. Room asked for
+ * up front (see memory_borrowfunc()) is allocated exactly.
+ */
+static uint16_t
+memory_reserve(PTPMemHandlerPrivate* priv, unsigned long len, int geometric)
+{
+	unsigned char	*newdata;
+	unsigned long	newsize;
+
+	if (len <= priv->alloced)
+		return PTP_RC_OK;
+	newsize = geometric ? priv->alloced * 2 : 0;
+	if (newsize < len)
+		newsize = len;
+	newdata = realloc (priv->data, newsize);
+	if (!newdata)
+		return PTP_RC_GeneralError;
+	priv->data = newdata;
+	priv->alloced = newsize;
+	if (priv->params) {
+		priv->params->recv_allocs++;
+		priv->params->recv_alloc_bytes += newsize;
+		if (newsize > priv->params->recv_alloc_peak)
+			priv->params->recv_alloc_peak = newsize;
+	}
+	return PTP_RC_OK;
+}
+
 static uint16_t
 memory_getfunc(PTPParams* params, void* private,
 	       unsigned long wantlen, unsigned char *data,
@@ -261,20 +310,43 @@ memory_putfunc(PTPParams* params, void* private,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
-	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		if (!priv->data)
-			return PTP_RC_GeneralError;
-		priv->size = priv->curoff + sendlen;
-	}
+	if (memory_reserve (priv, priv->curoff + sendlen, 1) != PTP_RC_OK)
+		return PTP_RC_GeneralError;
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
+	if (priv->curoff > priv->size)
+		priv->size = priv->curoff;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+memory_borrowfunc(PTPParams* params, void* private,
+	       unsigned long wantlen, unsigned char **data
+) {
+	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
+
+	/* size only grows on commit, the surplus is not data yet */
+	if (memory_reserve (priv, priv->curoff + wantlen, 0) != PTP_RC_OK)
+		return PTP_RC_GeneralError;
+	*data = priv->data + priv->curoff;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+memory_commitfunc(PTPParams* params, void* private,
+	       unsigned long len
+) {
+	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
+
+	priv->curoff += len;
+	if (priv->curoff > priv->size)
+		priv->size = priv->curoff;
 	return PTP_RC_OK;
 }
 
 /* init private struct for receiving data. */
 static uint16_t
-ptp_init_recv_memory_handler(PTPDataHandler *handler)
+ptp_init_recv_memory_handler(PTPDataHandler *handler, PTPParams *params)
 {
 	PTPMemHandlerPrivate* priv;
 	priv = malloc (sizeof(PTPMemHandlerPrivate));
@@ -283,9 +355,13 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler)
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->borrowfunc = memory_borrowfunc;
+	handler->commitfunc = memory_commitfunc;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
+	priv->alloced = 0;
+	priv->params = params;
 	return PTP_RC_OK;
 }
 
@@ -303,9 +379,13 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->borrowfunc = NULL;
+	handler->commitfunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
+	priv->alloced = len;
+	priv->params = NULL;
 	return PTP_RC_OK;
 }
 
@@ -325,6 +405,13 @@ ptp_exit_recv_memory_handler (PTPDataHandler *handler,
 	unsigned char **data, unsigned long *size
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)handler->priv;
+
+	/* give back the surplus of the last geometric step */
+	if (priv->size && priv->alloced > priv->size) {
+		unsigned char *newdata = realloc (priv->data, priv->size);
+		if (newdata)
+			priv->data = newdata;
+	}
 	*data = priv->data;
 	*size = priv->size;
 	free (priv);
@@ -375,6 +462,8 @@ ptp_init_fd_handler(PTPDataHandler *handler, int fd)
 	handler->priv = priv;
 	handler->getfunc = fd_getfunc;
 	handler->putfunc = fd_putfunc;
+	handler->borrowfunc = NULL;
+	handler->commitfunc = NULL;
 	priv->fd = fd;
 	return PTP_RC_OK;
 }
@@ -416,7 +505,7 @@ ptp_transaction (PTPParams* params, PTPContainer* ptp,
 		*data = NULL;
 		if (recvlen)
 			*recvlen = 0;
-		CHECK_PTP_RC(ptp_init_recv_memory_handler (&handler));
+		CHECK_PTP_RC(ptp_init_recv_memory_handler (&handler, params));
 		break;
 	default:break;
 	}
@@ -1490,11 +1579,11 @@ ptp_free_params (PTPParams *params)
 
 	free (params->cameraname);
 	free (params->wifi_profiles);
-	for (i=0;i<params->nrofobjects;i++)
-		ptp_free_object (&params->objects[i]);
-	free (params->objects);
+	ptp_objects_free (params);
+	ptp_strings_free (params);
 	free (params->storageids.Storage);
 	free (params->events);
+	free (params->cache_events);
 	for (i=0;i<params->nrofcanon_props;i++) {
 		free (params->canon_props[i].data);
 		ptp_free_devicepropdesc (&params->canon_props[i].dpd);
@@ -1506,6 +1595,16 @@ ptp_free_params (PTPParams *params)
 		ptp_free_devicepropdesc (&params->deviceproperties[i].desc);
 	free (params->deviceproperties);
 
+	for (i=0;i<(unsigned int)params->nrofobjectformats;i++) {
+		MTPObjectFormat	*of = &params->objectformats[i];
+		unsigned int	j;
+
+		for (j=0;j<of->nrofpds;j++)
+			ptp_free_objectpropdesc (&of->pds[j].opd);
+		free (of->pds);
+	}
+	free (params->objectformats);
+
 	ptp_free_DI (&params->deviceinfo);
 }
 
@@ -1623,7 +1722,11 @@ ptp_getfilesystemmanifest (PTPParams* params, uint32_t storage,
 	*numoifs = 0;
 	PTP_CNT_INIT(ptp, PTP_OC_GetFilesystemManifest, storage, objectformatcode, associationOH);
 	CHECK_PTP_RC (ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size));
-	ptp_unpack_ptp11_manifest (params, data, size, numoifs, oifs);
+	if (!ptp_unpack_ptp11_manifest (params, data, size, numoifs, oifs)) {
+		free (data);
+		return PTP_RC_GeneralError;
+	}
+	free (data);
 	return PTP_RC_OK;
 }
 
@@ -2643,7 +2746,7 @@ ptp_add_event (PTPParams *params, PTPContainer *evt)
 /* FIXME: incomplete ... needs storage mode retrieval support too (storage == 0xffffffff) */
 static uint16_t
 ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
-	unsigned int	k, i, j, last, changed;
+	unsigned int	k, i;
 	PTPCANONFolderEntry *tmp = NULL;
 	unsigned int	nroftmp = 0;
 	uint16_t	ret;
@@ -2667,7 +2770,6 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		storageids.Storage = malloc(sizeof(storageids.Storage[0]));
 		storageids.Storage[0] = storage;
 	}
-	last = changed = 0;
 
 	for (k=0;k<storageids.n;k++) {
 		if ((storageids.Storage[k] & 0xffff) == 0) {
@@ -2685,61 +2787,43 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		}
 		/* convert read entries into objectinfos */
 		for (i=0;i<nroftmp;i++) {
-			PTPObject	*newobs;
-
-			ob = NULL;
-			for (j=0;j<params->nrofobjects;j++) {
-				if (params->objects[(last+j)%params->nrofobjects].oid == tmp[i].ObjectHandle)  {
-					ob = &params->objects[(last+j)%params->nrofobjects];
-					break;
-				}
-			}
-			if (j == params->nrofobjects) {
-				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->nrofobjects,j);
-				newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-				if (!newobs) {
+			if (ptp_object_find (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
+				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->nrofobjects);
+				if (ptp_object_find_or_insert (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
 					free (tmp);
 					free (storageids.Storage);
 					return PTP_RC_GeneralError;
 				}
-				params->objects = newobs;
-				memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-				params->objects[params->nrofobjects].oid   = tmp[i].ObjectHandle;
-				params->objects[params->nrofobjects].flags = 0;
 
-				params->objects[params->nrofobjects].oi.StorageID = storageids.Storage[k];
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_STORAGEID_LOADED;
+				ob->oi.StorageID = storageids.Storage[k];
+				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 				if (handle == 0xffffffff)
-					params->objects[params->nrofobjects].oi.ParentObject = 0;
+					ob->oi.ParentObject = 0;
 				else
-					params->objects[params->nrofobjects].oi.ParentObject = handle;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-				params->objects[params->nrofobjects].oi.Filename = strdup(tmp[i].Filename);
-				params->objects[params->nrofobjects].oi.ObjectFormat = tmp[i].ObjectFormatCode;
+					ob->oi.ParentObject = handle;
+				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				ptp_strrelease (params, ob->oi.Filename);
+				ob->oi.Filename = ptp_strintern (params, tmp[i].Filename);
+				ob->oi.ObjectFormat = tmp[i].ObjectFormatCode;
 
 				ptp_debug (params, "   flags %x", tmp[i].Flags);
 				if (tmp[i].Flags & 0x1)
-					params->objects[params->nrofobjects].oi.ProtectionStatus = PTP_PS_ReadOnly;
+					ob->oi.ProtectionStatus = PTP_PS_ReadOnly;
 				else
-					params->objects[params->nrofobjects].oi.ProtectionStatus = PTP_PS_NoProtection;
-				params->objects[params->nrofobjects].canon_flags = tmp[i].Flags;
-				params->objects[params->nrofobjects].oi.ObjectCompressedSize = tmp[i].ObjectSize;
-				params->objects[params->nrofobjects].oi.CaptureDate = tmp[i].Time;
-				params->objects[params->nrofobjects].oi.ModificationDate = tmp[i].Time;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-
-				/*debug_objectinfo(params, tmp[i].ObjectHandle, &params->objects[params->nrofobjects].oi);*/
-				last = params->nrofobjects;
-				params->nrofobjects++;
-				changed = 1;
+					ob->oi.ProtectionStatus = PTP_PS_NoProtection;
+				ob->canon_flags = tmp[i].Flags;
+				ob->oi.ObjectCompressedSize = tmp[i].ObjectSize;
+				ob->oi.CaptureDate = tmp[i].Time;
+				ob->oi.ModificationDate = tmp[i].Time;
+				ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+
+				/*debug_objectinfo(params, tmp[i].ObjectHandle, &ob->oi);*/
 			} else {
-				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->nrofobjects,j);
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				/* for speeding up search */
-				last = (last+j)%params->nrofobjects;
+				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->nrofobjects);
 				if (handle != PTP_HANDLER_SPECIAL) {
 					ob->oi.ParentObject = handle;
 					ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+					ptp_object_changed (params, ob);
 				}
 				if (storageids.Storage[k] != PTP_HANDLER_SPECIAL) {
 					ob->oi.StorageID = storageids.Storage[k];
@@ -2749,8 +2833,6 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		}
 		free (tmp);
 	}
-	if (changed) ptp_objects_sort (params);
-
 	/* Do not cache ob, it might be reallocated and have a new address */
 	if (handle != 0xffffffff) {
 		ret = ptp_object_want (params, handle, PTPOBJECT_OBJECTINFO_LOADED, &ob);
@@ -2761,12 +2843,100 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 	return PTP_RC_OK;
 }
 
+/* Fill in a cached object from its filesystem manifest entry, taking over its filename */
+static void
+ptp_object_from_manifest (PTPParams *params, PTPObject *ob, PTPObjectFilesystemInfo *oif)
+{
+	ob->oi.StorageID 		= oif->StorageID;
+	ob->oi.ObjectFormat 		= oif->ObjectFormat;
+	ob->oi.ProtectionStatus 	= oif->ProtectionStatus;
+	ob->oi.ObjectCompressedSize	= oif->ObjectCompressedSize64;
+	ob->oi.ParentObject		= oif->ParentObject;
+
+	/* bad iOS, returns StorageID instead of 0x0 */
+	if (ob->oi.ParentObject == oif->StorageID) {
+		ptp_debug (params, "objectid 0x%08x aka %s has parent %08x, rewriting to 0", oif->ObjectHandle, oif->Filename, oif->ParentObject);
+		ob->oi.ParentObject = 0;
+	}
+
+	ob->oi.AssociationType		= oif->AssociationType;
+	ob->oi.AssociationDesc		= oif->AssociationDesc;
+	ob->oi.SequenceNumber		= oif->SequenceNumber;
+	ptp_strrelease (params, ob->oi.Filename);
+	ob->oi.Filename			= ptp_strintern_take (params, oif->Filename); /* hand over memory ownership */
+	oif->Filename			= NULL;
+	ob->oi.ModificationDate		= oif->ModificationDate;
+	/*
+	 * The manifest has no thumbnail and image sizes, capture date or
+	 * keywords, they are left empty rather than fetched one by one,
+	 * which is what the manifest saves us from. Get them from the
+	 * object's properties where needed.
+	 */
+	ob->oi.ThumbFormat		= 0;
+	ob->oi.ThumbCompressedSize	= 0;
+	ob->oi.ThumbPixWidth		= 0;
+	ob->oi.ThumbPixHeight		= 0;
+	ob->oi.ImagePixWidth		= 0;
+	ob->oi.ImagePixHeight		= 0;
+	ob->oi.ImageBitDepth		= 0;
+	ob->oi.CaptureDate		= 0;
+	ptp_strrelease (params, ob->oi.Keywords);
+	ob->oi.Keywords			= NULL;
+	ob->flags			|= PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED;
+	ptp_object_changed (params, ob);
+}
+
+/**
+ * ptp_list_storage_manifest:
+ * params:	PTPParams*
+ *		storage			- StorageID, 0xffffffff for all storages
+ *		numobs			- pointer to uint32_t that takes number of objects
+ *
+ * Lists all objects of a storage into the object cache with a single
+ * PTP 1.1 GetFilesystemManifest, in place of a GetObjectInfo for each
+ * one. The objects come with their object info marked as loaded, but
+ * without the thumbnail and image sizes, capture date and keywords,
+ * which the manifest does not carry.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_list_storage_manifest (PTPParams *params, uint32_t storage, uint32_t *numobs)
+{
+	uint64_t		numoifs = 0, i;
+	PTPObjectFilesystemInfo	*oifs = NULL;
+	uint16_t		ret = PTP_RC_OK;
+
+	*numobs = 0;
+	CHECK_PTP_RC(ptp_getfilesystemmanifest (params, storage, 0, 0, &numoifs, &oifs));
+	for (i=0;i<numoifs;i++) {
+		PTPObject	*ob;
+
+		if (!oifs[i].ObjectHandle ||
+		    ((storage != 0xffffffff) && (oifs[i].StorageID != storage))) {
+			ptp_debug (params, "manifest entry 0x%08x of storage 0x%08x does not belong here", oifs[i].ObjectHandle, oifs[i].StorageID);
+			ret = PTP_RC_GeneralError;
+			break;
+		}
+		if (ptp_object_find_or_insert (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK) {
+			ret = PTP_RC_GeneralError;
+			break;
+		}
+		ptp_object_from_manifest (params, ob, &oifs[i]);
+	}
+	for (i=0;i<numoifs;i++)
+		free (oifs[i].Filename);
+	free (oifs);
+	if (ret == PTP_RC_OK)
+		*numobs = numoifs;
+	return ret;
+}
+
 uint16_t
 ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
-	unsigned int		i, changed, last;
+	unsigned int		i;
 	uint16_t		ret;
 	uint32_t		xhandle = handle;
-	PTPObject		*newobs;
 	PTPObjectHandles	handles;
 
 	ptp_debug (params, "(storage=0x%08x, handle=0x%08x)", storage, handle);
@@ -2809,61 +2979,22 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
 		if (ret != PTP_RC_OK || !numoifs)
 			goto fallback;
 
-		last = changed = 0;
 		for (i=0;i<numoifs;i++) {
 			PTPObject	*ob;
-			unsigned int	j;
 
-			ob = NULL;
-			for (j=0;j<params->nrofobjects;j++) {
-				if (params->objects[(last+j)%params->nrofobjects].oid == oifs[i].ObjectHandle)  {
-					ob = &params->objects[(last+j)%params->nrofobjects];
-					break;
-				}
-			}
-			if (j == params->nrofobjects) {
-				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", oifs[i].ObjectHandle, params->nrofobjects,j);
-				newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-				if (!newobs) {
+			if (ptp_object_find (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK) {
+				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", oifs[i].ObjectHandle, params->nrofobjects);
+				if (ptp_object_find_or_insert (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK) {
 					free (oifs);
 					return PTP_RC_GeneralError;
 				}
-				params->objects = newobs;
-				memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-				params->objects[params->nrofobjects].oid = oifs[i].ObjectHandle;
-				params->objects[params->nrofobjects].flags = 0;
-				ob = &params->objects[params->nrofobjects];
-				params->nrofobjects++;
-				changed = 1;
 			} else {
-				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", oifs[i].ObjectHandle, params->nrofobjects,j);
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				/* for speeding up search */
-				last = (last+j)%params->nrofobjects;
-			}
-
-			ob->oi.StorageID 		= oifs[i].StorageID;
-			ob->oi.ObjectFormat 		= oifs[i].ObjectFormat;
-			ob->oi.ProtectionStatus 	= oifs[i].ProtectionStatus;
-			ob->oi.ObjectCompressedSize	= oifs[i].ObjectCompressedSize64;
-			ob->oi.ParentObject		= oifs[i].ParentObject;
-
-			/* bad iOS, returns StorageID instead of 0x0 */
-			if (ob->oi.ParentObject == oifs[i].StorageID) {
-				ptp_debug (params, "objectid 0x%08x aka %s has parent %08x, rewriting to 0", oifs[i].ObjectHandle, oifs[i].Filename, oifs[i].ParentObject);
-				ob->oi.ParentObject = 0;
+				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", oifs[i].ObjectHandle, params->nrofobjects);
 			}
 
-			ob->oi.AssociationType		= oifs[i].AssociationType;
-			ob->oi.AssociationDesc		= oifs[i].AssociationDesc;
-			ob->oi.SequenceNumber		= oifs[i].SequenceNumber;
-			ob->oi.Filename			= oifs[i].Filename; /* hand over memory ownership */
-			ob->oi.ModificationDate		= oifs[i].ModificationDate;
-			/* FIXME: most of it ... but not the image sizes */
-			ob->flags			|= PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED;
+			ptp_object_from_manifest (params, ob, &oifs[i]);
 		}
 		free (oifs);
-		if (changed) ptp_objects_sort (params);
 		return PTP_RC_OK;
 	}
 fallback:
@@ -2883,51 +3014,36 @@ fallback:
 	}
 	if (ret != PTP_RC_OK)
 		return ret;
-	last = changed = 0;
 	for (i=0;i<handles.n;i++) {
 		PTPObject	*ob;
-		unsigned int	j;
 
-		ob = NULL;
-		for (j=0;j<params->nrofobjects;j++) {
-			if (params->objects[(last+j)%params->nrofobjects].oid == handles.Handler[i])  {
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				break;
+		if (ptp_object_find (params, handles.Handler[i], &ob) != PTP_RC_OK) {
+			ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", handles.Handler[i], params->nrofobjects);
+			if (ptp_object_find_or_insert (params, handles.Handler[i], &ob) != PTP_RC_OK) {
+				free (handles.Handler);
+				return PTP_RC_GeneralError;
 			}
-		}
-		if (j == params->nrofobjects) {
-			ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", handles.Handler[i], params->nrofobjects,j);
-			newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-			if (!newobs) return PTP_RC_GeneralError;
-			params->objects = newobs;
-			memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-			params->objects[params->nrofobjects].oid = handles.Handler[i];
-			params->objects[params->nrofobjects].flags = 0;
 			/* root directory list files might return all files, so avoid tagging it */
 			if (handle != PTP_HANDLER_SPECIAL && handle) {
 				ptp_debug (params, "  parenthandle 0x%08x", handle);
 				if (handles.Handler[i] == handle) { /* EOS bug where oid == parent(oid) */
-					params->objects[params->nrofobjects].oi.ParentObject = 0;
+					ob->oi.ParentObject = 0;
 				} else {
-					params->objects[params->nrofobjects].oi.ParentObject = handle;
+					ob->oi.ParentObject = handle;
 				}
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
 			}
 			if (storage != PTP_HANDLER_SPECIAL) {
 				ptp_debug (params, "  storage 0x%08x", storage);
-				params->objects[params->nrofobjects].oi.StorageID = storage;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_STORAGEID_LOADED;
+				ob->oi.StorageID = storage;
+				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
-			params->nrofobjects++;
-			changed = 1;
 		} else {
-			ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", handles.Handler[i], params->nrofobjects,j);
-			ob = &params->objects[(last+j)%params->nrofobjects];
-			/* for speeding up search */
-			last = (last+j)%params->nrofobjects;
+			ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", handles.Handler[i], params->nrofobjects);
 			if (handle != PTP_HANDLER_SPECIAL) {
 				ob->oi.ParentObject = handle;
 				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				ptp_object_changed (params, ob);
 			}
 			if (storage != PTP_HANDLER_SPECIAL) {
 				ob->oi.StorageID = storage;
@@ -2936,7 +3052,6 @@ fallback:
 		}
 	}
 	free (handles.Handler);
-	if (changed) ptp_objects_sort (params);
 	return PTP_RC_OK;
 }
 
@@ -2959,25 +3074,27 @@ handle_event_internal (PTPParams *params, PTPContainer *event)
 	}
 	case PTP_EC_StoreAdded:
 	case PTP_EC_StoreRemoved: {
-		unsigned int i;
-
-		/* FIXME: if we just remove 1 out of many storages, we do not need to invalidate/reload the entire tree? */
+		uint32_t	storage = event->Param1;
 
-		/* refetch storage IDs and also invalidate whole object tree */
+		/* refetch storage IDs */
 		free (params->storageids.Storage);
 		params->storageids.Storage	= NULL;
 		params->storageids.n 		= 0;
 		ptp_getstorageids (params, &params->storageids);
+		params->storagechanged		= 1;
 
-		/* free object storage as it might be associated with the storage ids */
-		/* FIXME: enhance and just delete the ones from the storage */
-		for (i=0;i<params->nrofobjects;i++)
-			ptp_free_object (&params->objects[i]);
-		free (params->objects);
-		params->objects 		= NULL;
-		params->nrofobjects 		= 0;
+		/* only the objects of that one storage need reloading */
+		if (storage && (storage != 0xffffffff)) {
+			ptp_remove_storage_from_cache (params, storage);
+			if ((event->Code == PTP_EC_StoreAdded) &&
+			    (storage & 0xffff) && (storage != 0x80000001))
+				ptp_list_folder (params, storage, PTP_HANDLER_SPECIAL);
+			break;
+		}
+
+		/* no storage given, invalidate the whole object tree */
+		ptp_objects_free (params);
 
-		params->storagechanged		= 1;
 		/* mirror what we do in camera_init, fetch root directory entries. */
 		if (params->deviceinfo.VendorExtensionID != PTP_VENDOR_SONY)
 			ptp_list_folder (params, PTP_HANDLER_SPECIAL, PTP_HANDLER_SPECIAL);
@@ -4746,15 +4863,56 @@ ptp_nikon_writewifiprofile (PTPParams* params, PTPNIKONWifiProfile* profile)
 	return ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 }
 
+/*
+ * Object property descriptions never change during a session, so they
+ * are remembered per object format in params->objectformats. The entry
+ * of a format holds whatever descriptions have been asked for so far,
+ * and once GetObjectPropsSupported has been asked for it, exactly the
+ * supported properties (allpds).
+ */
+static MTPObjectFormat *
+ptp_mtp_find_objectformat (PTPParams *params, uint16_t ofc, int create)
+{
+	MTPObjectFormat	*of;
+	int		i;
+
+	for (i=0;i<params->nrofobjectformats;i++)
+		if (params->objectformats[i].ofc == ofc)
+			return &params->objectformats[i];
+	if (!create)
+		return NULL;
+	of = realloc (params->objectformats, (params->nrofobjectformats+1)*sizeof(MTPObjectFormat));
+	if (!of)
+		return NULL;
+	params->objectformats = of;
+	of = &params->objectformats[params->nrofobjectformats++];
+	memset (of, 0, sizeof(*of));
+	of->ofc = ofc;
+	return of;
+}
+
+static MTPPropertyDesc *
+ptp_mtp_find_propdesc (MTPObjectFormat *of, uint16_t opc)
+{
+	unsigned int	i;
+
+	for (i=0;i<of->nrofpds;i++)
+		if (of->pds[i].opc == opc)
+			return &of->pds[i];
+	return NULL;
+}
+
 /**
  * ptp_mtp_getobjectpropssupported:
  *
  * This command gets the object properties possible from the device.
+ * It is only sent once per object format and session, the answer is
+ * remembered in params->objectformats.
  *
  * params:	PTPParams*
  *	uint ofc		- object format code
  *	unsigned int *propnum	- number of elements in returned array
- *	uint16_t *props		- array of supported properties
+ *	uint16_t *props		- array of supported properties, to be freed
  *
  * Return values: Some PTP_RC_* code.
  *
@@ -4765,13 +4923,57 @@ ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc,
 ) {
 	PTPContainer	ptp;
 	unsigned char	*data = NULL;
-	unsigned int	xsize = 0;
+	unsigned int	xsize = 0, i;
+	MTPObjectFormat	*of;
+	MTPPropertyDesc	*pds = NULL, *pd;
+	uint16_t	*opcs = NULL;
+	uint32_t	nrofopcs;
+
+	of = ptp_mtp_find_objectformat (params, ofc, 0);
+	if (!of || !of->allpds) {
+		PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropsSupported, ofc);
+		CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &xsize));
+		if (!data) return PTP_RC_GeneralError;
+		nrofopcs = ptp_unpack_uint16_t_array (params, data, 0, xsize, &opcs);
+		free(data);
 
-        PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropsSupported, ofc);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &xsize));
-	if (!data) return PTP_RC_GeneralError;
-	*propnum=ptp_unpack_uint16_t_array (params, data, 0, xsize, props);
-	free(data);
+		of = ptp_mtp_find_objectformat (params, ofc, 1);
+		if (nrofopcs)
+			pds = calloc (nrofopcs, sizeof(MTPPropertyDesc));
+		if (!of || (nrofopcs && !pds)) {
+			free (opcs);
+			return PTP_RC_GeneralError;
+		}
+		/* Keep the descriptions asked for before */
+		for (i=0;i<nrofopcs;i++) {
+			pd = ptp_mtp_find_propdesc (of, opcs[i]);
+			if (pd) {
+				pds[i] = *pd;
+				pd->opc = 0;
+			}
+			pds[i].opc = opcs[i];
+		}
+		for (i=0;i<of->nrofpds;i++)
+			if (of->pds[i].opc)
+				ptp_free_objectpropdesc (&of->pds[i].opd);
+		free (of->pds);
+		of->pds = pds;
+		of->nrofpds = nrofopcs;
+		of->allpds = 1;
+		free (opcs);
+	}
+
+	*props = NULL;
+	*propnum = of->nrofpds;
+	if (!of->nrofpds)
+		return PTP_RC_OK;
+	*props = malloc (of->nrofpds*sizeof(uint16_t));
+	if (!*props) {
+		*propnum = 0;
+		return PTP_RC_GeneralError;
+	}
+	for (i=0;i<of->nrofpds;i++)
+		(*props)[i] = of->pds[i].opc;
 	return PTP_RC_OK;
 }
 
@@ -4794,11 +4996,35 @@ ptp_mtp_getobjectpropdesc (
 	PTPContainer	ptp;
 	unsigned char	*data = NULL;
 	unsigned int	size;
+	MTPObjectFormat	*of;
+	MTPPropertyDesc	*pd = NULL, *pds;
+	int		unpacked;
+
+	of = ptp_mtp_find_objectformat (params, ofc, 1);
+	if (of)
+		pd = ptp_mtp_find_propdesc (of, opc);
+	if (pd && pd->opd.DataType != PTP_DTC_UNDEF) {
+		duplicate_ObjectPropDesc (&pd->opd, opd);
+		return PTP_RC_OK;
+	}
 
         PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropDesc, opc, ofc);
         CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size));
-	ptp_unpack_OPD (params, data, opd, size);
+	unpacked = ptp_unpack_OPD (params, data, opd, size);
 	free(data);
+
+	/* Remember it, unless the format does not even have the property */
+	if (!unpacked || !of || (!pd && of->allpds))
+		return PTP_RC_OK;
+	if (!pd) {
+		pds = realloc (of->pds, (of->nrofpds+1)*sizeof(MTPPropertyDesc));
+		if (!pds)
+			return PTP_RC_OK;
+		of->pds = pds;
+		pd = &of->pds[of->nrofpds++];
+		pd->opc = opc;
+	}
+	duplicate_ObjectPropDesc (opd, &pd->opd);
 	return PTP_RC_OK;
 }
 
@@ -4939,46 +5165,258 @@ ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPPropert
 	return ptp_mtp_getobjectproplist_level(params, handle, 0, props, nrofprops);
 }
 
-uint16_t
-ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
-			    uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops)
-{
-	PTPContainer	ptp;
-	uint16_t	ret;
-	unsigned char	*data = NULL;
-	uint32_t	size;
+/*
+ * Streaming GetObjPropList decoder: the records are unpacked by the data
+ * handler as the blocks come in from the transport and passed on one by
+ * one, so the list is never held in memory as a whole. Only a record
+ * straddling two blocks is carried over.
+ */
 
-	PTP_CNT_INIT(ptp, PTP_OC_MTP_SendObjectPropList, *store, *parenthandle, (uint32_t) objecttype,
-		     (uint32_t) (objectsize >> 32), (uint32_t) (objectsize & 0xffffffffU)
-	);
+/* Anything bigger than this can not be decoded and ends the list */
+#define PTP_OPL_MAX_RECORD	0x1000000
 
-	/* Set object handle to 0 for a new object */
-	size = ptp_pack_OPL(params,props,nrofprops,&data);
-	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
-	free(data);
-	*store = ptp.Param1;
-	*parenthandle = ptp.Param2;
-	*handle = ptp.Param3;
+typedef struct {
+	PTPParams		*params;
+	PTPOPLRecordFunc	recordfunc;
+	void			*recordpriv;
+	int			header_done;
+	int			done;
+	uint32_t		prop_count;
+	uint32_t		nrofprops;
+	uint16_t		ret;
+	unsigned char		*pending;
+	unsigned long		pendinglen, pendingalloc;
+} PTPOPLStreamPrivate;
 
-	return ret;
+/* Decode as many complete records as there are, returns the bytes used */
+static unsigned long
+opl_stream_decode(PTPOPLStreamPrivate *priv, unsigned char *data, unsigned long len)
+{
+	PTPParams	*params = priv->params;
+	unsigned long	used = 0;
+
+	if (!priv->header_done) {
+		if (len < sizeof(uint32_t))
+			return 0;
+		priv->prop_count = dtoh32a(data);
+		priv->header_done = 1;
+		used += sizeof(uint32_t);
+		ptp_debug (params ,"Streaming MTP OPL (prop_count %d)", priv->prop_count);
+	}
+	while (!priv->done && priv->nrofprops < priv->prop_count) {
+		MTPProperties	prop;
+		unsigned int	reclen;
+
+		reclen = ptp_unpack_OPL_record(params, data + used, len - used, &prop);
+		if (!reclen)
+			break;
+		used += reclen;
+		priv->nrofprops++;
+		priv->ret = priv->recordfunc(params, priv->recordpriv, &prop);
+		if (priv->ret != PTP_RC_OK)
+			priv->done = 1;
+	}
+	if (priv->header_done && priv->nrofprops == priv->prop_count)
+		priv->done = 1;
+	return used;
 }
 
-uint16_t
-ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops)
+static uint16_t
+opl_stream_append(PTPOPLStreamPrivate *priv, unsigned char *data, unsigned long len)
 {
-	PTPContainer	ptp;
-	unsigned char	*data = NULL;
-	uint32_t	size;
+	if (priv->pendinglen + len > priv->pendingalloc) {
+		unsigned long	newalloc = priv->pendingalloc ? priv->pendingalloc : 1024;
+		unsigned char	*newpending;
 
-	PTP_CNT_INIT(ptp, PTP_OC_MTP_SetObjPropList);
-	size = ptp_pack_OPL(params,props,nrofprops,&data);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL));
-	free(data);
+		while (newalloc < priv->pendinglen + len)
+			newalloc *= 2;
+		newpending = realloc (priv->pending, newalloc);
+		if (!newpending)
+			return PTP_RC_GeneralError;
+		priv->pending = newpending;
+		priv->pendingalloc = newalloc;
+	}
+	memcpy (priv->pending + priv->pendinglen, data, len);
+	priv->pendinglen += len;
 	return PTP_RC_OK;
 }
 
-uint16_t
-ptp_mtpz_sendwmdrmpdapprequest (PTPParams* params, unsigned char *appcertmsg, uint32_t size)
+static uint16_t
+opl_stream_putfunc(PTPParams* params, void* private,
+		   unsigned long sendlen, unsigned char *data
+) {
+	PTPOPLStreamPrivate	*priv = (PTPOPLStreamPrivate*)private;
+	unsigned long		used;
+
+	if (priv->done)		/* trailing data, or the consumer gave up */
+		return priv->ret;
+
+	/* First complete the record left over from the previous block,
+	 * taking just as much of this one as it needs. */
+	while (priv->pendinglen && sendlen) {
+		unsigned long	step = priv->pendinglen < 512 ? 512 : priv->pendinglen;
+
+		if (step > sendlen)
+			step = sendlen;
+		CHECK_PTP_RC(opl_stream_append (priv, data, step));
+		data += step;
+		sendlen -= step;
+		used = opl_stream_decode (priv, priv->pending, priv->pendinglen);
+		if (priv->done)
+			return priv->ret;
+		if (used) {
+			/* hand back what the decoded records did not need */
+			data -= priv->pendinglen - used;
+			sendlen += priv->pendinglen - used;
+			priv->pendinglen = 0;
+		}
+	}
+
+	used = opl_stream_decode (priv, data, sendlen);
+	if (priv->done)
+		return priv->ret;
+	if (used < sendlen)
+		CHECK_PTP_RC(opl_stream_append (priv, data + used, sendlen - used));
+	if (priv->pendinglen > PTP_OPL_MAX_RECORD) {
+		ptp_debug (priv->params ,"undecodable MTP Object Property List record at property %d (of %d)", priv->nrofprops, priv->prop_count);
+		priv->done = 1;
+		priv->pendinglen = 0;
+	}
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_mtp_getobjectproplist_stream_generic:
+ * params:	PTPParams*
+ *		handle			- object handle, 0xffffffff for all objects
+ *		formats			- ObjectFormatCode to list, 0 for all
+ *		properties		- property code, 0xffffffff for all
+ *		propertygroups		- property group, if properties is 0
+ *		level			- depth, 1 for the children of a folder
+ *		recordfunc		- called for every property record
+ *		priv			- passed on to recordfunc
+ *		nrofprops		- number of records decoded
+ *
+ * Gets properties of the object(s) like ptp_mtp_getobjectproplist_generic(),
+ * but decodes the list while it is coming in and hands each record to
+ * recordfunc instead of returning an array of them. The records arrive
+ * in the order the device sends them.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectproplist_stream_generic (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, PTPOPLRecordFunc recordfunc, void *priv, int *nrofprops)
+{
+	PTPContainer		ptp;
+	PTPDataHandler		handler;
+	PTPOPLStreamPrivate	stream;
+	uint16_t		ret;
+
+	memset (&stream, 0, sizeof(stream));
+	stream.params = params;
+	stream.recordfunc = recordfunc;
+	stream.recordpriv = priv;
+	stream.ret = PTP_RC_OK;
+	handler.getfunc = NULL;
+	handler.putfunc = opl_stream_putfunc;
+	handler.borrowfunc = NULL;
+	handler.commitfunc = NULL;
+	handler.priv = &stream;
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, formats, properties, propertygroups, level);
+	ret = ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, &handler);
+	if (stream.ret != PTP_RC_OK)
+		ret = stream.ret;
+	if (ret == PTP_RC_OK && !stream.done) {
+		if (!stream.header_done)
+			ptp_debug (params ,"must have at least 4 bytes data, not %lu", stream.pendinglen);
+		else {
+			ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", stream.nrofprops, stream.prop_count);
+			ptp_debug (params ,"device probably needs DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL");
+			ptp_debug (params ,"or even DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST");
+		}
+	}
+	free (stream.pending);
+	*nrofprops = stream.nrofprops;
+	return ret;
+}
+
+/**
+ * ptp_mtp_getobjectproplist_stream_level:
+ * params:	PTPParams*
+ *		handle			- object handle, 0xffffffff for all objects
+ *		level			- depth, 1 for the children of a folder
+ *		recordfunc		- called for every property record
+ *		priv			- passed on to recordfunc
+ *		nrofprops		- number of records decoded
+ *
+ * Gets all properties of the object(s) like ptp_mtp_getobjectproplist_level(),
+ * streaming them like ptp_mtp_getobjectproplist_stream_generic().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectproplist_stream_level (PTPParams* params, uint32_t handle, uint32_t level, PTPOPLRecordFunc recordfunc, void *priv, int *nrofprops)
+{
+	return ptp_mtp_getobjectproplist_stream_generic (params, handle,
+		     0x00000000U,  /* 0x00000000U should be "all formats" */
+		     0xFFFFFFFFU,  /* 0xFFFFFFFFU should be "all properties" */
+		     0,
+		     level,
+		     recordfunc,
+		     priv,
+		     nrofprops
+	);
+}
+
+uint16_t
+ptp_mtp_getobjectproplist_stream (PTPParams* params, uint32_t handle, PTPOPLRecordFunc recordfunc, void *priv, int *nrofprops)
+{
+	return ptp_mtp_getobjectproplist_stream_level(params, handle, 0xFFFFFFFFU, recordfunc, priv, nrofprops);
+}
+
+uint16_t
+ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
+			    uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops)
+{
+	PTPContainer	ptp;
+	uint16_t	ret;
+	unsigned char	*data = NULL;
+	uint32_t	size;
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_SendObjectPropList, *store, *parenthandle, (uint32_t) objecttype,
+		     (uint32_t) (objectsize >> 32), (uint32_t) (objectsize & 0xffffffffU)
+	);
+
+	/* Set object handle to 0 for a new object */
+	size = ptp_pack_OPL(params,props,nrofprops,&data);
+	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
+	free(data);
+	*store = ptp.Param1;
+	*parenthandle = ptp.Param2;
+	*handle = ptp.Param3;
+
+	return ret;
+}
+
+uint16_t
+ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops)
+{
+	PTPContainer	ptp;
+	unsigned char	*data = NULL;
+	uint32_t	size;
+	uint16_t	ret;
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_SetObjPropList);
+	size = ptp_pack_OPL(params,props,nrofprops,&data);
+	/* a refused list is retried in smaller pieces, do not leak it */
+	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
+	free(data);
+	return ret;
+}
+
+uint16_t
+ptp_mtpz_sendwmdrmpdapprequest (PTPParams* params, unsigned char *appcertmsg, uint32_t size)
 {
 	PTPContainer ptp;
 
@@ -5427,15 +5865,39 @@ ptp_free_objectinfo (PTPObjectInfo *oi)
         free (oi->Keywords); oi->Keywords = NULL;
 }
 
+/* Drops the cached MTP properties of an object */
 void
-ptp_free_object (PTPObject *ob)
+ptp_free_object_mtpprops (PTPParams *params, PTPObject *ob)
 {
 	unsigned int i;
+
+	for (i=0;i<ob->nrofmtpprops;i++) {
+		MTPProperties *prop = &ob->mtpprops[i];
+
+		if (prop->datatype == PTP_DTC_STR) {
+			ptp_strrelease (params, prop->propval.str);
+			prop->propval.str = NULL;
+		} else
+			ptp_destroy_object_prop(prop);
+	}
+	if (ob->flags & PTPOBJECT_MTPPROPS_ARENA)
+		ptp_proparena_release (params, ob->mtpprops, ob->nrofmtpprops);
+	else
+		free (ob->mtpprops);
+	ob->flags &= ~PTPOBJECT_MTPPROPS_ARENA;
+	ob->mtpprops = NULL;
+	ob->nrofmtpprops = 0;
+}
+
+/* Frees a cached object, whose strings are interned in params */
+void
+ptp_free_object (PTPParams *params, PTPObject *ob)
+{
 	if (!ob) return;
 
-	ptp_free_objectinfo (&ob->oi);
-	for (i=0;i<ob->nrofmtpprops;i++)
-		ptp_destroy_object_prop(&ob->mtpprops[i]);
+	ptp_strrelease (params, ob->oi.Filename); ob->oi.Filename = NULL;
+	ptp_strrelease (params, ob->oi.Keywords); ob->oi.Keywords = NULL;
+	ptp_free_object_mtpprops (params, ob);
 	ob->flags = 0;
 }
 
@@ -8818,22 +9280,990 @@ ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t
 	return NULL;
 }
 
+/*
+ * The object cache keeps the objects in an array that grows by doubling,
+ * in the order they were added unless ptp_objects_sort() was called.
+ * Handles are looked up through objects_index, an open addressing hash
+ * table with linear probing that is kept at most half full. Each bucket
+ * holds the array slot of an object plus one, 0 marks an empty bucket.
+ * Should the index not be allocatable the lookups fall back to scanning
+ * the array.
+ *
+ * Removed objects are left in the array as tombstones with oid 0, so the
+ * other objects neither move nor change their order. The array is only
+ * compacted once the tombstones make up half of it, or when a batch
+ * removal is done.
+ */
+#define PTP_OBJECTS_MIN		64
+
+static inline unsigned int
+ptp_objects_hash (uint32_t handle)
+{
+	/* handles are mostly sequential, spread them out */
+	handle ^= handle >> 16;
+	handle *= 0x45d9f3bU;
+	handle ^= handle >> 16;
+	return handle;
+}
+
+static void
+ptp_objects_index_put (PTPParams *params, unsigned int slot)
+{
+	unsigned int	mask = params->objects_indexsize - 1;
+	unsigned int	i = ptp_objects_hash (params->objects[slot].oid) & mask;
+
+	while (params->objects_index[i])
+		i = (i + 1) & mask;
+	params->objects_index[i] = slot + 1;
+}
+
+/* Remove a bucket, moving up the entries probed past it */
+static void
+ptp_objects_index_del (PTPParams *params, unsigned int bucket)
+{
+	unsigned int	mask = params->objects_indexsize - 1;
+	unsigned int	i = bucket, j = bucket, k;
+
+	params->objects_index[i] = 0;
+	while (1) {
+		j = (j + 1) & mask;
+		if (!params->objects_index[j])
+			break;
+		k = ptp_objects_hash (params->objects[params->objects_index[j]-1].oid) & mask;
+		/* leave it if its home bucket lies cyclically in (i,j] */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		params->objects_index[i] = params->objects_index[j];
+		params->objects_index[j] = 0;
+		i = j;
+	}
+}
+
+/* Returns the bucket of handle, or -1 if it is not in the index */
+static int
+ptp_objects_index_find (PTPParams *params, uint32_t handle)
+{
+	unsigned int	mask = params->objects_indexsize - 1;
+	unsigned int	i = ptp_objects_hash (handle) & mask;
+
+	while (params->objects_index[i]) {
+		if (params->objects[params->objects_index[i]-1].oid == handle)
+			return i;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+/* Build the index from scratch for the objects array as it is */
+static uint16_t
+ptp_objects_index_rebuild (PTPParams *params)
+{
+	unsigned int	size = PTP_OBJECTS_MIN, i;
+
+	while (size < params->nrofobjects * 2)
+		size *= 2;
+	free (params->objects_index);
+	params->objects_indexsize = 0;
+	params->objects_index = calloc (size, sizeof(params->objects_index[0]));
+	if (!params->objects_index)
+		return PTP_RC_GeneralError;
+	params->objects_indexsize = size;
+	for (i=0;i<params->nrofobjects;i++)
+		if (params->objects[i].oid)
+			ptp_objects_index_put (params, i);
+	return PTP_RC_OK;
+}
+
+/*
+ * The children of each parent are found through a second index, built
+ * on demand the first time it is asked for and kept up to date from then
+ * on: objects_parents, sorted by handle, holds one run per parent with
+ * the array slots of its children. A run is in cache order, or by name
+ * once asked for that, with case ignored like the file systems of most
+ * devices do, or in no particular order after the cache was sorted.
+ *
+ * Every indexed object is flagged PTPOBJECT_CHILD_INDEXED and remembers
+ * the run it is in in childof. Objects that are added, or whose parent
+ * or file name changes, are only noted in objects_pending, see
+ * ptp_object_changed(), and filed into their run by the next lookup, as
+ * their parent often is not known yet when they come in. Removed objects
+ * leave their run right away, compacting the cache renumbers the runs.
+ */
+struct _PTPObjectParent {
+	uint32_t	parent;
+	unsigned int	*slots;
+	unsigned int	nrofchildren;
+	unsigned int	alloced;
+	int		order;
+};
+
+#define PTP_CHILDREN_BYSLOT	0
+#define PTP_CHILDREN_BYNAME	1
+#define PTP_CHILDREN_UNORDERED	(-1)
+
+#define PTPOBJECT_PARENT_KNOWN(ob)	((ob)->flags & (PTPOBJECT_PARENTOBJECT_LOADED|PTPOBJECT_OBJECTINFO_LOADED))
+
+typedef struct {
+	uint32_t	key;	/* parent handle */
+	unsigned int	slot;
+	const char	*name;
+} PTPObjectChild;
+
+static int
+ptp_objects_child_cmp (const void *a, const void *b)
+{
+	const PTPObjectChild *ca = a, *cb = b;
+
+	if (ca->key != cb->key) return (ca->key > cb->key) ? 1 : -1;
+	if (ca->slot != cb->slot) return (ca->slot > cb->slot) ? 1 : -1;
+	return 0;
+}
+
+static int
+ptp_objects_child_namecmp (const void *a, const void *b)
+{
+	const PTPObjectChild *ca = a, *cb = b;
+	int ret;
+
+	if (!ca->name || !cb->name) {
+		if (ca->name != cb->name)
+			return ca->name ? 1 : -1;
+	} else if ((ret = strcasecmp (ca->name, cb->name)) ||
+		   (ret = strcmp (ca->name, cb->name)))
+		return ret;
+	return ptp_objects_child_cmp (a, b);
+}
+
+/* Compare two children of one parent in the order of their run */
+static int
+ptp_objects_child_slotcmp (PTPParams *params, unsigned int a, unsigned int b, int order)
+{
+	PTPObjectChild	ca, cb;
+
+	ca.key	= cb.key = 0;
+	ca.slot	= a;
+	cb.slot	= b;
+	ca.name	= cb.name = NULL;
+	if (order != PTP_CHILDREN_BYNAME)
+		return ptp_objects_child_cmp (&ca, &cb);
+	ca.name	= params->objects[a].oi.Filename;
+	cb.name	= params->objects[b].oi.Filename;
+	return ptp_objects_child_namecmp (&ca, &cb);
+}
+
+/* Drop the index of children by parent, it is built again when next asked for */
+static void
+ptp_objects_children_free (PTPParams *params)
+{
+	unsigned int	i;
+
+	for (i=0;i<params->nrofobjects_parents;i++)
+		free (params->objects_parents[i].slots);
+	free (params->objects_parents);
+	params->objects_parents		= NULL;
+	params->nrofobjects_parents	= 0;
+	free (params->objects_pending);
+	params->objects_pending		= NULL;
+	params->nrofobjects_pending	= 0;
+	params->objects_pendingsize	= 0;
+	for (i=0;i<params->nrofobjects;i++)
+		params->objects[i].flags &= ~(PTPOBJECT_CHILD_INDEXED|PTPOBJECT_CHILD_PENDING);
+}
+
+/* Find the run of a parent, or add an empty one for it if create is set */
+static PTPObjectParent *
+ptp_objects_children_run (PTPParams *params, uint32_t parent, int create)
+{
+	unsigned int	lo = 0, hi = params->nrofobjects_parents;
+	PTPObjectParent	*p;
+
+	while (lo < hi) {
+		unsigned int	mid = lo + (hi - lo) / 2;
+
+		if (params->objects_parents[mid].parent == parent)
+			return &params->objects_parents[mid];
+		if (params->objects_parents[mid].parent < parent)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!create)
+		return NULL;
+	p = realloc (params->objects_parents, (params->nrofobjects_parents+1) * sizeof(PTPObjectParent));
+	if (!p)
+		return NULL;
+	params->objects_parents = p;
+	memmove (&p[lo+1], &p[lo], (params->nrofobjects_parents-lo) * sizeof(PTPObjectParent));
+	params->nrofobjects_parents++;
+	p = &p[lo];
+	p->parent	= parent;
+	p->slots	= NULL;
+	p->nrofchildren	= 0;
+	p->alloced	= 0;
+	p->order	= PTP_CHILDREN_BYSLOT;
+	return p;
+}
+
+/* File the object in a slot into the run of its parent */
+static uint16_t
+ptp_objects_children_add (PTPParams *params, unsigned int slot)
+{
+	PTPObject	*ob = &params->objects[slot];
+	PTPObjectParent	*p;
+	unsigned int	lo = 0, hi;
+
+	p = ptp_objects_children_run (params, ob->oi.ParentObject, 1);
+	if (!p)
+		return PTP_RC_GeneralError;
+	if (p->nrofchildren == p->alloced) {
+		unsigned int	alloced = p->alloced ? p->alloced*2 : 4;
+		unsigned int	*slots = realloc (p->slots, alloced * sizeof(unsigned int));
+
+		if (!slots)
+			return PTP_RC_GeneralError;
+		p->slots	= slots;
+		p->alloced	= alloced;
+	}
+	hi = p->nrofchildren;
+	/* new objects are appended to the cache, so usually go last */
+	if (p->order == PTP_CHILDREN_UNORDERED ||
+	    (hi && ptp_objects_child_slotcmp (params, slot, p->slots[hi-1], p->order) > 0))
+		lo = hi;
+	while (lo < hi) {
+		unsigned int	mid = lo + (hi - lo) / 2;
+
+		if (ptp_objects_child_slotcmp (params, slot, p->slots[mid], p->order) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	memmove (&p->slots[lo+1], &p->slots[lo], (p->nrofchildren-lo) * sizeof(unsigned int));
+	p->slots[lo] = slot;
+	p->nrofchildren++;
+	ob->childof = ob->oi.ParentObject;
+	ob->flags |= PTPOBJECT_CHILD_INDEXED;
+	return PTP_RC_OK;
+}
+
+/* Take the object in a slot out of the run it is filed in */
+static void
+ptp_objects_children_del (PTPParams *params, unsigned int slot)
+{
+	PTPObject	*ob = &params->objects[slot];
+	PTPObjectParent	*p;
+	unsigned int	i;
+
+	if (!(ob->flags & PTPOBJECT_CHILD_INDEXED))
+		return;
+	ob->flags &= ~PTPOBJECT_CHILD_INDEXED;
+	p = ptp_objects_children_run (params, ob->childof, 0);
+	if (!p)
+		return;
+	if (p->order == PTP_CHILDREN_BYSLOT) {
+		unsigned int	lo = 0, hi = p->nrofchildren;
+
+		while (lo < hi) {
+			unsigned int	mid = lo + (hi - lo) / 2;
+
+			if (p->slots[mid] < slot)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		i = lo;
+	} else {
+		/* the name it was filed under may have changed since */
+		for (i=0;i<p->nrofchildren && p->slots[i] != slot;i++)
+			;
+	}
+	if (i == p->nrofchildren || p->slots[i] != slot)
+		return;
+	memmove (&p->slots[i], &p->slots[i+1], (p->nrofchildren-i-1) * sizeof(unsigned int));
+	p->nrofchildren--;
+}
+
+/*
+ * Turn the slots in the runs into handles before the cache array is
+ * rearranged, and back into slots afterwards.
+ */
+static void
+ptp_objects_children_renumber (PTPParams *params, int toslots)
+{
+	unsigned int	i, j;
+
+	for (i=0;i<params->nrofobjects_parents;i++) {
+		PTPObjectParent	*p = &params->objects_parents[i];
+
+		for (j=0;j<p->nrofchildren;j++) {
+			PTPObject	*ob;
+
+			if (!toslots) {
+				p->slots[j] = params->objects[p->slots[j]].oid;
+				continue;
+			}
+			if (ptp_object_find (params, p->slots[j], &ob) != PTP_RC_OK) {
+				/* cannot happen, but rather rebuild than hand out a bad slot */
+				ptp_objects_children_free (params);
+				return;
+			}
+			p->slots[j] = ob - params->objects;
+		}
+	}
+}
+
+static uint16_t
+ptp_objects_children_build (PTPParams *params)
+{
+	PTPObjectChild	*tmp;
+	unsigned int	i, j, n = 0;
+
+	ptp_objects_children_free (params);
+	tmp = malloc ((params->nrofobjects ? params->nrofobjects : 1) * sizeof(PTPObjectChild));
+	if (!tmp)
+		return PTP_RC_GeneralError;
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject *ob = &params->objects[i];
+
+		if (PTPOBJECT_REMOVED(ob))
+			continue;
+		if (!PTPOBJECT_PARENT_KNOWN(ob)) {
+			/* filed once its parent is known */
+			ob->flags |= PTPOBJECT_CHILD_PENDING;
+			continue;
+		}
+		tmp[n].key	= ob->oi.ParentObject;
+		tmp[n].slot	= i;
+		tmp[n].name	= NULL;
+		n++;
+	}
+	qsort (tmp, n, sizeof(tmp[0]), ptp_objects_child_cmp);
+
+	/* a non-NULL objects_parents marks the index as built */
+	params->objects_parents = malloc (sizeof(PTPObjectParent));
+	if (!params->objects_parents)
+		goto fail;
+	for (i=0;i<n;i=j) {
+		PTPObjectParent *p;
+
+		for (j=i;j<n && tmp[j].key == tmp[i].key;j++)
+			;
+		/* keys come in ascending order, so this appends */
+		p = ptp_objects_children_run (params, tmp[i].key, 1);
+		if (!p)
+			goto fail;
+		p->slots = malloc ((j-i) * sizeof(unsigned int));
+		if (!p->slots)
+			goto fail;
+		p->nrofchildren = p->alloced = j-i;
+		for (;i<j;i++) {
+			PTPObject *ob = &params->objects[tmp[i].slot];
+
+			p->slots[p->nrofchildren-(j-i)] = tmp[i].slot;
+			ob->childof = tmp[i].key;
+			ob->flags |= PTPOBJECT_CHILD_INDEXED;
+		}
+	}
+	free (tmp);
+
+	/* queue up the objects whose parent is not known yet */
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject *ob = &params->objects[i];
+
+		if (!(ob->flags & PTPOBJECT_CHILD_PENDING))
+			continue;
+		ob->flags &= ~PTPOBJECT_CHILD_PENDING;
+		ptp_object_changed (params, ob);
+	}
+	return PTP_RC_OK;
+fail:
+	ptp_objects_children_free (params);
+	free (tmp);
+	return PTP_RC_GeneralError;
+}
+
+/**
+ * ptp_object_changed:
+ * params:	PTPParams*
+ *		ob			- the cached object
+ *
+ * Notes that a cached object was added, or that its parent or file name
+ * changed, so that the index of children by parent files it anew when
+ * next asked. Call this after changing either of them in place.
+ **/
+void
+ptp_object_changed (PTPParams *params, PTPObject *ob)
+{
+	if (!params->objects_parents || (ob->flags & PTPOBJECT_CHILD_PENDING))
+		return;
+	if (params->nrofobjects_pending == params->objects_pendingsize) {
+		unsigned int	size = params->objects_pendingsize ? params->objects_pendingsize*2 : 64;
+		uint32_t	*pending = realloc (params->objects_pending, size * sizeof(uint32_t));
+
+		if (!pending) {
+			/* the index is built anew when next asked */
+			ptp_objects_children_free (params);
+			return;
+		}
+		params->objects_pending		= pending;
+		params->objects_pendingsize	= size;
+	}
+	params->objects_pending[params->nrofobjects_pending++] = ob->oid;
+	ob->flags |= PTPOBJECT_CHILD_PENDING;
+}
+
+/* File the pending objects, keeping back those whose parent is not known yet */
+static uint16_t
+ptp_objects_children_update (PTPParams *params)
+{
+	unsigned int	i, n = 0;
+	PTPObject	*ob;
+
+	/* take them all out first, so that the runs are in order to insert into */
+	for (i=0;i<params->nrofobjects_pending;i++) {
+		/* gone since, or queued twice after being removed and added again */
+		if (ptp_object_find (params, params->objects_pending[i], &ob) != PTP_RC_OK)
+			continue;
+		if (!(ob->flags & PTPOBJECT_CHILD_PENDING))
+			continue;
+		ptp_objects_children_del (params, ob - params->objects);
+		params->objects_pending[n++] = ob->oid;
+		ob->flags &= ~PTPOBJECT_CHILD_PENDING;
+	}
+	params->nrofobjects_pending = n;
+	for (i=n=0;i<params->nrofobjects_pending;i++) {
+		ptp_object_find (params, params->objects_pending[i], &ob);
+		if (!PTPOBJECT_PARENT_KNOWN(ob)) {
+			params->objects_pending[n++] = ob->oid;
+			ob->flags |= PTPOBJECT_CHILD_PENDING;
+			continue;
+		}
+		CHECK_PTP_RC(ptp_objects_children_add (params, ob - params->objects));
+	}
+	params->nrofobjects_pending = n;
+	return PTP_RC_OK;
+}
+
+/* Put one parent's run of children in the requested order */
+static uint16_t
+ptp_objects_children_order (PTPParams *params, PTPObjectParent *p, int order)
+{
+	PTPObjectChild	*tmp;
+	unsigned int	i;
+
+	if (p->order == order || p->nrofchildren < 2) {
+		p->order = order;
+		return PTP_RC_OK;
+	}
+	tmp = malloc (p->nrofchildren * sizeof(PTPObjectChild));
+	if (!tmp)
+		return PTP_RC_GeneralError;
+	for (i=0;i<p->nrofchildren;i++) {
+		tmp[i].key	= p->parent;
+		tmp[i].slot	= p->slots[i];
+		tmp[i].name	= params->objects[p->slots[i]].oi.Filename;
+	}
+	qsort (tmp, p->nrofchildren, sizeof(tmp[0]),
+	       (order == PTP_CHILDREN_BYNAME) ? ptp_objects_child_namecmp : ptp_objects_child_cmp);
+	for (i=0;i<p->nrofchildren;i++)
+		p->slots[i] = tmp[i].slot;
+	free (tmp);
+	p->order = order;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_object_children:
+ * params:	PTPParams*
+ *		parent			- handle of the parent, 0 for the root
+ *		byname			- sort the children by file name
+ *		slots			- pointer to the array slots of the children
+ *		nrofslots		- pointer to the number of children
+ *
+ * Looks up the cached children of a parent, without walking the whole
+ * cache. They are given as slots into params->objects, in cache order
+ * or by name. The slots point into the cache itself and are only good
+ * until the cache is next changed, so do not e.g. load more of the
+ * children while walking them. Children whose parent is not known yet
+ * are not found.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
 uint16_t
-ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
+ptp_object_children (PTPParams *params, uint32_t parent, int byname,
+		     unsigned int **slots, unsigned int *nrofslots)
+{
+	PTPObjectParent	*p;
+
+	*slots = NULL;
+	*nrofslots = 0;
+	if (!params->objects_parents || ptp_objects_children_update (params) != PTP_RC_OK)
+		CHECK_PTP_RC(ptp_objects_children_build (params));
+	p = ptp_objects_children_run (params, parent, 0);
+	if (!p)
+		return PTP_RC_OK;
+	CHECK_PTP_RC(ptp_objects_children_order (params, p,
+		byname ? PTP_CHILDREN_BYNAME : PTP_CHILDREN_BYSLOT));
+	*slots = p->slots;
+	*nrofslots = p->nrofchildren;
+	return PTP_RC_OK;
+}
+
+/*
+ * The strings of the cached objects repeat a lot across a device: file
+ * names like "Thumbs.db" or "cover.jpg", and above all the artist, album
+ * and genre properties of the tracks. They are kept just once in a
+ * refcounted hash table per PTPParams, so all objects sharing a string
+ * point to the same copy. Strings that could not be interned, e.g. for
+ * lack of memory, stay plain malloc()ed copies, which ptp_strrelease()
+ * tells apart by their address. Anything handed out to the application
+ * is still copied from here.
+ */
+#define PTP_STRINGS_MIN	256
+
+struct _PTPString {
+	unsigned int	refcount;
+	uint32_t	hash;
+	char		str[1];
+};
+
+/* FNV-1a */
+static uint32_t
+ptp_strings_hash (const char *str)
+{
+	uint32_t	h = 2166136261U;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+/* Returns the bucket holding str, or the empty one it would go to */
+static unsigned int
+ptp_strings_bucket (PTPParams *params, const char *str, uint32_t hash)
+{
+	unsigned int	mask = params->stringssize - 1;
+	unsigned int	i = hash & mask;
+
+	while (params->strings[i]) {
+		if ((params->strings[i]->hash == hash) && !strcmp (params->strings[i]->str, str))
+			break;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static int
+ptp_strings_grow (PTPParams *params)
+{
+	PTPString	**old = params->strings;
+	unsigned int	oldsize = params->stringssize, i;
+	unsigned int	size = oldsize ? oldsize*2 : PTP_STRINGS_MIN;
+
+	params->strings = calloc (size, sizeof(PTPString*));
+	if (!params->strings) {
+		params->strings = old;
+		return 0;
+	}
+	params->stringssize = size;
+	for (i=0;i<oldsize;i++)
+		if (old[i])
+			params->strings[ptp_strings_bucket (params, old[i]->str, old[i]->hash)] = old[i];
+	free (old);
+	return 1;
+}
+
+/**
+ * ptp_parse_datetime:
+ * str:		PTP DateTime string, like "20060727T191500"
+ *
+ * Return values: the time the string stands for, 0 if it cannot be
+ * parsed.
+ **/
+time_t
+ptp_parse_datetime (const char *str)
+{
+	return ptp_unpack_PTPTIME (str);
+}
+
+/**
+ * ptp_strintern:
+ * params:	PTPParams*
+ *		str			- string to intern
+ *
+ * Looks up str in the string table and takes another reference to it,
+ * or adds a copy of it. The result must only be read and is given back
+ * with ptp_strrelease().
+ *
+ * Return values: the shared copy of str, NULL if str is NULL or out of
+ * memory.
+ **/
+char *
+ptp_strintern (PTPParams *params, const char *str)
+{
+	PTPString	*s;
+	uint32_t	hash;
+	unsigned int	i;
+	size_t		len;
+
+	if (!str)
+		return NULL;
+	/* keep the table at most half full, and never completely full */
+	if (((params->nrofstrings+1)*2 > params->stringssize) &&
+	    !ptp_strings_grow (params) &&
+	    (params->nrofstrings+1 >= params->stringssize))
+		return strdup (str);
+	hash = ptp_strings_hash (str);
+	i = ptp_strings_bucket (params, str, hash);
+	if (params->strings[i]) {
+		params->strings[i]->refcount++;
+		return params->strings[i]->str;
+	}
+	len = strlen (str);
+	s = malloc (sizeof(PTPString) + len);
+	if (!s)
+		return NULL;
+	s->refcount = 1;
+	s->hash = hash;
+	memcpy (s->str, str, len+1);
+	params->strings[i] = s;
+	params->nrofstrings++;
+	return s->str;
+}
+
+/**
+ * ptp_strintern_take:
+ * params:	PTPParams*
+ *		str			- malloc()ed string
+ *
+ * Like ptp_strintern(), but consumes the caller's copy of the string,
+ * as decoded from a device response.
+ *
+ * Return values: the shared copy of str, or str itself if it could not
+ * be interned.
+ **/
+char *
+ptp_strintern_take (PTPParams *params, char *str)
+{
+	char	*interned;
+
+	if (!str)
+		return NULL;
+	interned = ptp_strintern (params, str);
+	if (!interned)
+		return str;
+	free (str);
+	return interned;
+}
+
+/**
+ * ptp_strrelease:
+ * params:	PTPParams*
+ *		str			- string from ptp_strintern()
+ *
+ * Drops a reference to an interned string and frees it along with the
+ * last one. A string that is not in the table is simply free()d.
+ **/
+void
+ptp_strrelease (PTPParams *params, char *str)
+{
+	PTPString	*s;
+	unsigned int	mask, i, j, k;
+
+	if (!str)
+		return;
+	if (params->stringssize) {
+		i = ptp_strings_bucket (params, str, ptp_strings_hash (str));
+		s = params->strings[i];
+		if (s && (s->str == str)) {
+			if (--s->refcount)
+				return;
+			free (s);
+			params->nrofstrings--;
+			/* empty the bucket, moving up the entries probed past it */
+			mask = params->stringssize - 1;
+			params->strings[i] = NULL;
+			j = i;
+			while (1) {
+				j = (j + 1) & mask;
+				if (!params->strings[j])
+					break;
+				k = params->strings[j]->hash & mask;
+				if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+					continue;
+				params->strings[i] = params->strings[j];
+				params->strings[j] = NULL;
+				i = j;
+			}
+			return;
+		}
+	}
+	free (str);
+}
+
+/* Free the string table, along with any strings still in it */
+void
+ptp_strings_free (PTPParams *params)
 {
 	unsigned int i;
+
+	for (i=0;i<params->stringssize;i++)
+		free (params->strings[i]);
+	free (params->strings);
+	params->strings		= NULL;
+	params->nrofstrings	= 0;
+	params->stringssize	= 0;
+}
+
+/*
+ * Property lists that are filled in bulk, as by a GetObjPropList of all
+ * objects, are carved out of large blocks instead of being allocated per
+ * object. The blocks grow geometrically. Each counts the entries still
+ * in use, a block is released when its last slice is, or reused from
+ * the start if it is the newest one. Objects holding such a slice are
+ * marked PTPOBJECT_MTPPROPS_ARENA.
+ */
+#define PTP_PROPARENA_MIN	1024
+#define PTP_PROPARENA_MAX	65536
+
+struct _PTPPropArena {
+	PTPPropArena	*next;
+	unsigned int	used, size;
+	unsigned int	live;	/* entries not released yet */
+	MTPProperties	*props;
+};
+
+static MTPProperties *
+ptp_proparena_alloc (PTPParams *params, unsigned int n)
+{
+	PTPPropArena	*block = params->mtpprops_arena;
+
+	if (!block || block->size - block->used < n) {
+		unsigned int size = block ? block->size*2 : PTP_PROPARENA_MIN;
+
+		if (size > PTP_PROPARENA_MAX)
+			size = PTP_PROPARENA_MAX;
+		if (size < n)
+			size = n;
+		block = malloc (sizeof(PTPPropArena) + size*sizeof(MTPProperties));
+		if (!block)
+			return NULL;
+		block->props = (MTPProperties*)(block+1);
+		block->used = 0;
+		block->live = 0;
+		block->size = size;
+		block->next = params->mtpprops_arena;
+		params->mtpprops_arena = block;
+	}
+	block->used += n;
+	block->live += n;
+	return &block->props[block->used - n];
+}
+
+/* Gives back the slice of an object, e.g. one that left the cache */
+static void
+ptp_proparena_release (PTPParams *params, MTPProperties *props, unsigned int n)
+{
+	PTPPropArena	**pblock, *block;
+
+	for (pblock = &params->mtpprops_arena; (block = *pblock); pblock = &block->next) {
+		if (props < block->props || props >= block->props + block->size)
+			continue;
+		block->live -= n;
+		if (block->live)
+			return;
+		if (block == params->mtpprops_arena) {
+			block->used = 0;
+		} else {
+			*pblock = block->next;
+			free (block);
+		}
+		return;
+	}
+}
+
+static void
+ptp_proparena_free (PTPParams *params)
+{
+	while (params->mtpprops_arena) {
+		PTPPropArena *next = params->mtpprops_arena->next;
+
+		free (params->mtpprops_arena);
+		params->mtpprops_arena = next;
+	}
+}
+
+/**
+ * ptp_object_new_mtpprop:
+ * params:	PTPParams*
+ *		ob			- cached object
+ *
+ * Appends an entry to the property list of a cached object and returns
+ * it, to be filled in by the caller. As long as the properties of an
+ * object are added in one run, the list is a slice of the property
+ * arena and growing it costs no allocation.
+ *
+ * Return values: the new entry, NULL if out of memory.
+ **/
+MTPProperties *
+ptp_object_new_mtpprop (PTPParams *params, PTPObject *ob)
+{
+	PTPPropArena	*block = params->mtpprops_arena;
+	MTPProperties	*props;
+
+	if (ob->flags & PTPOBJECT_MTPPROPS_ARENA) {
+		/* the common case, the list is the tail of the current block */
+		if (block && block->used < block->size &&
+		    ob->mtpprops + ob->nrofmtpprops == block->props + block->used) {
+			block->used++;
+			block->live++;
+			return &ob->mtpprops[ob->nrofmtpprops++];
+		}
+		/* interleaved with another object, give it a list of its own */
+		props = malloc ((ob->nrofmtpprops+1)*sizeof(MTPProperties));
+		if (!props)
+			return NULL;
+		memcpy (props, ob->mtpprops, ob->nrofmtpprops*sizeof(MTPProperties));
+		ptp_proparena_release (params, ob->mtpprops, ob->nrofmtpprops);
+		ob->mtpprops = props;
+		ob->flags &= ~PTPOBJECT_MTPPROPS_ARENA;
+		return &ob->mtpprops[ob->nrofmtpprops++];
+	}
+	if (ob->nrofmtpprops) {
+		props = realloc (ob->mtpprops, (ob->nrofmtpprops+1)*sizeof(MTPProperties));
+		if (!props)
+			return NULL;
+		ob->mtpprops = props;
+		return &ob->mtpprops[ob->nrofmtpprops++];
+	}
+	props = ptp_proparena_alloc (params, 1);
+	if (!props)
+		return NULL;
+	ob->mtpprops = props;
+	ob->nrofmtpprops = 1;
+	ob->flags |= PTPOBJECT_MTPPROPS_ARENA;
+	return props;
+}
+
+/* Empty the object cache */
+void
+ptp_objects_free (PTPParams *params)
+{
+	unsigned int i;
+
+	for (i=0;i<params->nrofobjects;i++)
+		ptp_free_object (params, &params->objects[i]);
+	free (params->objects);
+	params->objects			= NULL;
+	params->nrofobjects		= 0;
+	params->nrofremovedobjects	= 0;
+	params->objects_alloced		= 0;
+	free (params->objects_index);
+	params->objects_index		= NULL;
+	params->objects_indexsize	= 0;
+	ptp_objects_children_free (params);
+	ptp_proparena_free (params);
+}
+
+/* Squeeze out the tombstones, keeping the order of the objects */
+static void
+ptp_objects_compact (PTPParams *params)
+{
+	unsigned int i, j;
+
+	if (!params->nrofremovedobjects)
+		return;
+	ptp_objects_children_renumber (params, 0);
+	for (i=j=0;i<params->nrofobjects;i++) {
+		if (!params->objects[i].oid)
+			continue;
+		if (i != j)
+			params->objects[j] = params->objects[i];
+		j++;
+	}
+	params->nrofobjects = j;
+	params->nrofremovedobjects = 0;
+	ptp_objects_index_rebuild (params);
+	ptp_objects_children_renumber (params, 1);
+}
+
+/* Turn a cached object into a tombstone */
+static uint16_t
+ptp_objects_tombstone (PTPParams *params, uint32_t handle)
+{
 	PTPObject	*ob;
 
 	CHECK_PTP_RC(ptp_object_find (params, handle, &ob));
-	i = ob-params->objects;
+	if (params->objects_index)
+		ptp_objects_index_del (params, ptp_objects_index_find (params, handle));
+	ptp_objects_children_del (params, ob - params->objects);
 	/* remove object from object info cache */
-	ptp_free_object (ob);
+	ptp_free_object (params, ob);
+	memset (ob, 0, sizeof(PTPObject));
+	params->nrofremovedobjects++;
+	return PTP_RC_OK;
+}
 
-	if (i < params->nrofobjects-1)
-		memmove (ob,ob+1,(params->nrofobjects-1-i)*sizeof(PTPObject));
-	params->nrofobjects--;
-	/* We use less memory than before so this shouldn't fail */
-	params->objects = realloc(params->objects, sizeof(PTPObject)*params->nrofobjects);
+uint16_t
+ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
+{
+	CHECK_PTP_RC(ptp_objects_tombstone (params, handle));
+	if (params->nrofremovedobjects*2 > params->nrofobjects)
+		ptp_objects_compact (params);
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_remove_objects_from_cache:
+ * params:	PTPParams*
+ *		handles			- handles of the objects to remove
+ *		nrofhandles		- number of handles
+ *
+ * Removes a batch of objects from the object cache, e.g. the contents
+ * of a deleted folder. Like ptp_remove_object_from_cache() the cache
+ * may be compacted, but at most once, at the end. Handles that are not
+ * cached are skipped.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_remove_objects_from_cache(PTPParams *params, uint32_t *handles, unsigned int nrofhandles)
+{
+	unsigned int i;
+
+	for (i=0;i<nrofhandles;i++)
+		ptp_objects_tombstone (params, handles[i]);
+	if (params->nrofremovedobjects*2 > params->nrofobjects)
+		ptp_objects_compact (params);
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_remove_storage_from_cache:
+ * params:	PTPParams*
+ *		storage			- StorageID
+ *
+ * Removes all cached objects of one storage, e.g. one that went away,
+ * leaving those of the other storages alone. Objects whose storage is
+ * not known yet are kept.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_remove_storage_from_cache(PTPParams *params, uint32_t storage)
+{
+	unsigned int i;
+
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject *ob = &params->objects[i];
+
+		if (PTPOBJECT_REMOVED(ob))
+			continue;
+		if (!(ob->flags & (PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_OBJECTINFO_LOADED)))
+			continue;
+		if (ob->oi.StorageID == storage)
+			ptp_objects_tombstone (params, ob->oid);
+	}
+	ptp_objects_compact (params);
 	return PTP_RC_OK;
 }
 
@@ -8850,85 +10280,73 @@ static int _cmp_ob (const void *a, const void *b)
 	return 0;
 }
 
+/* Sort the objects by handle, e.g. to list them in a stable order */
 void
 ptp_objects_sort (PTPParams *params)
 {
+	unsigned int i;
+
+	ptp_objects_compact (params);
+	ptp_objects_children_renumber (params, 0);
 	qsort (params->objects, params->nrofobjects, sizeof(PTPObject), _cmp_ob);
+	ptp_objects_index_rebuild (params);
+	ptp_objects_children_renumber (params, 1);
+	/* the runs, even by name for equal names, are sorted again when next asked */
+	for (i=0;i<params->nrofobjects_parents;i++)
+		params->objects_parents[i].order = PTP_CHILDREN_UNORDERED;
 }
 
-/* Binary search in objects. Needs "objects" to be a sorted by objectid list!  */
+/* Hash lookup in objects. */
 uint16_t
 ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob)
 {
-	PTPObject	tmpob;
+	unsigned int	i;
+	int		bucket;
 
-	tmpob.oid = handle;
-	*retob = bsearch (&tmpob, params->objects, params->nrofobjects, sizeof(tmpob), _cmp_ob);
-	if (!*retob)
+	*retob = NULL;
+	if (!handle)	/* the tombstones */
+		return PTP_RC_GeneralError;
+	if (!params->objects_index) {
+		for (i=0;i<params->nrofobjects;i++)
+			if (params->objects[i].oid == handle) {
+				*retob = &params->objects[i];
+				return PTP_RC_OK;
+			}
+		return PTP_RC_GeneralError;
+	}
+	bucket = ptp_objects_index_find (params, handle);
+	if (bucket < 0)
 		return PTP_RC_GeneralError;
+	*retob = &params->objects[params->objects_index[bucket]-1];
 	return PTP_RC_OK;
 }
 
-/* Binary search in objects + insert of not found. Needs "objects" to be a sorted by objectid list!  */
+/* Hash lookup in objects + append if not found. */
 uint16_t
 ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob)
 {
-	unsigned int 	begin, end, cursor;
-	unsigned int	insertat;
 	PTPObject	*newobs;
 
 	if (!handle) return PTP_RC_GeneralError;
-	*retob = NULL;
-	if (!params->nrofobjects) {
-		params->objects = calloc(1,sizeof(PTPObject));
-		params->nrofobjects = 1;
-		params->objects[0].oid = handle;
-		*retob = &params->objects[0];
-		return PTP_RC_OK;
-	}
-	begin = 0;
-	end = params->nrofobjects-1;
-	/*ptp_debug (params, "searching %08x, total=%d", handle, params->nrofobjects);*/
-	while (1) {
-		cursor = (end-begin)/2+begin;
-		/*ptp_debug (params, "ob %d: %08x [%d-%d]", cursor, params->objects[cursor].oid, begin, end);*/
-		if (params->objects[cursor].oid == handle) {
-			*retob = &params->objects[cursor];
-			return PTP_RC_OK;
-		}
-		if (params->objects[cursor].oid < handle)
-			begin = cursor;
-		else
-			end = cursor;
-		if ((end - begin) <= 1)
-			break;
-	}
-	if (params->objects[begin].oid == handle) {
-		*retob = &params->objects[begin];
-		return PTP_RC_OK;
-	}
-	if (params->objects[end].oid == handle) {
-		*retob = &params->objects[end];
+	if (ptp_object_find (params, handle, retob) == PTP_RC_OK)
 		return PTP_RC_OK;
+	if (params->nrofobjects == params->objects_alloced) {
+		unsigned int alloced = params->objects_alloced ? params->objects_alloced*2 : PTP_OBJECTS_MIN;
+
+		newobs = realloc (params->objects, sizeof(PTPObject)*alloced);
+		if (!newobs) return PTP_RC_GeneralError;
+		params->objects = newobs;
+		params->objects_alloced = alloced;
 	}
-	if ((begin == 0) && (handle < params->objects[0].oid)) {
-		insertat=begin;
-	} else {
-		if ((end == params->nrofobjects-1) && (handle > params->objects[end].oid))
-			insertat=end+1;
-		else
-			insertat=begin+1;
-	}
-	/*ptp_debug (params, "inserting oid %x at [%x,%x], begin=%d, end=%d, insertat=%d\n", handle, params->objects[begin].oid, params->objects[end].oid, begin, end, insertat);*/
-	newobs = realloc (params->objects, sizeof(PTPObject)*(params->nrofobjects+1));
-	if (!newobs) return PTP_RC_GeneralError;
-	params->objects = newobs;
-	if (insertat<params->nrofobjects)
-		memmove (&params->objects[insertat+1],&params->objects[insertat],(params->nrofobjects-insertat)*sizeof(PTPObject));
-	memset(&params->objects[insertat],0,sizeof(PTPObject));
-	params->objects[insertat].oid = handle;
-	*retob = &params->objects[insertat];
+	memset(&params->objects[params->nrofobjects],0,sizeof(PTPObject));
+	params->objects[params->nrofobjects].oid = handle;
+	*retob = &params->objects[params->nrofobjects];
 	params->nrofobjects++;
+	if (!params->objects_index || params->nrofobjects*2 > params->objects_indexsize)
+		ptp_objects_index_rebuild (params); /* if this fails, we scan */
+	else
+		ptp_objects_index_put (params, params->nrofobjects-1);
+	ptp_object_changed (params, *retob);
 	return PTP_RC_OK;
 }
 
@@ -8953,6 +10371,8 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 	/* Do we have all of it already? */
 	if ((ob->flags & want) == want)
 		return PTP_RC_OK;
+	/* whatever is loaded now may give it another parent or name */
+	ptp_object_changed (params, ob);
 
 #define X (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)
 	if ((want & X) && ((ob->flags & X) != X)) {
@@ -8962,13 +10382,19 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED)
 			saveparent = ob->oi.ParentObject;
 
+		ptp_strrelease (params, ob->oi.Filename); ob->oi.Filename = NULL;
+		ptp_strrelease (params, ob->oi.Keywords); ob->oi.Keywords = NULL;
 		ret = ptp_getobjectinfo (params, handle, &ob->oi);
 		if (ret != PTP_RC_OK) {
 			/* kill it from the internal list ... */
 			ptp_remove_object_from_cache(params, handle);
 			return ret;
 		}
-		if (!ob->oi.Filename) ob->oi.Filename=strdup("<none>");
+		if (ob->oi.Filename)
+			ob->oi.Filename = ptp_strintern_take (params, ob->oi.Filename);
+		else
+			ob->oi.Filename = ptp_strintern (params, "<none>");
+		ob->oi.Keywords = ptp_strintern_take (params, ob->oi.Keywords);
 		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED) {
 			if (ob->oi.ParentObject != saveparent)
 				ptp_debug (params, "saved parent %08x is not the same as read via getobjectinfo %08x", ob->oi.ParentObject, saveparent);
@@ -9031,6 +10457,7 @@ read64bit:		;
 	) {
 		int		nrofprops = 0;
 		MTPProperties 	*props = NULL;
+		unsigned int	i;
 
 		if (params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST) {
 			want &= ~PTPOBJECT_MTPPROPLIST_LOADED;
@@ -9047,12 +10474,15 @@ read64bit:		;
 		ret = ptp_mtp_getobjectproplist_single (params, handle, &props, &nrofprops);
 		if (ret != PTP_RC_OK)
 			goto fallback;
+		ptp_free_object_mtpprops (params, ob);
 		ob->mtpprops = props;
 		ob->nrofmtpprops = nrofprops;
+		for (i=0;i<ob->nrofmtpprops;i++)
+			if (props[i].datatype == PTP_DTC_STR)
+				props[i].propval.str = ptp_strintern_take (params, props[i].propval.str);
 
 		/* Override the ObjectInfo data with data from properties */
 		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI) {
-			unsigned int i;
 			MTPProperties *prop = ob->mtpprops;
 
 			for (i=0;i<ob->nrofmtpprops;i++,prop++) {
@@ -9084,8 +10514,8 @@ read64bit:		;
 					break;
 				case PTP_OPC_ObjectFileName:
 					if (prop->propval.str) {
-						free(ob->oi.Filename);
-						ob->oi.Filename = strdup(prop->propval.str);
+						ptp_strrelease(params, ob->oi.Filename);
+						ob->oi.Filename = ptp_strintern(params, prop->propval.str);
 					}
 					break;
 				case PTP_OPC_DateCreated:
@@ -9096,8 +10526,8 @@ read64bit:		;
 					break;
 				case PTP_OPC_Keywords:
 					if (prop->propval.str) {
-						free(ob->oi.Keywords);
-						ob->oi.Keywords = strdup(prop->propval.str);
+						ptp_strrelease(params, ob->oi.Keywords);
+						ob->oi.Keywords = ptp_strintern(params, prop->propval.str);
 					}
 					break;
 				case PTP_OPC_ParentObject:
@@ -3513,6 +3513,9 @@ typedef struct _PTPCanonEOSDeviceInfo {
 /* Glue stuff starts here */
 
 typedef struct _PTPParams PTPParams;
+typedef struct _PTPPropArena PTPPropArena;
+typedef struct _PTPString PTPString;
+typedef struct _PTPObjectParent PTPObjectParent;
 
 
 typedef uint16_t (* PTPDataGetFunc)	(PTPParams* params, void*priv,
@@ -3522,12 +3525,41 @@ typedef uint16_t (* PTPDataGetFunc)	(PTPParams* params, void*priv,
 typedef uint16_t (* PTPDataPutFunc)	(PTPParams* params, void*priv,
 					unsigned long sendlen,
 	                                unsigned char *data);
+/*
+ * Optional zero-copy receive interface: borrowfunc hands out a buffer
+ * of at least wantlen bytes right after the data received so far, the
+ * transport reads straight into it and then calls commitfunc with the
+ * number of bytes that actually arrived. The buffer stays valid until
+ * the next call into the handler. Handlers that cannot lend out their
+ * storage set both to NULL and only get putfunc calls.
+ *
+ * A borrowfunc call that is never committed just reserves room, this
+ * is how the transport presizes a handler for the announced length of
+ * a data phase.
+ */
+typedef uint16_t (* PTPDataBorrowFunc)	(PTPParams* params, void*priv,
+					 unsigned long wantlen,
+					 unsigned char **data);
+typedef uint16_t (* PTPDataCommitFunc)	(PTPParams* params, void*priv,
+					 unsigned long len);
+
 typedef struct _PTPDataHandler {
 	PTPDataGetFunc		getfunc;
 	PTPDataPutFunc		putfunc;
+	PTPDataBorrowFunc	borrowfunc;
+	PTPDataCommitFunc	commitfunc;
 	void			*priv;
 } PTPDataHandler;
 
+/*
+ * Receives the records of a streamed MTP object property list one by
+ * one, see ptp_mtp_getobjectproplist_stream(). The callee takes over
+ * whatever prop->propval points to. Returning anything but PTP_RC_OK
+ * aborts the transfer.
+ */
+typedef uint16_t (* PTPOPLRecordFunc)	(PTPParams* params, void *priv,
+					 MTPProperties *prop);
+
 /*
  * This functions take PTP oriented arguments and send them over an
  * appropriate data layer doing byteorder conversion accordingly.
@@ -3563,11 +3595,17 @@ struct _PTPObject {
 #define PTPOBJECT_DIRECTORY_LOADED	(1<<3)
 #define PTPOBJECT_PARENTOBJECT_LOADED	(1<<4)
 #define PTPOBJECT_STORAGEID_LOADED	(1<<5)
+#define PTPOBJECT_MTPPROPS_ARENA	(1<<6)	/* mtpprops is a slice of the property arena */
+#define PTPOBJECT_CHILD_INDEXED		(1<<7)	/* filed under childof in the parent index */
+#define PTPOBJECT_CHILD_PENDING		(1<<8)	/* queued to be filed anew in the parent index */
+/* Removed objects stay in the cache as tombstones until it is compacted */
+#define PTPOBJECT_REMOVED(ob)		((ob)->oid == 0)
 
 	PTPObjectInfo	oi;
 	uint32_t	canon_flags;
 	MTPProperties	*mtpprops;
 	unsigned int	nrofmtpprops;
+	uint32_t	childof;	/* parent it is indexed under, see ptp.c */
 };
 typedef struct _PTPObject PTPObject;
 
@@ -3589,6 +3627,7 @@ struct _MTPObjectFormat {
 	uint16_t	ofc;
 	unsigned int	nrofpds;
 	MTPPropertyDesc	*pds;
+	int		allpds;	/* pds are all the supported properties */
 };
 typedef struct _MTPObjectFormat MTPObjectFormat;
 
@@ -3641,7 +3680,20 @@ struct _PTPParams {
 
 	/* PTP: internal structures used by ptp driver */
 	PTPObject	*objects;
-	unsigned int	nrofobjects;
+	unsigned int	nrofobjects;		/* including removed ones */
+	unsigned int	nrofremovedobjects;
+	unsigned int	objects_alloced;
+	unsigned int	*objects_index;		/* handle hash, see ptp.c */
+	unsigned int	objects_indexsize;
+	PTPObjectParent	*objects_parents;	/* parent index, see ptp.c */
+	unsigned int	nrofobjects_parents;
+	uint32_t	*objects_pending;	/* handles to file anew */
+	unsigned int	nrofobjects_pending;
+	unsigned int	objects_pendingsize;
+	PTPPropArena	*mtpprops_arena;	/* newest block first */
+	PTPString	**strings;		/* interned cache strings */
+	unsigned int	nrofstrings;
+	unsigned int	stringssize;
 
 	PTPDeviceInfo	deviceinfo;
 
@@ -3649,6 +3701,23 @@ struct _PTPParams {
 	PTPContainer	*events;
 	unsigned int	nrofevents;
 
+	/* libmtp: object events not yet applied to the object cache */
+	int		cache_events_enabled;
+	PTPContainer	*cache_events;
+	unsigned int	nrofcache_events;
+	/* libmtp: inside the libusb callback of an asynchronous event read */
+	int		in_event_callback;
+
+	/* libmtp: the object cache is filled one folder at a time */
+	int		objects_lazy;
+	/* libmtp: which ways of listing objects failed or worked */
+	int		listing_flags;
+	/* libmtp: most objects a SetObjPropList may carry, 0 if no limit seen */
+	unsigned int	proplist_maxobjects;
+
+	/* Nesting depth of ptp_transaction_new() */
+	int		in_transaction;
+
 	/* Capture count for SDRAM capture style images */
 	unsigned int		capcnt;
 
@@ -3714,6 +3783,13 @@ struct _PTPParams {
 	 */
 	uint8_t		*response_packet;
 	uint16_t	response_packet_size;
+
+	/* Statistics of the memory receive handler: number of buffer
+	 * (re)allocations, bytes allocated by them and the largest buffer.
+	 */
+	uint64_t	recv_allocs;
+	uint64_t	recv_alloc_bytes;
+	uint64_t	recv_alloc_peak;
 };
 
 /* Asynchronous event callback */
@@ -3938,6 +4014,9 @@ uint16_t ptp_mtp_getobjectproplist_generic (PTPParams* params, uint32_t handle,
 uint16_t ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t level, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
+uint16_t ptp_mtp_getobjectproplist_stream (PTPParams* params, uint32_t handle, PTPOPLRecordFunc recordfunc, void *priv, int *nrofprops);
+uint16_t ptp_mtp_getobjectproplist_stream_level (PTPParams* params, uint32_t handle, uint32_t level, PTPOPLRecordFunc recordfunc, void *priv, int *nrofprops);
+uint16_t ptp_mtp_getobjectproplist_stream_generic (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, PTPOPLRecordFunc recordfunc, void *priv, int *nrofprops);
 uint16_t ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 				     uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops);
 uint16_t ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops);
@@ -4572,7 +4651,7 @@ void ptp_free_objectpropdesc	(PTPObjectPropDesc*);
 void ptp_free_devicepropdesc	(PTPDevicePropDesc*);
 void ptp_free_devicepropvalue	(uint16_t, PTPPropertyValue*);
 void ptp_free_objectinfo	(PTPObjectInfo *oi);
-void ptp_free_object		(PTPObject *oi);
+void ptp_free_object		(PTPParams *params, PTPObject *ob);
 
 const char *ptp_strerror	(uint16_t ret, uint16_t vendor);
 void ptp_debug			(PTPParams *params, const char *format, ...);
@@ -4593,13 +4672,32 @@ MTPProperties *ptp_get_new_object_prop_entry(MTPProperties **props, int *nrofpro
 void ptp_destroy_object_prop(MTPProperties *prop);
 void ptp_destroy_object_prop_list(MTPProperties *props, int nrofprops);
 MTPProperties *ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t const attribute_id);
+/*
+ * Removing objects leaves tombstones in params->objects, see
+ * PTPOBJECT_REMOVED(). Once they make up half of the array it is
+ * compacted, which moves the remaining objects, so do not keep
+ * PTPObject pointers or array slots across these calls.
+ */
 uint16_t ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
+uint16_t ptp_remove_objects_from_cache(PTPParams *params, uint32_t *handles, unsigned int nrofhandles);
+uint16_t ptp_remove_storage_from_cache(PTPParams *params, uint32_t storage);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_object_want (PTPParams *, uint32_t handle, unsigned int want, PTPObject**retob);
 void ptp_objects_sort (PTPParams *);
+uint16_t ptp_object_children (PTPParams *, uint32_t parent, int byname, unsigned int **slots, unsigned int *nrofslots);
+void ptp_object_changed (PTPParams *params, PTPObject *ob);
+void ptp_objects_free (PTPParams *);
 uint16_t ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob);
+MTPProperties *ptp_object_new_mtpprop (PTPParams *params, PTPObject *ob);
+void ptp_free_object_mtpprops (PTPParams *params, PTPObject *ob);
+time_t ptp_parse_datetime (const char *str);
+char *ptp_strintern (PTPParams *params, const char *str);
+char *ptp_strintern_take (PTPParams *params, char *str);
+void ptp_strrelease (PTPParams *params, char *str);
+void ptp_strings_free (PTPParams *params);
 uint16_t ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle);
+uint16_t ptp_list_storage_manifest (PTPParams *params, uint32_t storage, uint32_t *numobs);
 /* ptpip.c */
 void ptp_nikon_getptpipguid (unsigned char* guid);
 